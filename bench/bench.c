@@ -0,0 +1,416 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../include/network.h"
+#include "../include/peers.h"
+#include "../include/discovery.h"
+#include "../include/offers.h"
+#include "../include/conn_pool.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+/*
+ * Headless benchmark for `make bench`. Runs the real network stack
+ * without ncurses and talks to itself over loopback: text messages go
+ * through send_text_message() as fast as it returns and come back through
+ * the reactor, so latency includes any queueing behind the burst; files go
+ * through send_file() and are accepted as soon as they are offered.
+ * Discovery is timed against a second copy of this binary started as a
+ * beacon peer. Results are printed to stdout as one JSON object; progress
+ * goes to stderr.
+ */
+#define BENCH_PORT 47100
+#define BENCH_MESSAGES 20000
+#define BENCH_WARMUP 200
+#define BENCH_WAIT_SECONDS 30
+#define BENCH_PEER_NAME "bench-peer"
+
+static int wake_fd = -1;
+static int verbose = 0;
+
+// Filled by the drain thread
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bench_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t *latencies = NULL;      // Nanoseconds, by message number
+static int message_total = 0;
+static int messages_received = 0;
+static int warmups_received = 0;
+static uint64_t last_receive_ns = 0;
+static int files_received = 0;
+static int files_failed = 0;
+static unsigned long records_dropped = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_notify(int events) {
+    (void)events;
+    uint64_t one = 1;
+    if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {
+        // Counter full: a wakeup is already pending
+    }
+}
+
+static void handle_record(const LogRecord *record, void *arg) {
+    (void)arg;
+    uint64_t now = now_ns();
+    if (record->kind == LOG_FILE_OFFER) {
+        // Every offer is accepted
+        uint32_t id = record->offer.id;
+        offers_decide(&id, OFFER_ACCEPTED);
+        return;
+    }
+
+    pthread_mutex_lock(&bench_mutex);
+    if (record->kind == LOG_CHAT_IN) {
+        int seq;
+        unsigned long long sent;
+        if (sscanf(record->text, "bench: %d %llu", &seq, &sent) == 2 && seq >= 0 && seq < message_total) {
+            latencies[seq] = now - sent;
+            messages_received++;
+            last_receive_ns = now;
+        } else if (strncmp(record->text, "bench: warmup ", 14) == 0) {
+            warmups_received++;
+        }
+    } else if (record->kind == LOG_INFO) {
+        if (strncmp(record->text, "File received: ", 15) == 0) {
+            files_received++;
+        } else if (strstr(record->text, "interrupted") || strncmp(record->text, "Failed", 6) == 0) {
+            files_failed++;
+        }
+        if (verbose) fprintf(stderr, "  lume: %s\n", record->text);
+    }
+    pthread_cond_broadcast(&bench_cond);
+    pthread_mutex_unlock(&bench_mutex);
+}
+
+static void *drain_main(void *arg) {
+    (void)arg;
+    struct pollfd pfd = { wake_fd, POLLIN, 0 };
+    while (1) {
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) break;
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0) {
+            // Nothing pending
+        }
+        log_drain(handle_record, NULL);
+        unsigned long lost = log_take_dropped();
+        if (lost) {
+            pthread_mutex_lock(&bench_mutex);
+            records_dropped += lost;
+            pthread_mutex_unlock(&bench_mutex);
+        }
+    }
+    return NULL;
+}
+
+// Block until pred() holds or the timeout passes; returns pred()
+static int wait_for(int (*pred)(void *), void *arg, int seconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    pthread_mutex_lock(&bench_mutex);
+    int done;
+    while (!(done = pred(arg))) {
+        if (pthread_cond_timedwait(&bench_cond, &bench_mutex, &deadline) == ETIMEDOUT) {
+            done = pred(arg);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bench_mutex);
+    return done;
+}
+
+static int all_messages_in(void *arg) {
+    return messages_received >= *(int *)arg;
+}
+
+static int warmed_up(void *arg) {
+    (void)arg;
+    return warmups_received >= BENCH_WARMUP;
+}
+
+static int file_settled(void *arg) {
+    return files_received + files_failed >= *(int *)arg;
+}
+
+static int wait_for_listener(int port) {
+    for (int i = 0; i < 200; i++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ok = connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(sock);
+        if (ok) return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_messages(const Peer *self, int count) {
+    fprintf(stderr, "messages: %d warm-up, %d timed\n", BENCH_WARMUP, count);
+    char msg[64];
+    for (int i = 0; i < BENCH_WARMUP; i++) {
+        snprintf(msg, sizeof(msg), "warmup %d", i);
+        send_text_message(self, msg);
+    }
+    wait_for(warmed_up, NULL, BENCH_WAIT_SECONDS);
+
+    latencies = calloc(count, sizeof(uint64_t));
+    pthread_mutex_lock(&bench_mutex);
+    message_total = count;
+    messages_received = 0;
+    pthread_mutex_unlock(&bench_mutex);
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < count; i++) {
+        snprintf(msg, sizeof(msg), "%d %llu", i, (unsigned long long)now_ns());
+        send_text_message(self, msg);
+    }
+    uint64_t sent = now_ns();
+    wait_for(all_messages_in, &count, BENCH_WAIT_SECONDS);
+
+    pthread_mutex_lock(&bench_mutex);
+    int received = messages_received;
+    uint64_t end = last_receive_ns > sent ? last_receive_ns : sent;
+    pthread_mutex_unlock(&bench_mutex);
+
+    // Messages that never arrived sort last and count against p99
+    for (int i = 0; i < count; i++) {
+        if (latencies[i] == 0) latencies[i] = UINT64_MAX;
+    }
+    qsort(latencies, count, sizeof(uint64_t), compare_u64);
+    double seconds = (end - start) / 1e9;
+    uint64_t p50 = latencies[count / 2];
+    uint64_t p99 = latencies[(size_t)count * 99 / 100];
+
+    printf("  \"messages\": {\"sent\": %d, \"received\": %d, \"per_sec\": %.0f, ", count, received, received / seconds);
+    if (p50 == UINT64_MAX) printf("\"p50_us\": null, ");
+    else printf("\"p50_us\": %.1f, ", p50 / 1e3);
+    if (p99 == UINT64_MAX) printf("\"p99_us\": null},\n");
+    else printf("\"p99_us\": %.1f},\n", p99 / 1e3);
+    free(latencies);
+    latencies = NULL;
+}
+
+static int make_file(const char *path, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    char *block = malloc(1 << 20);
+    if (!block) {
+        close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < (1 << 20); i++) block[i] = (char)(i * 131 + 7);
+    size_t left = size;
+    int rc = 0;
+    while (left > 0 && rc == 0) {
+        size_t n = left < (1 << 20) ? left : (1 << 20);
+        if (write(fd, block, n) != (ssize_t)n) rc = -1;
+        left -= n;
+    }
+    free(block);
+    close(fd);
+    return rc;
+}
+
+static void bench_files(const Peer *self, const size_t *sizes, int count) {
+    printf("  \"files\": [");
+    const char *separator = "";
+    for (int i = 0; i < count; i++) {
+        char name[64], path[96];
+        snprintf(name, sizeof(name), "bench-%zu.bin", sizes[i]);
+        snprintf(path, sizeof(path), "out/%s", name);
+        fprintf(stderr, "files: %zu bytes\n", sizes[i]);
+        if (make_file(path, sizes[i]) < 0) {
+            fprintf(stderr, "cannot create %s\n", path);
+            unlink(path);
+            // Still listed, so every requested size has an entry
+            printf("%s\n    {\"bytes\": %zu, \"ok\": false, \"seconds\": null, \"mb_per_s\": null}",
+                   separator, sizes[i]);
+            separator = ",";
+            continue;
+        }
+
+        pthread_mutex_lock(&bench_mutex);
+        int target = files_received + files_failed + 1;
+        int ok_before = files_received;
+        pthread_mutex_unlock(&bench_mutex);
+
+        TransferProgress progress;
+        memset(&progress, 0, sizeof(progress));
+        uint64_t start = now_ns();
+        int rc = send_file(self, path, &progress);
+        int settled = rc == 0 && wait_for(file_settled, &target, BENCH_WAIT_SECONDS);
+        double seconds = (now_ns() - start) / 1e9;
+
+        pthread_mutex_lock(&bench_mutex);
+        int ok = settled && files_received > ok_before;
+        pthread_mutex_unlock(&bench_mutex);
+
+        printf("%s\n    {\"bytes\": %zu, \"ok\": %s, \"seconds\": %.4f, \"mb_per_s\": ", separator,
+               sizes[i], ok ? "true" : "false", seconds);
+        separator = ",";
+        if (ok) printf("%.1f}", sizes[i] / seconds / 1e6);
+        else printf("null}");
+        unlink(path);
+        unlink(name);
+    }
+    printf("\n  ],\n");
+}
+
+static void bench_discovery(const char *self_exe, int port) {
+    char port_arg[16];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    fprintf(stderr, "discovery: starting a beacon peer\n");
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(self_exe, self_exe, "--peer", port_arg, (char *)NULL);
+        _exit(127);
+    }
+
+    double ms = -1;
+    Peer peer;
+    while (pid > 0 && now_ns() - start < (uint64_t)BENCH_WAIT_SECONDS * 1000000000ull) {
+        if (peers_find_by_name(BENCH_PEER_NAME, &peer)) {
+            ms = (now_ns() - start) / 1e6;
+            break;
+        }
+        usleep(200);
+    }
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    DiscoveryStats stats;
+    discovery_stats(&stats);
+    if (ms < 0) printf("  \"discovery\": {\"ms\": null, ");
+    else printf("  \"discovery\": {\"ms\": %.2f, ", ms);
+    printf("\"datagrams\": %lu, \"malformed\": %lu, \"dropped\": %lu},\n",
+           stats.received, stats.malformed, stats.dropped);
+}
+
+// Second process for the discovery test: beacon and listen until killed
+static int run_peer(int port) {
+    strncpy(app_state.local_username, BENCH_PEER_NAME, USERNAME_LEN - 1);
+    app_state.local_tcp_port = port;
+    app_state.running = 1;
+    init_network_threads();
+    while (1) pause();
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--messages N] [--sizes BYTES,...] [--port PORT] [--io-uring] [--verbose]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int messages = BENCH_MESSAGES;
+    int port = BENCH_PORT;
+    size_t sizes[16] = { 1 << 20, 16 << 20, 128 << 20 };
+    int size_count = 3;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            return run_peer(atoi(argv[i + 1]));
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            size_count = 0;
+            for (char *s = strtok(argv[++i], ","); s && size_count < 16; s = strtok(NULL, ",")) {
+                sizes[size_count++] = strtoull(s, NULL, 10);
+            }
+        } else if (strcmp(argv[i], "--io-uring") == 0) {
+            app_state.io_uring = 1;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (messages < 1 || port < 1 || port > 65534) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char self_exe[4096];
+    ssize_t exe_len = readlink("/proc/self/exe", self_exe, sizeof(self_exe) - 1);
+    if (exe_len < 0) {
+        perror("readlink");
+        return 1;
+    }
+    self_exe[exe_len] = '\0';
+
+    // Received files land in the working directory, sent ones come from out/
+    char dir[] = "/tmp/lume-bench-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0 || mkdir("out", 0700) < 0) {
+        perror("bench directory");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    app_set_notify(bench_notify);
+    pthread_t drain_tid;
+    pthread_create(&drain_tid, NULL, drain_main, NULL);
+    pthread_detach(drain_tid);
+
+    strncpy(app_state.local_username, "bench", USERNAME_LEN - 1);
+    strncpy(app_state.local_ip, "127.0.0.1", sizeof(app_state.local_ip) - 1);
+    app_state.local_tcp_port = port;
+    app_state.running = 1;
+    init_network_threads();
+    if (wait_for_listener(port) < 0) {
+        fprintf(stderr, "listener on port %d did not come up\n", port);
+        return 1;
+    }
+
+    Peer self;
+    memset(&self, 0, sizeof(self));
+    strncpy(self.username, "bench", USERNAME_LEN - 1);
+    inet_pton(AF_INET, "127.0.0.1", &self.ip_addr);
+    self.tcp_port = port;
+
+    printf("{\n  \"benchmark\": \"lume\",\n  \"timestamp\": %lld,\n", (long long)time(NULL));
+    bench_messages(&self, messages);
+    bench_files(&self, sizes, size_count);
+    bench_discovery(self_exe, port + 1);
+    pthread_mutex_lock(&bench_mutex);
+    printf("  \"log_records_dropped\": %lu\n}\n", records_dropped);
+    pthread_mutex_unlock(&bench_mutex);
+    fflush(stdout);
+
+    rmdir("out");
+    if (chdir("/") == 0) rmdir(dir);
+    cleanup_conn_pool();
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef APP_H
+#define APP_H
+
+#include "network.h"
+
+// Settings and run state shared by the network core and whichever front end runs it
+typedef struct {
+    char local_username[USERNAME_LEN];
+    int local_tcp_port;
+    char local_ip[16];
+    int running;
+
+    // Tuning from lume.conf
+    int file_streams;           // Parallel connections per file, 0 = automatic
+    int tcp_nodelay;            // Send chat frames without waiting on Nagle
+    int tcp_cork;               // Hold file bodies until segments are full
+    int socket_sndbuf;          // SO_SNDBUF in bytes, 0 = kernel autotuning
+    int socket_rcvbuf;          // SO_RCVBUF in bytes, 0 = kernel autotuning
+    int multicast;              // Discover peers through a multicast group, not broadcast
+    char multicast_group[16];   // Empty for DISCOVERY_MULTICAST_GROUP
+    int worker_threads;         // Threads receiving file bodies
+    int max_connections;        // Open incoming connections before accepting pauses
+    int io_uring;               // Move file bodies through io_uring (IO_URING=1 builds)
+
+} AppState;
+
+extern AppState app_state;
+
+// Changes reported to the front end through app_notify()
+#define APP_EVENT_LOG 0x1       // Records are waiting in the log ring
+#define APP_EVENT_PEERS 0x2     // The set of peers changed
+
+typedef void (*AppNotify)(int events);
+
+void app_set_notify(AppNotify notify);
+void app_notify(int events);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef CHATLOG_H
+#define CHATLOG_H
+
+#include "network.h"
+
+#define CHATLOG_FLUSH_MS 500             // Appends are batched for at most this long
+#define CHATLOG_CHECKPOINT_RECORDS 256   // Records between index checkpoints
+#define CHATLOG_REPLAY 100               // Messages shown again at startup
+
+// Direction of a logged message
+#define CHATLOG_IN 1
+#define CHATLOG_OUT 2
+
+void init_chatlog();
+void cleanup_chatlog();
+void chatlog_append(const char *peer_name, int direction, const char *text);
+
+#endif
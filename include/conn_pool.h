@@ -0,0 +1,30 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <time.h>
+
+#define POOL_MAX_IDLE 64        // Idle sockets kept open across all peers
+#define POOL_IDLE_TIMEOUT 60    // Seconds an idle socket is kept before eviction
+#define POOL_REAP_INTERVAL 5    // Seconds between eviction passes
+
+typedef struct PooledConn {
+    int sock;
+    struct in_addr ip_addr;
+    int tcp_port;
+    time_t last_used;
+    uint32_t caps;              // FILE_CAP_* the peer announced in its hello
+    int reused;                 // Taken from the idle list, may have gone stale
+    struct PooledConn *next;
+} PooledConn;
+
+void init_conn_pool();
+void cleanup_conn_pool();
+PooledConn *conn_pool_acquire(struct in_addr ip_addr, int tcp_port);
+PooledConn *conn_pool_take_idle(struct in_addr ip_addr, int tcp_port);
+PooledConn *conn_pool_adopt(int sock, struct in_addr ip_addr, int tcp_port, uint32_t caps);
+void conn_pool_release(PooledConn *conn);
+void conn_pool_discard(PooledConn *conn);
+
+#endif
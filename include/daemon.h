@@ -0,0 +1,13 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#define DAEMON_SOCKET "lume.sock"        // Default control socket, in ~/.config/lume
+#define DAEMON_CLIENTS_MAX 64            // Control connections open at once
+#define DAEMON_LINE_MAX 1024             // Longest command; longer lines are refused
+#define DAEMON_OUTPUT_MAX (4 << 20)      // Unsent bytes before a client is dropped as stuck
+
+int init_daemon(const char *socket_path);
+void run_daemon();
+void cleanup_daemon();
+
+#endif
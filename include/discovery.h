@@ -0,0 +1,23 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#define DISCOVERY_MULTICAST_GROUP "239.255.76.77"  // Default group for multicast=1
+#define BEACON_INTERVAL_MIN_MS 1000     // Cadence right after start or a change in the peer set
+#define BEACON_INTERVAL_MAX_MS 10000    // Backed off to while the peer set is stable
+#define BEACON_JITTER_PCT 20            // Each interval is randomised by up to this much
+#define SOLICIT_COUNT 3                 // Solicits sent on start, in case one is lost
+#define SOLICIT_RETRY_MS 250            // Gap before the second solicit, doubling after
+#define DISCOVERY_TICK_MS 500           // Longest wait, so shutdown is noticed
+#define DISCOVERY_BATCH 64              // Datagrams taken per recvmmsg()
+#define DISCOVERY_DROP_LOG_MS 10000     // Least time between reports of lost datagrams
+
+typedef struct {
+    unsigned long received;             // Datagrams read, well-formed or not
+    unsigned long malformed;            // Not a beacon or solicit we understand
+    unsigned long dropped;              // Lost to a full socket receive buffer
+} DiscoveryStats;
+
+void init_discovery();
+void discovery_stats(DiscoveryStats *out);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#define FANOUT_TIMEOUT_MS 5000          // Deadline for every delivery of one message
+#define FANOUT_LABEL_LEN 48
+
+// Results of fanout_to_all() and fanout_to_group() below zero
+#define FANOUT_NO_PEERS -1              // Nobody to send to
+#define FANOUT_NO_GROUP -2              // No group by that name
+#define FANOUT_FAILED -3                // Out of memory or threads
+
+int fanout_to_all(const char *msg);
+int fanout_to_group(const char *group, const char *msg);
+
+#endif
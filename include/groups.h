@@ -0,0 +1,23 @@
+#ifndef GROUPS_H
+#define GROUPS_H
+
+#include <stddef.h>
+
+#define GROUP_NAME_LEN 32               // Letters, digits, '-' and '_'
+#define GROUP_MEMBERS_LEN 512           // Usernames separated by single spaces
+#define GROUPS_MAX 64
+#define GROUPS_FILE "groups"            // In ~/.config/lume, one "name member..." per line
+
+// Results of groups_set()
+#define GROUP_SAVED 0
+#define GROUP_REMOVED 1
+#define GROUP_INVALID -1                // Bad name, or the member list is too long
+#define GROUP_UNKNOWN -2                // Removing a group that does not exist
+#define GROUP_FULL -3                   // GROUPS_MAX groups are defined already
+
+void init_groups();
+int groups_set(const char *name, const char *members);
+int groups_find(const char *name, char *members, size_t size);
+int groups_names(char names[][GROUP_NAME_LEN], int max);
+
+#endif
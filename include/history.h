@@ -0,0 +1,40 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HISTORY_LINES 131072          // Lines kept for scrollback; a power of two
+#define HISTORY_ARENA_SIZE (16 << 20) // Bytes of line text kept for scrollback
+#define HISTORY_LINE_MAX 1024         // Encoded size of one line; longer ones are cut
+
+// Style byte of a run: a colour pair in the low bits plus these flags
+#define HISTORY_PAIR_MASK 0x0f
+#define HISTORY_BOLD 0x10
+#define HISTORY_DIM 0x20
+
+// One screen line being assembled from styled runs
+typedef struct {
+    unsigned char data[HISTORY_LINE_MAX];
+    size_t len;
+    int width;                        // Columns the line takes unwrapped
+} HistoryLine;
+
+// A run read back from a stored line
+typedef struct {
+    int style;
+    const char *text;
+    size_t len;
+} HistoryRun;
+
+void history_line_init(HistoryLine *line);
+void history_line_add(HistoryLine *line, int style, const char *text);
+void history_line_addn(HistoryLine *line, int style, const char *text, size_t len);
+void history_push(const HistoryLine *line);
+
+uint64_t history_first();
+uint64_t history_end();
+const unsigned char *history_get(uint64_t seq, size_t *len, int *width);
+int history_next_run(const unsigned char **cursor, const unsigned char *end, HistoryRun *run);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "network.h"
+
+#define LOG_RING_SIZE 512        // Records buffered for the front end; a power of two
+#define LOG_TEXT_LEN 512         // Longer lines are truncated
+
+typedef enum {
+    LOG_INFO,                    // Status line
+    LOG_CHAT_IN,                 // Message from a peer
+    LOG_CHAT_OUT,                // Message we sent
+    LOG_HELP,                    // The /help listing
+    LOG_FILE_OFFER               // Prompt for an incoming file
+} LogKind;
+
+typedef struct {
+    LogKind kind;
+    time_t when;
+    union {
+        char text[LOG_TEXT_LEN];
+        struct {
+            uint32_t id;
+            size_t file_size;
+            char sender[USERNAME_LEN];
+            char filename[256];
+        } offer;
+    };
+} LogRecord;
+
+typedef void (*LogSink)(const LogRecord *record, void *arg);
+
+void log_message(const char *fmt, ...);
+void log_chat(LogKind kind, const char *fmt, ...);
+int log_submit(const LogRecord *record);
+void log_file_offer(uint32_t offer_id, const char *sender, const char *filename, size_t file_size);
+int log_drain(LogSink sink, void *arg);
+unsigned long log_take_dropped();
+
+#endif
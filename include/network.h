@@ -4,48 +4,77 @@
 #include <netinet/in.h>
 #include <time.h>
 #include <stdint.h>
+#include "transfer.h"
 
 #define BROADCAST_PORT 9000
 #define BROADCAST_IP "255.255.255.255"
-#define MAX_PEERS 50
 #define USERNAME_LEN 32
-#define CHUNK_SIZE 4096
+#define CHUNK_SIZE 4096          // Per-frame chunk of the legacy MSG_FILE_CHUNK body
+
+// File transfer capabilities, offered in FileMetadata and echoed in FileAccept
+#define FILE_CAP_STREAM 0x1      // Body is a length-delimited stream of large chunks
+#define FILE_CAP_RESUME 0x2      // Receiver may hold a prefix; requires FILE_CAP_STREAM
+#define FILE_CAP_STRIPED 0x4     // Body split over parallel connections; requires FILE_CAP_STREAM
+#define FILE_CAP_TREE 0x8        // The offer is a directory, sent as a manifest and packed data
+#define FILE_CAPS_SUPPORTED (FILE_CAP_STREAM | FILE_CAP_RESUME | FILE_CAP_STRIPED | FILE_CAP_TREE)
+
+#define MAX_FILE_STREAMS 8                       // Upper bound on parallel connections per file
+#define SOCKET_BUFFER_MAX (64 * 1024 * 1024)      // Largest socket_sndbuf/socket_rcvbuf accepted
+#define FILE_STREAM_AUTO_BYTES (64 * 1024 * 1024) // Bytes per stream when choosing automatically
+#define FILE_STREAM_AUTO_MAX 4                    // Most streams chosen automatically
+#define FILE_RESPONSE_POLL_MS 200                 // Cancellation check while awaiting an answer
 
 typedef enum {
     MSG_TEXT,
     MSG_FILE_METADATA,
     MSG_FILE_CHUNK,
     MSG_FILE_ACCEPT,
-    MSG_FILE_REJECT
+    MSG_FILE_REJECT,
+    MSG_FILE_STRIPE
 } MessageType;
 
 typedef struct {
-    char username[USERNAME_LEN];
-    int tcp_port;
-} BeaconPacket;
-
-typedef struct {
+    uint32_t id;                 // Stable handle, assigned in discovery order
     char username[USERNAME_LEN];
     struct in_addr ip_addr;
     int tcp_port;
     time_t last_seen;
 } Peer;
 
+// A decoded frame header; the encoding is in wire.h
 typedef struct {
     int type;
-    char sender_name[USERNAME_LEN];
     size_t payload_len;
-} MessagePacket;
+} FrameHeader;
 
 typedef struct {
     char filename[256];
     size_t file_size;
+    uint32_t flags;              // FILE_CAP_* offered by the sender
+    uint32_t streams;            // Parallel connections the sender would like
+    uint64_t transfer_id;        // Ties MSG_FILE_STRIPE connections to this offer
 } FileMetadata;
 
+typedef struct {
+    uint32_t flags;              // FILE_CAP_* the receiver agreed to
+    uint32_t prefix_crc;         // CRC-32 of the bytes already held
+    uint64_t resume_offset;      // Bytes already held from an earlier attempt
+    uint32_t streams;            // Parallel connections granted, 1 if not striped
+} FileAccept;
+
+// Opens each extra connection of a striped transfer
+typedef struct {
+    uint64_t transfer_id;
+    uint32_t index;              // 1..streams-1; stripe 0 uses the offer's connection
+} FileStripe;
+
 int get_local_ip(char *ip_buffer, size_t buffer_size);
 void init_network_threads();
-void send_text_message(int peer_index, const char *msg);
-void send_file(int peer_index, const char *filepath);
-void send_file_response(int sock, int accepted);
+void send_text_message(const Peer *peer, const char *msg);
+int send_file(const Peer *peer, const char *filepath, TransferProgress *progress);
+void tune_socket(int sock);
+void send_file_response(int sock, int accepted, const FileAccept *accept);
+int receive_file(int sock, const FileMetadata *meta);
+void finish_received_file(const char *part_path, const char *filename, int status);
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef OFFERS_H
+#define OFFERS_H
+
+#include <stdint.h>
+
+// Decision on an incoming file offer
+#define OFFER_PENDING 0
+#define OFFER_ACCEPTED 1
+#define OFFER_REJECTED -1
+
+// Results of offers_decide()
+#define OFFER_UNKNOWN -1         // No pending offer with that id
+#define OFFER_AMBIGUOUS -2       // No id given and several offers are pending
+
+uint32_t offers_add(void *owner);
+int offers_decide(uint32_t *id, int decision);
+void *offers_next_decided(int *decision);
+int offers_withdraw(uint32_t id);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef OUTGOING_H
+#define OUTGOING_H
+
+#include <stdint.h>
+#include "network.h"
+
+#define OUTGOING_THREADS 2      // Files sent at the same time; the rest wait in line
+#define OUTGOING_PATH_LEN 256   // Longer paths are refused rather than cut
+
+void init_outgoing(int threads);
+uint32_t outgoing_enqueue(const Peer *peer, const char *path);
+int outgoing_cancel(uint32_t id);
+void outgoing_list();
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PEERS_H
+#define PEERS_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include "network.h"
+
+#define PEER_EXPIRY_TIMEOUT 30  // Seconds without a beacon before a peer is dropped
+#define PEER_REAP_INTERVAL 3    // Seconds between expiry passes
+#define PEER_TABLE_MIN 16       // Initial capacity of the peer table
+
+// Outcome of peers_update()
+#define PEER_UPDATED 0
+#define PEER_ADDED 1
+#define PEER_RENAMED 2          // Known address announced a new username
+
+// One beacon's worth of news for peers_update()
+typedef struct {
+    char username[USERNAME_LEN];
+    struct in_addr ip_addr;
+    int tcp_port;
+    int result;                 // Filled in: PEER_*, or -1 if the table is full
+    Peer peer;                  // Filled in: the entry after the update
+} PeerUpdate;
+
+void init_peers();
+void cleanup_peers();
+int peers_update(PeerUpdate *updates, int count);
+int peers_find(uint32_t id, Peer *out);
+int peers_find_by_name(const char *username, Peer *out);
+int peers_find_by_addr(struct in_addr ip_addr, int tcp_port, Peer *out);
+int peers_list(Peer *out, int max);
+int peers_resolve(uint32_t id, Peer *out, int *position);
+uint32_t peers_step(uint32_t id, int delta);
+unsigned peers_changes();
+
+#endif
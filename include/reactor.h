@@ -0,0 +1,17 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_TICK_MS 100          // Upper bound on how long timers can lag
+#define MAX_PAYLOAD_LEN (1 << 20)    // Largest control/text payload accepted
+#define FILE_DECISION_TIMEOUT 30     // Seconds before an unanswered offer is rejected
+#define REACTOR_MAX_CONNECTIONS 1024 // Default for max_connections= in lume.conf
+#define REACTOR_CONNECTIONS_LIMIT 65536
+#define REACTOR_PAYLOAD_MIN 256      // Smallest payload buffer a connection allocates
+#define REACTOR_PAYLOAD_KEEP (64 * 1024) // Larger buffers are freed after their frame
+#define ACCEPT_PAUSE_LOG_SEC 10      // Least time between reports of paused accepting
+
+void *tcp_server(void *arg);
+void reactor_wake();
+
+#endif
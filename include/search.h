@@ -0,0 +1,15 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdint.h>
+
+#define SEARCH_WORD_MAX 32          // Longer words are indexed by their prefix
+#define SEARCH_TERMS_MAX 8          // Words of a query that are looked up
+#define SEARCH_RESULTS 20           // Hits shown for one query
+#define SEARCH_SWEEP_MIN (1 << 20)  // Index bytes before lines gone from history are dropped
+
+void search_add(uint64_t seq, const char *text);
+int search_query(const char *query, uint64_t *hits, int max_hits, int *total);
+void cleanup_search();
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef STRIPES_H
+#define STRIPES_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include "network.h"
+
+#define STRIPE_JOIN_TIMEOUT 30   // Seconds for all stripe connections to arrive
+
+typedef struct StripedTransfer StripedTransfer;
+
+StripedTransfer *stripes_register(const FileMetadata *meta, struct in_addr peer, int fd,
+                                  const char *part_path, const char *filename, uint32_t streams);
+void stripes_begin(StripedTransfer *t, uint64_t start);
+void stripes_abort(StripedTransfer *t);
+int stripes_receive(StripedTransfer *t, int sock, uint32_t index);
+int receive_stripe(int sock, const FileStripe *stripe);
+void sweep_striped_transfers();
+
+#endif
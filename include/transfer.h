@@ -0,0 +1,40 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define TRANSFER_PIPE_SIZE (1 << 20)   // Requested capacity of the splice pipe
+#define TRANSFER_COPY_SIZE (64 * 1024) // Bounce buffer when zero-copy is refused
+
+// Chunk sizes of the FILE_CAP_STREAM body, adapted to measured throughput
+#define STREAM_CHUNK_MIN (64 * 1024)
+#define STREAM_CHUNK_MAX (8 * 1024 * 1024)
+#define STREAM_CHUNK_TARGET_MS 50
+
+#define TRANSFER_CRC_BLOCK (1 << 20)   // Read size when checksumming a resume prefix
+
+// Results of receive_file_body() and receive_file_stream()
+#define TRANSFER_OK 0
+#define TRANSFER_STREAM_ERROR -1       // Socket broke, connection unusable
+#define TRANSFER_WRITE_ERROR 1         // Disk write failed, stream stayed in sync
+
+// Shared between a send and whoever started it; may be NULL
+typedef struct {
+    atomic_ullong sent;          // Body bytes handed to the socket, including a resumed prefix
+    atomic_ullong total;         // Body size of a directory, once it has been scanned
+    atomic_int accepted;         // The receiver agreed and the body is under way
+    atomic_int cancelled;        // Set to abandon the send at the next chunk
+} TransferProgress;
+
+int send_file_body(int sock, int fd, off_t size, TransferProgress *progress);
+int send_file_stream(int sock, int fd, off_t offset, off_t end, TransferProgress *progress);
+int receive_file_body(int sock, int fd, size_t size);
+int receive_file_stream(int sock, int fd, off_t offset, size_t size, size_t *received_out);
+int transfer_prefix_crc(int fd, off_t len, uint32_t *crc_out);
+void stripe_range(uint64_t start, uint64_t end, uint32_t streams, uint32_t index,
+                  uint64_t *offset, uint64_t *len);
+
+#endif
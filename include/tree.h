@@ -0,0 +1,28 @@
+#ifndef TREE_H
+#define TREE_H
+
+#include <stdint.h>
+#include "transfer.h"
+
+#define TREE_ENTRIES_MAX 1000000        // Files and directories in one transfer
+#define TREE_PATH_MAX 1024              // Longest path below the transferred directory
+#define TREE_DEPTH_MAX 64               // Deeper directories are skipped when sending
+#define TREE_MANIFEST_MAX (64 * 1024 * 1024)
+#define TREE_BLOCK_SIZE (1024 * 1024)   // File data packed into one stream chunk
+#define TREE_PREFETCH_BLOCKS 4          // Blocks read ahead of the socket
+
+// Kinds of manifest entry
+#define TREE_DIR 0
+#define TREE_FILE 1
+
+typedef struct TreeManifest TreeManifest;
+
+TreeManifest *tree_scan(const char *root);
+void tree_free(TreeManifest *tree);
+uint64_t tree_total_bytes(const TreeManifest *tree);
+int tree_file_count(const TreeManifest *tree);
+int tree_send(int sock, const TreeManifest *tree, TransferProgress *progress);
+int tree_valid_name(const char *name);
+int tree_receive(int sock, const char *dir, uint64_t total, int *files_out, int *failed_out);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+// Registered buffers of one transfer; reads, socket I/O and writes overlap across them and across chunks
+#define URING_BUFFERS 8
+#define URING_BUFFER_SIZE (128 * 1024)
+#define URING_QUEUE_DEPTH (2 * URING_BUFFERS)
+#define URING_MIN_RANGE (2 * URING_BUFFER_SIZE) // Smaller bodies are not worth setting up a ring
+
+// Results of uring_send_chunk() and uring_receive_chunk()
+#define URING_OK 0
+#define URING_ERROR -1                 // Socket or file failed, the stream is unusable
+#define URING_UNSUPPORTED -2           // Refused before any byte moved; use the plain path
+
+typedef struct UringEngine UringEngine;
+
+UringEngine *uring_engine();
+void uring_send_begin(UringEngine *engine, int sock, int fd, off_t offset, off_t end);
+int uring_send_chunk(UringEngine *engine, size_t len);
+void uring_receive_begin(UringEngine *engine, int sock, int fd, off_t offset, int *write_failed);
+int uring_receive_chunk(UringEngine *engine, size_t len);
+void uring_finish(UringEngine *engine);
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+int send_exact(int sock, const void *buf, size_t len, int flags);
+int sendmsg_exact(int sock, struct iovec *iov, int iovcnt, int flags);
+int recv_exact(int sock, void *buf, size_t len);
+long long now_ms();
+
+#endif
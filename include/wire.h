@@ -0,0 +1,76 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "network.h"
+
+/*
+ * TCP wire format. Each side opens a connection with a hello:
+ *
+ *   "LUME" | version u8 | body length u8 | varint caps, username
+ *
+ * and every frame after it is
+ *
+ *   type u8 | varint payload length | payload
+ *
+ * Discovery datagrams reuse the hello layout with a kind in place of the
+ * body length:
+ *
+ *   "LUME" | version u8 | kind u8 | varint TCP port | username
+ *
+ * Integers are unsigned LEB128 varints, so nothing depends on the word
+ * size, byte order or struct padding of either build. Decoders ignore
+ * bytes after the fields they know, which leaves room to append fields.
+ */
+#define WIRE_MAGIC "LUME"
+#define WIRE_VERSION 1
+#define WIRE_HELLO_PREFIX 6             // Magic, version, body length
+#define WIRE_HELLO_MAX (WIRE_HELLO_PREFIX + 255)
+#define WIRE_HEADER_MAX 5               // Type and a payload length below 2^28
+#define WIRE_VARINT_MAX 10
+#define WIRE_OFFER_MAX (4 * WIRE_VARINT_MAX + 2 + 256)
+#define WIRE_ACCEPT_MAX (4 * WIRE_VARINT_MAX)
+#define WIRE_STRIPE_MAX (2 * WIRE_VARINT_MAX)
+#define WIRE_HANDSHAKE_TIMEOUT 5        // Seconds to wait for the peer's hello
+#define WIRE_BEACON_MAX (WIRE_HELLO_PREFIX + WIRE_VARINT_MAX + USERNAME_LEN)
+
+// Kinds of discovery datagram
+#define WIRE_BEACON_ANNOUNCE 1          // Periodic presence, or the answer to a solicit
+#define WIRE_BEACON_SOLICIT 2           // A node that just started asks everyone to answer
+
+typedef struct {
+    uint32_t version;                   // Version both sides speak: the lower one
+    uint32_t caps;                      // FILE_CAP_* the peer supports
+    char username[USERNAME_LEN];
+} WireHello;
+
+typedef struct {
+    int kind;                           // WIRE_BEACON_*
+    int tcp_port;
+    char username[USERNAME_LEN];
+} WireBeacon;
+
+size_t wire_put_varint(unsigned char *p, uint64_t value);
+int wire_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *value);
+
+size_t wire_encode_hello(unsigned char *buf);
+int wire_parse_hello(const unsigned char *buf, size_t len, WireHello *hello);
+size_t wire_encode_header(unsigned char *buf, int type, size_t payload_len);
+int wire_parse_header(const unsigned char *buf, size_t len, FrameHeader *header);
+
+size_t wire_encode_beacon(unsigned char *buf, int kind);
+int wire_parse_beacon(const unsigned char *buf, size_t len, WireBeacon *beacon);
+
+size_t wire_encode_offer(unsigned char *buf, const FileMetadata *meta);
+int wire_decode_offer(const unsigned char *buf, size_t len, FileMetadata *meta);
+size_t wire_encode_accept(unsigned char *buf, const FileAccept *accept);
+int wire_decode_accept(const unsigned char *buf, size_t len, FileAccept *accept);
+size_t wire_encode_stripe(unsigned char *buf, const FileStripe *stripe);
+int wire_decode_stripe(const unsigned char *buf, size_t len, FileStripe *stripe);
+
+int wire_send_frame(int sock, int type, const void *payload, size_t len, int flags);
+int wire_handshake(int sock, WireHello *peer);
+int wire_recv_header(int sock, FrameHeader *header);
+
+#endif
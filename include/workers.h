@@ -0,0 +1,16 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#define WORKER_THREADS 4            // Default for worker_threads= in lume.conf
+#define WORKER_THREADS_MAX 64
+#define WORKER_QUEUE_LEN 256        // Jobs one worker holds; past that submitting fails
+#define WORKER_BACKLOG 8            // Queued jobs per worker at which accepting pauses
+
+typedef void (*WorkFn)(void *arg);
+
+int init_workers(int count);
+int workers_submit(WorkFn fn, void *arg);
+int workers_count();
+int workers_saturated();
+
+#endif
@@ -0,0 +1,27 @@
+#include <stdatomic.h>
+#include "../include/app.h"
+#include "../include/workers.h"
+#include "../include/reactor.h"
+
+AppState app_state = {
+    .tcp_nodelay = 1,
+    .tcp_cork = 1,
+    .worker_threads = WORKER_THREADS,
+    .max_connections = REACTOR_MAX_CONNECTIONS,
+};
+
+/*
+ * The front end (the ncurses UI or the daemon) registers one hook and is
+ * told what changed; the core never calls into a front end directly. The
+ * hook may run on any thread and must not block.
+ */
+static _Atomic(AppNotify) notify_hook = NULL;
+
+void app_set_notify(AppNotify notify) {
+    atomic_store(&notify_hook, notify);
+}
+
+void app_notify(int events) {
+    AppNotify notify = atomic_load(&notify_hook);
+    if (notify) notify(events);
+}
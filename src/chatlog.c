@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/chatlog.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+/*
+ * Per-peer message history on disk, in ~/.config/lume/history/<local user>/.
+ * Each peer has an append-only <name>.log of records and a <name>.idx of
+ * checkpoints. Appending only copies the record into the peer's pending
+ * buffer; a flusher thread writes each buffer with a single write() every
+ * CHATLOG_FLUSH_MS. Once CHATLOG_CHECKPOINT_RECORDS records have gone out
+ * since the last checkpoint it appends another one, the offset and number
+ * of the next record, so a reader can start near the end of a large log
+ * instead of scanning it from the top.
+ *
+ * A log begins with a header naming the peer. Each record is a fixed
+ * header and the text, with a checksum over both so that a write torn by
+ * a crash is recognised; the flusher cuts such a tail off when it reopens
+ * the file. Files stay on this machine, so they use host byte order.
+ */
+#define CHATLOG_MAGIC "LUMELOG1"
+
+typedef struct {
+    char magic[8];
+    char peer_name[USERNAME_LEN];
+} ChatLogHeader;
+
+typedef struct {
+    uint32_t check;             // FNV-1a of the fields below and the text
+    uint32_t when;
+    uint16_t length;
+    uint8_t direction;
+    uint8_t reserved;
+} ChatRecord;
+
+typedef struct {
+    uint64_t offset;            // Start of record number count
+    uint64_t count;
+} ChatCheckpoint;
+
+typedef struct ChatLog {
+    char peer_name[USERNAME_LEN];
+
+    // Filled by appenders under chatlog_mutex
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    char *spare;                // Buffer of the previous flush, reused
+    size_t spare_cap;
+
+    // Flusher thread only
+    int fd;                     // -1 until the first flush, -2 if unusable
+    int index_fd;
+    uint64_t count;             // Records on disk
+    uint64_t checkpoint_count;  // Records covered by the last checkpoint
+
+    struct ChatLog *next;
+} ChatLog;
+
+// A log and its index mapped read-only
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    const ChatCheckpoint *checkpoints;
+    size_t checkpoints_size;    // Bytes mapped
+    size_t checkpoint_total;    // Entries that lie inside the log
+    char peer_name[USERNAME_LEN];
+} ChatLogView;
+
+static ChatLog *logs = NULL;    // Only ever grows, so entries stay put
+static char log_dir[600];
+static int stopping = 0;
+static int flusher_started = 0;
+static pthread_t flusher;
+static pthread_mutex_t chatlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chatlog_cond = PTHREAD_COND_INITIALIZER;
+
+static uint32_t record_check(const ChatRecord *record, const char *text) {
+    uint32_t hash = 2166136261u;
+    const unsigned char *p = (const unsigned char *)record + sizeof(record->check);
+    for (size_t i = sizeof(record->check); i < sizeof(*record); i++) {
+        hash = (hash ^ *p++) * 16777619u;
+    }
+    for (size_t i = 0; i < record->length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * File names keep letters, digits, '-' and '_'; every other byte becomes
+ * %XX, so distinct names never share a file. An empty name is "%", which
+ * no other name encodes to.
+ */
+static void log_path(char *path, size_t size, const char *name, const char *suffix) {
+    static const char hex[] = "0123456789ABCDEF";
+    char safe[3 * USERNAME_LEN];
+    size_t n = 0;
+    for (size_t i = 0; name[i] && i < USERNAME_LEN - 1; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_') {
+            safe[n++] = (char)c;
+        } else {
+            safe[n++] = '%';
+            safe[n++] = hex[c >> 4];
+            safe[n++] = hex[c & 0xf];
+        }
+    }
+    if (n == 0) safe[n++] = '%';
+    safe[n] = '\0';
+    snprintf(path, size, "%s/%s%s", log_dir, safe, suffix);
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int map_view(int fd, int index_fd, ChatLogView *view) {
+    memset(view, 0, sizeof(*view));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ChatLogHeader)) return -1;
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return -1;
+    view->data = data;
+    view->size = (size_t)st.st_size;
+
+    ChatLogHeader header;
+    memcpy(&header, view->data, sizeof(header));
+    if (memcmp(header.magic, CHATLOG_MAGIC, sizeof(header.magic)) != 0) {
+        munmap(data, view->size);
+        return -1;
+    }
+    memcpy(view->peer_name, header.peer_name, USERNAME_LEN);
+    view->peer_name[USERNAME_LEN - 1] = '\0';
+
+    if (index_fd >= 0 && fstat(index_fd, &st) == 0 && (size_t)st.st_size >= sizeof(ChatCheckpoint)) {
+        void *index = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, index_fd, 0);
+        if (index != MAP_FAILED) {
+            view->checkpoints = index;
+            view->checkpoints_size = (size_t)st.st_size;
+            // Checkpoints are written in order; ignore any past a cut-off tail
+            size_t total = view->checkpoints_size / sizeof(ChatCheckpoint);
+            while (total > 0 && view->checkpoints[total - 1].offset > view->size) total--;
+            view->checkpoint_total = total;
+        }
+    }
+    return 0;
+}
+
+static void unmap_view(ChatLogView *view) {
+    if (view->data) munmap((void *)view->data, view->size);
+    if (view->checkpoints) munmap((void *)view->checkpoints, view->checkpoints_size);
+    view->data = NULL;
+    view->checkpoints = NULL;
+}
+
+// Offset just past the record at offset, or 0 if no intact record starts there
+static size_t next_record(const ChatLogView *view, size_t offset, ChatRecord *record) {
+    if (view->size - offset < sizeof(*record)) return 0;
+    memcpy(record, view->data + offset, sizeof(*record));
+    size_t end = offset + sizeof(*record) + record->length;
+    if (end > view->size) return 0;
+    if (record_check(record, (const char *)view->data + offset + sizeof(*record)) != record->check) return 0;
+    return end;
+}
+
+// Latest checkpoint at or before record number limit; the start of the log counts as one
+static ChatCheckpoint checkpoint_before(const ChatLogView *view, uint64_t limit) {
+    ChatCheckpoint best = { sizeof(ChatLogHeader), 0 };
+    size_t lo = 0, hi = view->checkpoint_total;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (view->checkpoints[mid].count <= limit) {
+            best = view->checkpoints[mid];
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return best;
+}
+
+// Walk intact records from a checkpoint; returns how many, and where they end
+static uint64_t scan_records(const ChatLogView *view, size_t offset, size_t *end) {
+    uint64_t count = 0;
+    ChatRecord record;
+    size_t next;
+    while ((next = next_record(view, offset, &record)) != 0) {
+        offset = next;
+        count++;
+    }
+    *end = offset;
+    return count;
+}
+
+/*
+ * Open a peer's log for appending. A new log gets its header; an existing
+ * one is checked from its last checkpoint, and a torn tail is cut off
+ * along with any checkpoints that pointed into it.
+ */
+static void open_log(ChatLog *log) {
+    char path[1024];
+    char index_path[1024];
+    log_path(path, sizeof(path), log->peer_name, ".log");
+    log_path(index_path, sizeof(index_path), log->peer_name, ".idx");
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    log->index_fd = open(index_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (log->fd < 0 || log->index_fd < 0) {
+        log_message("Cannot open chat history %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    struct stat st;
+    if (fstat(log->fd, &st) < 0) goto fail;
+    if (st.st_size == 0) {
+        ChatLogHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, CHATLOG_MAGIC, sizeof(header.magic));
+        strncpy(header.peer_name, log->peer_name, USERNAME_LEN - 1);
+        if (write_all(log->fd, &header, sizeof(header)) < 0 || ftruncate(log->index_fd, 0) < 0) goto fail;
+        log->count = 0;
+        log->checkpoint_count = 0;
+        return;
+    }
+
+    ChatLogView view;
+    if (map_view(log->fd, log->index_fd, &view) < 0) {
+        log_message("Not a chat history file, leaving it alone: %s", path);
+        goto fail;
+    }
+    ChatCheckpoint last = checkpoint_before(&view, UINT64_MAX);
+    size_t end;
+    log->count = last.count + scan_records(&view, last.offset, &end);
+    log->checkpoint_count = last.count;
+    size_t keep_checkpoints = view.checkpoint_total;
+    while (keep_checkpoints > 0 && view.checkpoints[keep_checkpoints - 1].offset > end) keep_checkpoints--;
+    size_t size = view.size;
+    unmap_view(&view);
+
+    if (end < size) {
+        if (ftruncate(log->fd, (off_t)end) < 0 ||
+            ftruncate(log->index_fd, (off_t)(keep_checkpoints * sizeof(ChatCheckpoint))) < 0) {
+            goto fail;
+        }
+        log_message("Dropped a damaged tail of the chat history with %s", log->peer_name);
+    }
+    return;
+
+fail:
+    if (log->fd >= 0) close(log->fd);
+    if (log->index_fd >= 0) close(log->index_fd);
+    log->fd = -2;
+    log->index_fd = -1;
+}
+
+// Checkpoints buffered before one write to the index
+#define CHECKPOINT_BATCH 64
+
+static void write_checkpoints(ChatLog *log, const ChatCheckpoint *checkpoints, size_t count) {
+    if (write_all(log->index_fd, checkpoints, count * sizeof(ChatCheckpoint)) < 0) {
+        // A lost checkpoint only makes the next startup scan further
+    }
+}
+
+static void write_batch(ChatLog *log, const char *buf, size_t len) {
+    if (log->fd == -1) open_log(log);
+    if (log->fd < 0) return;
+
+    if (write_all(log->fd, buf, len) < 0) {
+        log_message("Failed to write chat history with %s: %s", log->peer_name, strerror(errno));
+        close(log->fd);
+        close(log->index_fd);
+        log->fd = -2;
+        log->index_fd = -1;
+        return;
+    }
+    // With O_APPEND the position is the end of our write
+    uint64_t base = (uint64_t)lseek(log->fd, 0, SEEK_CUR) - len;
+
+    // Walk the batch's records to checkpoint every CHATLOG_CHECKPOINT_RECORDS
+    ChatCheckpoint checkpoints[CHECKPOINT_BATCH];
+    size_t pending = 0;
+    size_t offset = 0;
+    while (offset < len) {
+        ChatRecord record;
+        memcpy(&record, buf + offset, sizeof(record));
+        offset += sizeof(record) + record.length;
+        log->count++;
+        if (log->count - log->checkpoint_count < CHATLOG_CHECKPOINT_RECORDS) continue;
+
+        checkpoints[pending].offset = base + offset;
+        checkpoints[pending].count = log->count;
+        log->checkpoint_count = log->count;
+        if (++pending == CHECKPOINT_BATCH) {
+            write_checkpoints(log, checkpoints, pending);
+            pending = 0;
+        }
+    }
+    if (pending > 0) write_checkpoints(log, checkpoints, pending);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&chatlog_mutex);
+    while (1) {
+        int stop = stopping;
+        for (ChatLog *log = logs; log; log = log->next) {
+            if (log->pending_len == 0) continue;
+
+            // Take the batch and hand appenders the spare buffer
+            char *buf = log->pending;
+            size_t len = log->pending_len;
+            size_t cap = log->pending_cap;
+            log->pending = log->spare;
+            log->pending_cap = log->spare_cap;
+            log->pending_len = 0;
+            log->spare = NULL;
+            log->spare_cap = 0;
+            pthread_mutex_unlock(&chatlog_mutex);
+
+            write_batch(log, buf, len);
+
+            pthread_mutex_lock(&chatlog_mutex);
+            if (!log->spare) {
+                log->spare = buf;
+                log->spare_cap = cap;
+            } else {
+                free(buf);
+            }
+        }
+        if (stop) break;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CHATLOG_FLUSH_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        if (!stopping) pthread_cond_timedwait(&chatlog_cond, &chatlog_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&chatlog_mutex);
+    return NULL;
+}
+
+// Called with chatlog_mutex held
+static ChatLog *find_log(const char *peer_name) {
+    for (ChatLog *log = logs; log; log = log->next) {
+        if (strncmp(log->peer_name, peer_name, USERNAME_LEN) == 0) return log;
+    }
+    ChatLog *log = calloc(1, sizeof(ChatLog));
+    if (!log) return NULL;
+    strncpy(log->peer_name, peer_name, USERNAME_LEN - 1);
+    log->fd = -1;
+    log->index_fd = -1;
+    log->next = logs;
+    logs = log;
+    return log;
+}
+
+/*
+ * Record a message to or from a peer. Only copies into memory; the flusher
+ * writes it out within CHATLOG_FLUSH_MS.
+ */
+void chatlog_append(const char *peer_name, int direction, const char *text) {
+    ChatRecord record;
+    size_t length = strlen(text);
+    record.when = (uint32_t)time(NULL);
+    record.length = (uint16_t)(length > UINT16_MAX ? UINT16_MAX : length);
+    record.direction = (uint8_t)direction;
+    record.reserved = 0;
+    record.check = record_check(&record, text);
+    size_t needed = sizeof(record) + record.length;
+
+    pthread_mutex_lock(&chatlog_mutex);
+    ChatLog *log = flusher_started && !stopping ? find_log(peer_name) : NULL;
+    if (log && log->pending_len + needed > log->pending_cap) {
+        size_t cap = log->pending_cap ? log->pending_cap * 2 : 4096;
+        while (cap < log->pending_len + needed) cap *= 2;
+        char *grown = realloc(log->pending, cap);
+        if (grown) {
+            log->pending = grown;
+            log->pending_cap = cap;
+        } else {
+            log = NULL;
+        }
+    }
+    if (log) {
+        memcpy(log->pending + log->pending_len, &record, sizeof(record));
+        memcpy(log->pending + log->pending_len + sizeof(record), text, record.length);
+        log->pending_len += needed;
+    }
+    pthread_mutex_unlock(&chatlog_mutex);
+}
+
+typedef struct {
+    uint32_t when;
+    uint32_t order;             // Keeps each log's own order among equal times
+    int direction;
+    size_t view;                // Log the record came from
+    const char *text;
+    uint16_t length;
+} ReplayEntry;
+
+typedef struct {
+    ReplayEntry *entries;
+    size_t count;
+    size_t cap;
+} ReplayList;
+
+static int compare_replay(const void *a, const void *b) {
+    const ReplayEntry *x = a, *y = b;
+    if (x->when != y->when) return x->when < y->when ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Add the newest limit records of one log, found from its checkpoints
+static void collect_tail(const ChatLogView *view, size_t view_index, uint64_t limit, ReplayList *list) {
+    ChatCheckpoint start = checkpoint_before(view, UINT64_MAX);
+    size_t end;
+    uint64_t total = start.count + scan_records(view, start.offset, &end);
+    if (total - start.count < limit) {
+        start = checkpoint_before(view, total > limit ? total - limit : 0);
+    }
+
+    ChatRecord record;
+    size_t offset = start.offset;
+    for (uint64_t skip = total - start.count > limit ? total - start.count - limit : 0; skip > 0; skip--) {
+        offset = next_record(view, offset, &record);
+        if (offset == 0) return;
+    }
+
+    size_t next;
+    while ((next = next_record(view, offset, &record)) != 0) {
+        if (list->count == list->cap) {
+            size_t cap = list->cap ? list->cap * 2 : 256;
+            ReplayEntry *grown = realloc(list->entries, cap * sizeof(ReplayEntry));
+            if (!grown) return;
+            list->entries = grown;
+            list->cap = cap;
+        }
+        ReplayEntry *entry = &list->entries[list->count];
+        entry->when = record.when;
+        entry->order = (uint32_t)list->count;
+        entry->direction = record.direction;
+        entry->view = view_index;
+        entry->text = (const char *)view->data + offset + sizeof(record);
+        entry->length = record.length;
+        list->count++;
+        offset = next;
+    }
+}
+
+// Show the newest messages across all peers, oldest first
+static void replay_history() {
+    DIR *dir = opendir(log_dir);
+    if (!dir) return;
+
+    ChatLogView *views = NULL;
+    size_t view_count = 0;
+    ReplayList list = { NULL, 0, 0 };
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        if (name_len <= 4 || strcmp(entry->d_name + name_len - 4, ".log") != 0) continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", log_dir, entry->d_name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        memcpy(path + strlen(path) - 4, ".idx", 4);
+        int index_fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        ChatLogView *grown = realloc(views, (view_count + 1) * sizeof(ChatLogView));
+        if (grown) {
+            views = grown;
+            if (map_view(fd, index_fd, &views[view_count]) == 0) {
+                collect_tail(&views[view_count], view_count, CHATLOG_REPLAY, &list);
+                view_count++;
+            }
+        }
+        close(fd);
+        if (index_fd >= 0) close(index_fd);
+    }
+    closedir(dir);
+
+    qsort(list.entries, list.count, sizeof(ReplayEntry), compare_replay);
+    size_t first = list.count > CHATLOG_REPLAY ? list.count - CHATLOG_REPLAY : 0;
+    for (size_t i = first; i < list.count; i++) {
+        const ReplayEntry *e = &list.entries[i];
+        const char *peer_name = views[e->view].peer_name;
+        LogRecord record;
+        memset(&record, 0, sizeof(record));
+        record.when = e->when;
+        if (e->direction == CHATLOG_OUT) {
+            record.kind = LOG_CHAT_OUT;
+            snprintf(record.text, sizeof(record.text), "Me -> %s: %.*s", peer_name, (int)e->length, e->text);
+        } else {
+            record.kind = LOG_CHAT_IN;
+            snprintf(record.text, sizeof(record.text), "%s: %.*s", peer_name, (int)e->length, e->text);
+        }
+        log_submit(&record);
+    }
+    if (list.count > first) log_message("Restored %zu messages from earlier sessions", list.count - first);
+
+    free(list.entries);
+    for (size_t i = 0; i < view_count; i++) unmap_view(&views[i]);
+    free(views);
+}
+
+static int make_dir(const char *path) {
+    return mkdir(path, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+void init_chatlog() {
+    const char *home = getenv("HOME");
+    if (!home) return;
+
+    static const char *levels[] = { ".config", ".config/lume", ".config/lume/history" };
+    char dir[512];
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        snprintf(dir, sizeof(dir), "%s/%s", home, levels[i]);
+        if (make_dir(dir) < 0) {
+            log_message("Chat history disabled: cannot create %s", dir);
+            return;
+        }
+    }
+
+    // One directory per local identity, named like the peer logs
+    snprintf(log_dir, sizeof(log_dir), "%s", dir);
+    char user_dir[sizeof(log_dir)];
+    log_path(user_dir, sizeof(user_dir), app_state.local_username, "");
+    if (make_dir(user_dir) < 0) {
+        log_message("Chat history disabled: cannot create %s", user_dir);
+        log_dir[0] = '\0';
+        return;
+    }
+    snprintf(log_dir, sizeof(log_dir), "%s", user_dir);
+
+    replay_history();
+    if (pthread_create(&flusher, NULL, flusher_main, NULL) == 0) flusher_started = 1;
+}
+
+// Write out what is still pending and close every log
+void cleanup_chatlog() {
+    if (!flusher_started) return;
+
+    pthread_mutex_lock(&chatlog_mutex);
+    stopping = 1;
+    pthread_cond_signal(&chatlog_cond);
+    pthread_mutex_unlock(&chatlog_mutex);
+    pthread_join(flusher, NULL);
+
+    // Late appends see stopping and leave the logs alone
+    pthread_mutex_lock(&chatlog_mutex);
+    while (logs) {
+        ChatLog *log = logs;
+        logs = log->next;
+        if (log->fd >= 0) close(log->fd);
+        if (log->index_fd >= 0) close(log->index_fd);
+        free(log->pending);
+        free(log->spare);
+        free(log);
+    }
+    pthread_mutex_unlock(&chatlog_mutex);
+}
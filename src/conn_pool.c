@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../include/conn_pool.h"
+#include "../include/wire.h"
+
+// Idle outgoing connections, most recently released first
+static PooledConn *idle_list = NULL;
+static int idle_count = 0;
+static int pool_running = 0;
+static pthread_t reaper_tid;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+static void close_conn(PooledConn *conn) {
+    close(conn->sock);
+    free(conn);
+}
+
+/*
+ * An idle socket is only worth reusing if the peer has not closed it and
+ * nothing unexpected is waiting to be read. A zero-length peek means EOF,
+ * and any pending data would desynchronise the next exchange.
+ */
+static int conn_is_alive(const PooledConn *conn) {
+    char c;
+    ssize_t n = recv(conn->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+    return 0;
+}
+
+static void *pool_reaper(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += POOL_REAP_INTERVAL;
+        pthread_cond_timedwait(&pool_cond, &pool_mutex, &deadline);
+
+        time_t now = time(NULL);
+        PooledConn **link = &idle_list;
+        while (*link) {
+            PooledConn *conn = *link;
+            if (now - conn->last_used >= POOL_IDLE_TIMEOUT) {
+                *link = conn->next;
+                idle_count--;
+                close_conn(conn);
+            } else {
+                link = &conn->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+void init_conn_pool() {
+    pthread_mutex_lock(&pool_mutex);
+    pool_running = 1;
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_create(&reaper_tid, NULL, pool_reaper, NULL);
+}
+
+void cleanup_conn_pool() {
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool_running) {
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+    pool_running = 0;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_join(reaper_tid, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    while (idle_list) {
+        PooledConn *conn = idle_list;
+        idle_list = conn->next;
+        close_conn(conn);
+    }
+    idle_count = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Take a healthy idle connection to the peer, or NULL if there is none
+PooledConn *conn_pool_take_idle(struct in_addr ip_addr, int tcp_port) {
+    pthread_mutex_lock(&pool_mutex);
+    PooledConn **link = &idle_list;
+    while (*link) {
+        PooledConn *conn = *link;
+        if (conn->ip_addr.s_addr == ip_addr.s_addr && conn->tcp_port == tcp_port) {
+            *link = conn->next;
+            idle_count--;
+            if (conn_is_alive(conn)) {
+                pthread_mutex_unlock(&pool_mutex);
+                conn->next = NULL;
+                conn->reused = 1;
+                return conn;
+            }
+            close_conn(conn);
+        } else {
+            link = &conn->next;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+/*
+ * Wrap a connected blocking socket whose hellos have been exchanged, so
+ * that it can be released into the pool. The socket is closed on failure.
+ */
+PooledConn *conn_pool_adopt(int sock, struct in_addr ip_addr, int tcp_port, uint32_t caps) {
+    PooledConn *conn = calloc(1, sizeof(PooledConn));
+    if (!conn) {
+        close(sock);
+        return NULL;
+    }
+    conn->sock = sock;
+    conn->ip_addr = ip_addr;
+    conn->tcp_port = tcp_port;
+    conn->last_used = time(NULL);
+    conn->caps = caps;
+    return conn;
+}
+
+/*
+ * Hand out an exclusive connection to the given peer. Idle sockets are
+ * reused when still healthy; otherwise a fresh connection is opened and
+ * the hellos are exchanged on it. Returns NULL if the peer cannot be
+ * reached or does not speak the protocol.
+ */
+PooledConn *conn_pool_acquire(struct in_addr ip_addr, int tcp_port) {
+    PooledConn *idle = conn_pool_take_idle(ip_addr, tcp_port);
+    if (idle) return idle;
+
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return NULL;
+    tune_socket(sock);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(tcp_port);
+    addr.sin_addr = ip_addr;
+
+    WireHello hello;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || wire_handshake(sock, &hello) < 0) {
+        close(sock);
+        return NULL;
+    }
+    return conn_pool_adopt(sock, ip_addr, tcp_port, hello.caps);
+}
+
+// Return a connection that is still in a clean protocol state
+void conn_pool_release(PooledConn *conn) {
+    if (!conn) return;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (!pool_running) {
+        pthread_mutex_unlock(&pool_mutex);
+        close_conn(conn);
+        return;
+    }
+
+    // Make room by dropping the least recently used idle socket
+    if (idle_count >= POOL_MAX_IDLE) {
+        PooledConn **link = &idle_list;
+        while ((*link)->next) link = &(*link)->next;
+        close_conn(*link);
+        *link = NULL;
+        idle_count--;
+    }
+
+    conn->last_used = time(NULL);
+    conn->reused = 0;
+    conn->next = idle_list;
+    idle_list = conn;
+    idle_count++;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Drop a connection that failed or was left mid-exchange
+void conn_pool_discard(PooledConn *conn) {
+    if (conn) close_conn(conn);
+}
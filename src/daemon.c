@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "../include/daemon.h"
+#include "../include/app.h"
+#include "../include/log.h"
+#include "../include/peers.h"
+#include "../include/offers.h"
+#include "../include/outgoing.h"
+#include "../include/groups.h"
+#include "../include/fanout.h"
+
+/*
+ * Headless front end. Instead of the ncurses UI, one thread serves a UNIX
+ * socket that takes one command per line and answers each with a line
+ * starting "ok" or "error" (after any "peer" lines). A client that sends
+ * "events" also gets every log record as an "event" line; log records are
+ * copied to stderr as well. Everything runs on the calling thread through
+ * one epoll set, which is woken by the core's notify hook.
+ */
+#define EPOLL_LISTEN 0
+#define EPOLL_WAKE 1
+#define EPOLL_CLIENT 2          // Plus the client slot
+
+typedef struct {
+    int fd;                     // -1 when the slot is free
+    int events;                 // Subscribed to the event stream
+    int overlong;               // Skipping the rest of a line that did not fit
+    int dead;                   // Closed once the current pass is done
+    int want_write;             // EPOLLOUT is registered
+    size_t in_len;
+    char in[DAEMON_LINE_MAX];
+    char *out;
+    size_t out_start;           // Unsent bytes are out[out_start, out_len)
+    size_t out_len;
+    size_t out_cap;
+} Client;
+
+static Client clients[DAEMON_CLIENTS_MAX];
+static int listen_fd = -1;
+static int wake_fd = -1;
+static int epoll_fd = -1;
+static char socket_file[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static volatile sig_atomic_t stop_requested = 0;
+static atomic_int wake_pending = 0;     // A wakeup is in flight; cleared before draining
+
+static void wake() {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // Counter full: a wakeup is already pending
+    }
+}
+
+static void daemon_notify(int events) {
+    (void)events;
+    if (!atomic_exchange(&wake_pending, 1)) wake();
+}
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+    wake();
+}
+
+static void client_write(Client *c, const char *text, size_t len) {
+    if (c->fd < 0 || c->dead) return;
+    if (c->out_len - c->out_start + len > DAEMON_OUTPUT_MAX) {
+        fprintf(stderr, "Dropping a control client that stopped reading\n");
+        c->dead = 1;
+        return;
+    }
+    if (c->out_len + len > c->out_cap && c->out_start > 0) {
+        memmove(c->out, c->out + c->out_start, c->out_len - c->out_start);
+        c->out_len -= c->out_start;
+        c->out_start = 0;
+    }
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 4096;
+        while (cap < c->out_len + len) cap *= 2;
+        char *out = realloc(c->out, cap);
+        if (!out) {
+            c->dead = 1;
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, text, len);
+    c->out_len += len;
+}
+
+static void client_printf(Client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void client_printf(Client *c, const char *fmt, ...) {
+    char line[DAEMON_LINE_MAX + 128];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t)len >= sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    client_write(c, line, (size_t)len);
+}
+
+// Send what the socket takes now and watch for room if anything is left
+static void flush_client(Client *c) {
+    while (!c->dead && c->out_start < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_start, c->out_len - c->out_start, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) c->dead = 1;
+            break;
+        }
+        c->out_start += (size_t)n;
+    }
+    if (c->out_start == c->out_len) c->out_start = c->out_len = 0;
+
+    int want = !c->dead && c->out_len > 0;
+    if (want != c->want_write) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+        ev.data.u32 = EPOLL_CLIENT + (uint32_t)(c - clients);
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+}
+
+static void close_client(Client *c) {
+    close(c->fd);
+    free(c->out);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static void accept_clients() {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        Client *c = NULL;
+        for (int i = 0; i < DAEMON_CLIENTS_MAX && !c; i++) {
+            if (clients[i].fd < 0) c = &clients[i];
+        }
+        if (!c) {
+            static const char full[] = "error too many control connections\n";
+            if (send(fd, full, sizeof(full) - 1, MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+                // Closing anyway
+            }
+            close(fd);
+            continue;
+        }
+
+        c->fd = fd;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = EPOLL_CLIENT + (uint32_t)(c - clients);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) close_client(c);
+    }
+}
+
+// Control characters from peers must not break the one-line framing
+static void copy_line(char *dst, size_t size, const char *src) {
+    size_t i = 0;
+    for (; src[i] && i + 1 < size; i++) {
+        unsigned char ch = (unsigned char)src[i];
+        dst[i] = (ch < 32 || ch == 127) ? ' ' : (char)ch;
+    }
+    dst[i] = '\0';
+}
+
+static void broadcast(const char *line, size_t len) {
+    for (int i = 0; i < DAEMON_CLIENTS_MAX; i++) {
+        if (clients[i].fd >= 0 && clients[i].events) client_write(&clients[i], line, len);
+    }
+}
+
+static void emit_record(const LogRecord *record, void *arg) {
+    (void)arg;
+    char text[LOG_TEXT_LEN];
+    char line[LOG_TEXT_LEN + 384];
+    int len;
+
+    if (record->kind == LOG_HELP) return;
+    if (record->kind == LOG_FILE_OFFER) {
+        char sender[USERNAME_LEN], filename[256];
+        copy_line(sender, sizeof(sender), record->offer.sender);
+        copy_line(filename, sizeof(filename), record->offer.filename);
+        snprintf(text, sizeof(text), "File offer #%u from %s: %s (%zu bytes)",
+                 record->offer.id, sender, filename, record->offer.file_size);
+        len = snprintf(line, sizeof(line), "event offer %lld %u %zu %s %s\n", (long long)record->when,
+                       record->offer.id, record->offer.file_size, sender, filename);
+    } else {
+        const char *kind = record->kind == LOG_CHAT_IN ? "message" : record->kind == LOG_CHAT_OUT ? "sent" : "info";
+        copy_line(text, sizeof(text), record->text);
+        len = snprintf(line, sizeof(line), "event %s %lld %s\n", kind, (long long)record->when, text);
+    }
+
+    static char stamp[16];
+    static time_t stamp_when = -1;
+    if (record->when != stamp_when) {
+        struct tm tm;
+        localtime_r(&record->when, &tm);
+        strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+        stamp_when = record->when;
+    }
+    fprintf(stderr, "[%s] %s\n", stamp, text);
+
+    if (len > 0) broadcast(line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+static void drain_log() {
+    log_drain(emit_record, NULL);
+    fflush(stderr);
+    unsigned long lost = log_take_dropped();
+    if (lost) {
+        fprintf(stderr, "%lu log lines were dropped\n", lost);
+        char line[64];
+        int len = snprintf(line, sizeof(line), "event dropped %lld %lu\n", (long long)time(NULL), lost);
+        broadcast(line, (size_t)len);
+    }
+}
+
+// Split off the first space-separated word of *arg
+static char *next_word(char **arg) {
+    char *word = *arg;
+    char *end = word + strcspn(word, " ");
+    if (*end) *end++ = '\0';
+    while (*end == ' ') end++;
+    *arg = end;
+    return word;
+}
+
+// A peer is named by username, or by the id shown by "peers"
+static int find_peer(const char *name, Peer *out) {
+    if (peers_find_by_name(name, out)) return 1;
+    char *endptr;
+    unsigned long id = strtoul(name, &endptr, 10);
+    return *name && *endptr == '\0' && id > 0 && id <= UINT32_MAX && peers_find((uint32_t)id, out);
+}
+
+static void command_peers(Client *c) {
+    Peer stack[64];
+    Peer *list = stack;
+    int total = peers_list(stack, 64);
+    if (total > 64) {
+        int capacity = total;
+        list = malloc(capacity * sizeof(Peer));
+        if (!list) {
+            client_printf(c, "error out of memory\n");
+            return;
+        }
+        total = peers_list(list, capacity);
+        if (total > capacity) total = capacity;
+    }
+    for (int i = 0; i < total; i++) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &list[i].ip_addr, ip, sizeof(ip));
+        client_printf(c, "peer %u %s %s %d\n", list[i].id, list[i].username, ip, list[i].tcp_port);
+    }
+    client_printf(c, "ok %d\n", total);
+    if (list != stack) free(list);
+}
+
+static void command_send(Client *c, char *arg, int file) {
+    char *name = next_word(&arg);
+    Peer peer;
+    if (!*name || !*arg) {
+        client_printf(c, "error usage: %s <peer> <%s>\n", file ? "file" : "send", file ? "path" : "text");
+    } else if (!find_peer(name, &peer)) {
+        client_printf(c, "error no peer %s\n", name);
+    } else if (!file) {
+        send_text_message(&peer, arg);
+        client_printf(c, "ok\n");
+    } else {
+        uint32_t id = outgoing_enqueue(&peer, arg);
+        if (id) client_printf(c, "ok %u\n", id);
+        else client_printf(c, "error cannot send %s\n", arg);
+    }
+}
+
+// "all <text>" or "to <group> <text>"; delivery is reported as events
+static void command_fanout(Client *c, char *arg, int group) {
+    char *name = group ? next_word(&arg) : NULL;
+    if ((group && !*name) || !*arg) {
+        client_printf(c, "error usage: %s <text>\n", group ? "to <group>" : "all");
+        return;
+    }
+    int result = group ? fanout_to_group(name, arg) : fanout_to_all(arg);
+    if (result >= 0) client_printf(c, "ok %d\n", result);
+    else if (result == FANOUT_NO_PEERS) client_printf(c, "error no peers\n");
+    else if (result == FANOUT_NO_GROUP) client_printf(c, "error no group %s\n", name);
+    else client_printf(c, "error cannot send\n");
+}
+
+// "group" lists the groups, "group <name> [users...]" sets or removes one
+static void command_group(Client *c, char *arg) {
+    char *name = next_word(&arg);
+    if (!*name) {
+        char names[GROUPS_MAX][GROUP_NAME_LEN];
+        int count = groups_names(names, GROUPS_MAX);
+        for (int i = 0; i < count; i++) {
+            char members[GROUP_MEMBERS_LEN];
+            if (groups_find(names[i], members, sizeof(members))) client_printf(c, "group %s %s\n", names[i], members);
+        }
+        client_printf(c, "ok %d\n", count);
+        return;
+    }
+
+    int result = groups_set(name, arg);
+    if (result >= 0) client_printf(c, "ok\n");
+    else if (result == GROUP_UNKNOWN) client_printf(c, "error no group %s\n", name);
+    else if (result == GROUP_FULL) client_printf(c, "error too many groups\n");
+    else client_printf(c, "error invalid group %s\n", name);
+}
+
+static int parse_id(const char *arg, uint32_t *id) {
+    char *endptr;
+    unsigned long val = strtoul(arg, &endptr, 10);
+    if (endptr == arg || *endptr != '\0' || val == 0 || val > UINT32_MAX) return -1;
+    *id = (uint32_t)val;
+    return 0;
+}
+
+// Without an id the only pending offer is used, like /accept in the UI
+static void command_decide(Client *c, const char *arg, int decision) {
+    uint32_t id = 0;
+    if (*arg && parse_id(arg, &id) < 0) {
+        client_printf(c, "error invalid id %s\n", arg);
+        return;
+    }
+    int result = offers_decide(&id, decision);
+    if (result == 0) client_printf(c, "ok %u\n", id);
+    else if (result == OFFER_AMBIGUOUS) client_printf(c, "error several offers are pending\n");
+    else client_printf(c, "error no pending offer\n");
+}
+
+static void command_cancel(Client *c, const char *arg) {
+    uint32_t id;
+    if (parse_id(arg, &id) < 0) client_printf(c, "error usage: cancel <id>\n");
+    else if (!outgoing_cancel(id)) client_printf(c, "error no outgoing transfer %u\n", id);
+    else client_printf(c, "ok\n");
+}
+
+static void run_command(Client *c, char *line) {
+    char *arg = line;
+    char *command = next_word(&arg);
+
+    if (*command == '\0') {
+        return;
+    } else if (strcmp(command, "send") == 0) {
+        command_send(c, arg, 0);
+    } else if (strcmp(command, "file") == 0) {
+        command_send(c, arg, 1);
+    } else if (strcmp(command, "all") == 0) {
+        command_fanout(c, arg, 0);
+    } else if (strcmp(command, "to") == 0) {
+        command_fanout(c, arg, 1);
+    } else if (strcmp(command, "group") == 0) {
+        command_group(c, arg);
+    } else if (strcmp(command, "peers") == 0) {
+        command_peers(c);
+    } else if (strcmp(command, "accept") == 0) {
+        command_decide(c, arg, OFFER_ACCEPTED);
+    } else if (strcmp(command, "reject") == 0) {
+        command_decide(c, arg, OFFER_REJECTED);
+    } else if (strcmp(command, "cancel") == 0) {
+        command_cancel(c, arg);
+    } else if (strcmp(command, "events") == 0) {
+        c->events = 1;
+        client_printf(c, "ok\n");
+    } else if (strcmp(command, "shutdown") == 0) {
+        client_printf(c, "ok\n");
+        stop_requested = 1;
+    } else {
+        client_printf(c, "error unknown command %s\n", command);
+    }
+}
+
+// Run every complete line received so far; one read per wakeup keeps clients fair
+static void read_client(Client *c) {
+    ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        c->dead = 1;
+        return;
+    }
+    if (n < 0) return;
+    c->in_len += (size_t)n;
+
+    char *start = c->in;
+    char *end = c->in + c->in_len;
+    char *nl;
+    while (!c->dead && (nl = memchr(start, '\n', (size_t)(end - start))) != NULL) {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+        if (c->overlong) c->overlong = 0;
+        else run_command(c, start);
+        start = nl + 1;
+    }
+    c->in_len = (size_t)(end - start);
+    memmove(c->in, start, c->in_len);
+
+    if (c->in_len == sizeof(c->in)) {
+        if (!c->overlong) client_printf(c, "error line too long\n");
+        c->overlong = 1;
+        c->in_len = 0;
+    }
+}
+
+/*
+ * Start listening on socket_path, or ~/.config/lume/lume.sock when NULL.
+ * Call before init_network_threads() so no record is missed. A socket left
+ * behind by a daemon that died is replaced; a live one is an error.
+ */
+int init_daemon(const char *socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    char path[512];
+    if (!socket_path) {
+        const char *home = getenv("HOME");
+        if (!home) {
+            fprintf(stderr, "Error: HOME environment variable not set.\n");
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/.config", home);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/.config/lume", home);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/.config/lume/%s", home, DAEMON_SOCKET);
+        socket_path = path;
+    }
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "Another Lume daemon is listening on %s\n", socket_path);
+        close(probe);
+        return -1;
+    }
+    if (probe >= 0) close(probe);
+    unlink(socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(0077);
+    int bound = listen_fd >= 0 && bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listen_fd, 16) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", socket_path, strerror(errno));
+        if (listen_fd >= 0) close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+    strcpy(socket_file, socket_path);
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = EPOLL_LISTEN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+    ev.data.u32 = EPOLL_WAKE;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+
+    for (int i = 0; i < DAEMON_CLIENTS_MAX; i++) clients[i].fd = -1;
+
+    // Log lines are flushed once per drained batch instead of one write each
+    static char stderr_buf[1 << 16];
+    setvbuf(stderr, stderr_buf, _IOFBF, sizeof(stderr_buf));
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    app_set_notify(daemon_notify);
+    return 0;
+}
+
+// Serve the control socket until SIGINT, SIGTERM or "shutdown"
+void run_daemon() {
+    struct epoll_event events[32];
+    while (app_state.running && !stop_requested) {
+        int n = epoll_wait(epoll_fd, events, 32, -1);
+        if (n < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < n; i++) {
+            uint32_t slot = events[i].data.u32;
+            if (slot == EPOLL_LISTEN) {
+                accept_clients();
+            } else if (slot == EPOLL_WAKE) {
+                uint64_t count;
+                atomic_store(&wake_pending, 0);
+                if (read(wake_fd, &count, sizeof(count)) < 0) {
+                    // Already drained
+                }
+            } else {
+                Client *c = &clients[slot - EPOLL_CLIENT];
+                if (c->fd < 0) continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) read_client(c);
+            }
+        }
+
+        drain_log();
+        for (int i = 0; i < DAEMON_CLIENTS_MAX; i++) {
+            Client *c = &clients[i];
+            if (c->fd < 0) continue;
+            if (c->out_len > 0) flush_client(c);
+            if (c->dead) close_client(c);
+        }
+    }
+    app_state.running = 0;
+}
+
+void cleanup_daemon() {
+    app_set_notify(NULL);
+    drain_log();
+    for (int i = 0; i < DAEMON_CLIENTS_MAX; i++) {
+        if (clients[i].fd >= 0) {
+            flush_client(&clients[i]);
+            close_client(&clients[i]);
+        }
+    }
+    if (listen_fd >= 0) close(listen_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    if (wake_fd >= 0) close(wake_fd);
+    listen_fd = epoll_fd = wake_fd = -1;
+    if (socket_file[0]) unlink(socket_file);
+    socket_file[0] = '\0';
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include "../include/discovery.h"
+#include "../include/peers.h"
+#include "../include/wire.h"
+#include "../include/util.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+/*
+ * LAN discovery. A node that starts broadcasts a solicit, which also
+ * announces it, and every peer that hears one answers straight back to
+ * the sender by unicast, so a new node learns the whole LAN within a round
+ * trip. After that each node keeps announcing itself with beacons whose
+ * interval doubles, up to BEACON_INTERVAL_MAX_MS, for as long as its peer
+ * set stays unchanged, and drops back to BEACON_INTERVAL_MIN_MS when it
+ * changes. Intervals are jittered so nodes started together spread out.
+ *
+ * Datagrams go to 255.255.255.255, or with multicast=1 to a multicast
+ * group, which keeps them off hosts that are not running Lume. Solicits
+ * and beacons are sent from their own socket; unicast answers come back
+ * to it, since several nodes on one host share the listening port.
+ *
+ * Both sockets are drained DISCOVERY_BATCH datagrams at a time. Repeats
+ * from one sender within a batch collapse into a single update, and the
+ * batch goes into the peer table under one lock. The kernel's count of
+ * datagrams lost to a full receive buffer comes with each read through
+ * SO_RXQ_OVFL and is reported in the log.
+ */
+_Static_assert(PEER_EXPIRY_TIMEOUT * 1000 > 2 * BEACON_INTERVAL_MAX_MS * (100 + BEACON_JITTER_PCT) / 100,
+               "peers must survive a lost beacon at the longest interval");
+
+static int listen_sock = -1;            // Bound to BROADCAST_PORT: beacons and solicits
+static int send_sock = -1;              // Our beacons and solicits out, answers in
+static struct sockaddr_in dest_addr;
+static uint64_t jitter_state;
+static int answered = 0;                // A peer answered our solicit; stop repeating it
+
+static atomic_ulong received = 0;
+static atomic_ulong malformed = 0;
+static atomic_ulong dropped = 0;
+static uint32_t overflow[2];            // Kernel drop counters of listen_sock and send_sock
+
+// xorshift64; the spread only needs to differ between nodes
+static int jittered(int interval_ms) {
+    jitter_state ^= jitter_state << 13;
+    jitter_state ^= jitter_state >> 7;
+    jitter_state ^= jitter_state << 17;
+    int spread = interval_ms * BEACON_JITTER_PCT / 100;
+    return interval_ms - spread + (int)(jitter_state % (uint64_t)(2 * spread + 1));
+}
+
+static void send_datagram(int kind, const struct sockaddr_in *to) {
+    unsigned char buf[WIRE_BEACON_MAX];
+    size_t len = wire_encode_beacon(buf, kind);
+    sendto(send_sock, buf, len, 0, (const struct sockaddr *)to, sizeof(*to));
+}
+
+// Fold the kernel's running drop count for the socket into the total
+static void note_overflow(int sock, struct msghdr *msg) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SO_RXQ_OVFL) continue;
+        uint32_t count;
+        memcpy(&count, CMSG_DATA(c), sizeof(count));
+        uint32_t *last = &overflow[sock == send_sock];
+        if (count > *last) {
+            atomic_fetch_add(&dropped, count - *last);
+            *last = count;
+        }
+    }
+}
+
+static void add_solicitor(struct sockaddr_in *list, int *count, const struct sockaddr_in *addr) {
+    for (int i = 0; i < *count; i++) {
+        if (list[i].sin_addr.s_addr == addr->sin_addr.s_addr && list[i].sin_port == addr->sin_port) return;
+    }
+    list[(*count)++] = *addr;
+}
+
+// Read one batch; returns -1 once the socket has nothing more to read
+static int receive_batch(int sock) {
+    unsigned char bufs[DISCOVERY_BATCH][WIRE_BEACON_MAX + 1];
+    struct sockaddr_in from[DISCOVERY_BATCH];
+    union {
+        char buf[CMSG_SPACE(sizeof(uint32_t))];
+        struct cmsghdr align;
+    } control[DISCOVERY_BATCH];
+    struct iovec iov[DISCOVERY_BATCH];
+    struct mmsghdr msgs[DISCOVERY_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < DISCOVERY_BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof(bufs[i]);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_control = control[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+    }
+
+    int n = recvmmsg(sock, msgs, DISCOVERY_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) return errno == EINTR ? 0 : -1;
+    atomic_fetch_add(&received, n);
+
+    // Later beacons from a name replace earlier ones in the same batch
+    PeerUpdate updates[DISCOVERY_BATCH];
+    struct sockaddr_in solicitors[DISCOVERY_BATCH];
+    int count = 0, solicit_count = 0;
+    for (int i = 0; i < n; i++) {
+        note_overflow(sock, &msgs[i].msg_hdr);
+
+        WireBeacon beacon;
+        if ((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || msgs[i].msg_len > WIRE_BEACON_MAX ||
+            wire_parse_beacon(bufs[i], msgs[i].msg_len, &beacon) < 0) {
+            atomic_fetch_add(&malformed, 1);
+            continue;
+        }
+        if (strcmp(beacon.username, app_state.local_username) == 0) continue;
+
+        if (beacon.kind == WIRE_BEACON_SOLICIT) add_solicitor(solicitors, &solicit_count, &from[i]);
+        else if (sock == send_sock) answered = 1;
+
+        int j = 0;
+        while (j < count && strcmp(updates[j].username, beacon.username) != 0) j++;
+        if (j == count) count++;
+        memcpy(updates[j].username, beacon.username, USERNAME_LEN);
+        updates[j].ip_addr = from[i].sin_addr;
+        updates[j].tcp_port = beacon.tcp_port;
+    }
+
+    if (count > 0 && peers_update(updates, count) == 0) {
+        for (int i = 0; i < count; i++) {
+            if (updates[i].result == PEER_ADDED || updates[i].result == PEER_RENAMED) {
+                log_message("New peer discovered: %s", updates[i].peer.username);
+            }
+        }
+    }
+    for (int i = 0; i < solicit_count; i++) send_datagram(WIRE_BEACON_ANNOUNCE, &solicitors[i]);
+    return n < DISCOVERY_BATCH ? -1 : 0;
+}
+
+static int open_sockets() {
+    struct in_addr group;
+    if (app_state.multicast) {
+        const char *name = app_state.multicast_group[0] ? app_state.multicast_group : DISCOVERY_MULTICAST_GROUP;
+        if (inet_pton(AF_INET, name, &group) != 1 || !IN_MULTICAST(ntohl(group.s_addr))) {
+            log_message("Error: %s is not a multicast group", name);
+            return -1;
+        }
+    }
+
+    listen_sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    send_sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (listen_sock < 0 || send_sock < 0) return -1;
+
+    int on = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listen_sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+    setsockopt(send_sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(BROADCAST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_message("Error: Could not bind to UDP port %d for discovery", BROADCAST_PORT);
+        return -1;
+    }
+
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(BROADCAST_PORT);
+    if (app_state.multicast) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = group;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(listen_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            log_message("Error: Could not join multicast group %s", inet_ntoa(group));
+            return -1;
+        }
+        // Other nodes on this host hear us too; the group stays on the local link
+        unsigned char ttl = 1, loop = 1;
+        setsockopt(send_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(send_sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        dest_addr.sin_addr = group;
+    } else {
+        if (setsockopt(send_sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) < 0) return -1;
+        dest_addr.sin_addr.s_addr = inet_addr(BROADCAST_IP);
+    }
+    return 0;
+}
+
+static void *discovery_main(void *arg) {
+    (void)arg;
+    if (open_sockets() < 0) {
+        if (listen_sock >= 0) close(listen_sock);
+        if (send_sock >= 0) close(send_sock);
+        return NULL;
+    }
+    if (getrandom(&jitter_state, sizeof(jitter_state), 0) != sizeof(jitter_state) || jitter_state == 0) {
+        jitter_state = (uint64_t)now_ms() ^ ((uint64_t)getpid() << 32) ^ 1;
+    }
+
+    long long now = now_ms();
+    int solicits_left = SOLICIT_COUNT;
+    int solicit_gap = SOLICIT_RETRY_MS;
+    long long next_solicit = now;
+    int interval = BEACON_INTERVAL_MIN_MS;
+    long long next_beacon = now + jittered(interval);
+    unsigned seen_changes = peers_changes();
+    unsigned long reported_drops = 0;
+    long long next_drop_report = now;
+
+    struct pollfd fds[2] = { { listen_sock, POLLIN, 0 }, { send_sock, POLLIN, 0 } };
+    while (app_state.running) {
+        now = now_ms();
+        if (answered) solicits_left = 0;
+        if (solicits_left > 0 && now >= next_solicit) {
+            send_datagram(WIRE_BEACON_SOLICIT, &dest_addr);
+            solicits_left--;
+            next_solicit = now + solicit_gap;
+            solicit_gap *= 2;
+        }
+        if (now >= next_beacon) {
+            send_datagram(WIRE_BEACON_ANNOUNCE, &dest_addr);
+            unsigned changes = peers_changes();
+            if (changes != seen_changes) interval = BEACON_INTERVAL_MIN_MS;
+            else if (interval < BEACON_INTERVAL_MAX_MS) interval *= 2;
+            if (interval > BEACON_INTERVAL_MAX_MS) interval = BEACON_INTERVAL_MAX_MS;
+            seen_changes = changes;
+            next_beacon = now + jittered(interval);
+        }
+
+        unsigned long drops = atomic_load(&dropped);
+        if (drops > reported_drops && now >= next_drop_report) {
+            log_message("Discovery: %lu datagrams lost to a full receive buffer", drops - reported_drops);
+            reported_drops = drops;
+            next_drop_report = now + DISCOVERY_DROP_LOG_MS;
+        }
+
+        long long wake = next_beacon;
+        if (solicits_left > 0 && next_solicit < wake) wake = next_solicit;
+        long long timeout = wake - now;
+        if (timeout > DISCOVERY_TICK_MS) timeout = DISCOVERY_TICK_MS;
+        if (timeout < 0) timeout = 0;
+
+        if (poll(fds, 2, (int)timeout) <= 0) continue;
+        for (int i = 0; i < 2; i++) {
+            if (fds[i].revents & POLLIN) {
+                while (receive_batch(fds[i].fd) == 0) {}
+            }
+        }
+    }
+
+    close(listen_sock);
+    close(send_sock);
+    return NULL;
+}
+
+void discovery_stats(DiscoveryStats *out) {
+    out->received = atomic_load(&received);
+    out->malformed = atomic_load(&malformed);
+    out->dropped = atomic_load(&dropped);
+}
+
+void init_discovery() {
+    pthread_t tid;
+    pthread_create(&tid, NULL, discovery_main, NULL);
+    pthread_detach(tid);
+}
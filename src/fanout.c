@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "../include/fanout.h"
+#include "../include/groups.h"
+#include "../include/peers.h"
+#include "../include/conn_pool.h"
+#include "../include/chatlog.h"
+#include "../include/wire.h"
+#include "../include/util.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+/*
+ * One chat message sent to many peers at once. Every connection is driven
+ * from a single poll() loop on non-blocking sockets: fresh connections are
+ * all started together, and our hello and the frame go out in one write as
+ * soon as each connect completes. The whole fan-out therefore costs about
+ * one round trip to the slowest peer instead of one handshake per peer.
+ * A fresh socket joins the pool once the peer's hello has come back.
+ */
+typedef enum {
+    TARGET_CONNECTING,
+    TARGET_SENDING,
+    TARGET_READ_HELLO,
+    TARGET_DELIVERED,
+    TARGET_FAILED
+} TargetState;
+
+typedef struct {
+    Peer peer;
+    TargetState state;
+    PooledConn *conn;           // Reused idle connection, NULL for a fresh one
+    int sock;
+    size_t sent;                // Bytes of the job's wire buffer written
+    unsigned char hello[WIRE_HELLO_MAX];
+    size_t hello_len;
+    const char *error;          // Why it failed, or NULL to report err
+    int err;
+} FanoutTarget;
+
+typedef struct {
+    char label[FANOUT_LABEL_LEN];
+    char *msg;
+    unsigned char *wire;        // Our hello followed by the MSG_TEXT frame
+    size_t hello_len;
+    size_t wire_len;
+    int count;
+    FanoutTarget *targets;
+} FanoutJob;
+
+static void free_job(FanoutJob *job) {
+    free(job->targets);
+    free(job->wire);
+    free(job->msg);
+    free(job);
+}
+
+static FanoutJob *new_job(int count, const char *label, const char *msg) {
+    size_t msg_len = strlen(msg);
+    FanoutJob *job = calloc(1, sizeof(FanoutJob));
+    if (!job) return NULL;
+    job->targets = calloc(count, sizeof(FanoutTarget));
+    job->msg = strdup(msg);
+    job->wire = malloc(WIRE_HELLO_MAX + WIRE_HEADER_MAX + msg_len);
+    if (!job->targets || !job->msg || !job->wire) {
+        free_job(job);
+        return NULL;
+    }
+
+    snprintf(job->label, sizeof(job->label), "%s", label);
+    job->hello_len = wire_encode_hello(job->wire);
+    job->wire_len = job->hello_len + wire_encode_header(job->wire + job->hello_len, MSG_TEXT, msg_len);
+    memcpy(job->wire + job->wire_len, msg, msg_len);
+    job->wire_len += msg_len;
+    job->count = count;
+    for (int i = 0; i < count; i++) job->targets[i].sock = -1;
+    return job;
+}
+
+static void fail_target(FanoutTarget *t, const char *error, int err) {
+    if (t->conn) conn_pool_discard(t->conn);
+    else if (t->sock >= 0) close(t->sock);
+    t->conn = NULL;
+    t->sock = -1;
+    t->state = TARGET_FAILED;
+    t->error = error;
+    t->err = err;
+}
+
+static int set_blocking(int sock, int blocking) {
+    int flags = fcntl(sock, F_GETFL);
+    if (flags < 0) return -1;
+    return fcntl(sock, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
+static void open_target(FanoutTarget *t) {
+    t->conn = NULL;
+    t->sent = 0;
+    t->hello_len = 0;
+    t->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (t->sock < 0) {
+        fail_target(t, NULL, errno);
+        return;
+    }
+    tune_socket(t->sock);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(t->peer.tcp_port);
+    addr.sin_addr = t->peer.ip_addr;
+    if (connect(t->sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        t->state = TARGET_SENDING;
+    } else if (errno == EINPROGRESS) {
+        t->state = TARGET_CONNECTING;
+    } else {
+        fail_target(t, NULL, errno);
+    }
+}
+
+// Idle pooled sockets have exchanged hellos already, so they skip ours
+static void start_target(FanoutJob *job, FanoutTarget *t) {
+    t->conn = conn_pool_take_idle(t->peer.ip_addr, t->peer.tcp_port);
+    if (t->conn && set_blocking(t->conn->sock, 0) == 0) {
+        t->sock = t->conn->sock;
+        t->sent = job->hello_len;
+        t->state = TARGET_SENDING;
+    } else {
+        if (t->conn) conn_pool_discard(t->conn);
+        open_target(t);
+    }
+}
+
+static void write_target(FanoutJob *job, FanoutTarget *t) {
+    while (t->sent < job->wire_len) {
+        ssize_t n = send(t->sock, job->wire + t->sent, job->wire_len - t->sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            t->sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        // A reused socket may have been closed by the peer while idle
+        int err = n < 0 ? errno : EPIPE;
+        if (t->conn) {
+            conn_pool_discard(t->conn);
+            open_target(t);
+            if (t->state == TARGET_SENDING) continue;
+            return;
+        }
+        fail_target(t, NULL, err);
+        return;
+    }
+
+    if (t->conn) {
+        set_blocking(t->sock, 1);
+        conn_pool_release(t->conn);
+        t->conn = NULL;
+        t->sock = -1;
+        t->state = TARGET_DELIVERED;
+    } else {
+        t->state = TARGET_READ_HELLO;
+    }
+}
+
+static void read_hello(FanoutTarget *t) {
+    WireHello hello;
+    int need;
+    while ((need = wire_parse_hello(t->hello, t->hello_len, &hello)) > 0) {
+        ssize_t n = recv(t->sock, t->hello + t->hello_len, (size_t)need - t->hello_len, 0);
+        if (n > 0) {
+            t->hello_len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        fail_target(t, NULL, n == 0 ? ECONNRESET : errno);
+        return;
+    }
+    if (need < 0) {
+        fail_target(t, "not a Lume peer", 0);
+        return;
+    }
+
+    set_blocking(t->sock, 1);
+    conn_pool_release(conn_pool_adopt(t->sock, t->peer.ip_addr, t->peer.tcp_port, hello.caps));
+    t->sock = -1;
+    t->state = TARGET_DELIVERED;
+}
+
+// Drive every target to delivery or failure under one shared deadline
+static void run_job(FanoutJob *job) {
+    struct pollfd *fds = calloc(job->count, sizeof(struct pollfd));
+    int *owner = calloc(job->count, sizeof(int));
+    if (!fds || !owner) {
+        for (int i = 0; i < job->count; i++) {
+            if (job->targets[i].state != TARGET_FAILED) fail_target(&job->targets[i], NULL, ENOMEM);
+        }
+        free(fds);
+        free(owner);
+        return;
+    }
+
+    for (int i = 0; i < job->count; i++) {
+        FanoutTarget *t = &job->targets[i];
+        if (t->state == TARGET_FAILED) continue;
+        start_target(job, t);
+        if (t->state == TARGET_SENDING) write_target(job, t);
+    }
+
+    long long deadline = now_ms() + FANOUT_TIMEOUT_MS;
+    while (1) {
+        int n = 0;
+        for (int i = 0; i < job->count; i++) {
+            FanoutTarget *t = &job->targets[i];
+            short events;
+            if (t->state == TARGET_CONNECTING || t->state == TARGET_SENDING) events = POLLOUT;
+            else if (t->state == TARGET_READ_HELLO) events = POLLIN;
+            else continue;
+            fds[n].fd = t->sock;
+            fds[n].events = events;
+            fds[n].revents = 0;
+            owner[n++] = i;
+        }
+        long long remaining = deadline - now_ms();
+        if (n == 0 || remaining <= 0) break;
+
+        if (poll(fds, n, (int)remaining) < 0 && errno != EINTR) break;
+        for (int k = 0; k < n; k++) {
+            if (!fds[k].revents) continue;
+            FanoutTarget *t = &job->targets[owner[k]];
+            if (t->state == TARGET_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(t->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err) {
+                    fail_target(t, NULL, err);
+                    continue;
+                }
+                t->state = TARGET_SENDING;
+            }
+            if (t->state == TARGET_SENDING) write_target(job, t);
+            else if (t->state == TARGET_READ_HELLO) read_hello(t);
+        }
+    }
+
+    for (int i = 0; i < job->count; i++) {
+        FanoutTarget *t = &job->targets[i];
+        if (t->state != TARGET_DELIVERED && t->state != TARGET_FAILED) fail_target(t, NULL, ETIMEDOUT);
+    }
+    free(fds);
+    free(owner);
+}
+
+static void report_job(const FanoutJob *job) {
+    int delivered = 0;
+    for (int i = 0; i < job->count; i++) {
+        const FanoutTarget *t = &job->targets[i];
+        if (t->state == TARGET_DELIVERED) {
+            chatlog_append(t->peer.username, CHATLOG_OUT, job->msg);
+            delivered++;
+        }
+    }
+    if (delivered > 0) log_chat(LOG_CHAT_OUT, "Me -> %s: %s", job->label, job->msg);
+
+    for (int i = 0; i < job->count; i++) {
+        const FanoutTarget *t = &job->targets[i];
+        if (t->state == TARGET_FAILED) {
+            log_message("Not delivered to %s: %s", t->peer.username, t->error ? t->error : strerror(t->err));
+        }
+    }
+    if (delivered < job->count) log_message("Delivered to %d of %d peers", delivered, job->count);
+}
+
+static void *fanout_main(void *arg) {
+    FanoutJob *job = arg;
+    run_job(job);
+    report_job(job);
+    free_job(job);
+    return NULL;
+}
+
+// Returns the number of targets, like the public entry points
+static int start_job(FanoutJob *job) {
+    int count = job->count;     // The job is the thread's once it starts
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, fanout_main, job) != 0) {
+        free_job(job);
+        return FANOUT_FAILED;
+    }
+    pthread_detach(tid);
+    return count;
+}
+
+/*
+ * Send msg to every peer currently known. Delivery runs in the background
+ * and is reported through the log; returns the number of peers targeted
+ * or a negative FANOUT_* error.
+ */
+int fanout_to_all(const char *msg) {
+    Peer stack[64];
+    Peer *list = stack;
+    int total = peers_list(stack, 64);
+    if (total > 64) {
+        // Peers that appeared since the first count wait for the next /all
+        int capacity = total;
+        list = malloc(capacity * sizeof(Peer));
+        if (!list) return FANOUT_FAILED;
+        total = peers_list(list, capacity);
+        if (total > capacity) total = capacity;
+    }
+    if (total == 0) {
+        if (list != stack) free(list);
+        return FANOUT_NO_PEERS;
+    }
+
+    FanoutJob *job = new_job(total, "everyone", msg);
+    if (job) {
+        for (int i = 0; i < total; i++) job->targets[i].peer = list[i];
+    }
+    if (list != stack) free(list);
+    return job ? start_job(job) : FANOUT_FAILED;
+}
+
+/*
+ * Send msg to the members of a group. Members who are not online count
+ * as failed deliveries, so they show up in the report.
+ */
+int fanout_to_group(const char *group, const char *msg) {
+    char members[GROUP_MEMBERS_LEN];
+    if (!groups_find(group, members, sizeof(members))) return FANOUT_NO_GROUP;
+
+    int count = 1;
+    for (const char *p = members; *p; p++) count += *p == ' ';
+
+    char label[FANOUT_LABEL_LEN];
+    snprintf(label, sizeof(label), "group %s", group);
+    FanoutJob *job = new_job(count, label, msg);
+    if (!job) return FANOUT_FAILED;
+
+    int n = 0;
+    char *save;
+    for (char *name = strtok_r(members, " ", &save); name; name = strtok_r(NULL, " ", &save)) {
+        FanoutTarget *t = &job->targets[n];
+        if (!peers_find_by_name(name, &t->peer)) {
+            snprintf(t->peer.username, sizeof(t->peer.username), "%s", name);
+            t->state = TARGET_FAILED;
+            t->error = "not online";
+        } else {
+            // A member listed twice is only sent the message once
+            int duplicate = 0;
+            for (int i = 0; i < n; i++) {
+                if (job->targets[i].state != TARGET_FAILED && job->targets[i].peer.id == t->peer.id) duplicate = 1;
+            }
+            if (duplicate) continue;
+        }
+        n++;
+    }
+    job->count = n;
+    return start_job(job);
+}
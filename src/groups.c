@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "../include/groups.h"
+#include "../include/log.h"
+
+/*
+ * Named sets of peers for /to. Members are kept by username, so a group
+ * survives its members going offline and coming back on a new address.
+ * Every change rewrites the groups file through a rename.
+ */
+typedef struct {
+    char name[GROUP_NAME_LEN];
+    char members[GROUP_MEMBERS_LEN];
+} Group;
+
+static Group groups[GROUPS_MAX];
+static int group_count = 0;
+static char groups_path[512];
+static pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int valid_name(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0 || len >= GROUP_NAME_LEN) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!isalnum((unsigned char)name[i]) && name[i] != '-' && name[i] != '_') return 0;
+    }
+    return 1;
+}
+
+// Collapse runs of whitespace into single spaces; -1 if the result does not fit
+static int normalize_members(const char *members, char *out, size_t size) {
+    size_t len = 0;
+    const char *p = members;
+    while (*p) {
+        while (isspace((unsigned char)*p)) p++;
+        size_t word = 0;
+        while (p[word] && !isspace((unsigned char)p[word])) word++;
+        if (word == 0) break;
+        if (len + (len > 0) + word >= size) return -1;
+        if (len > 0) out[len++] = ' ';
+        memcpy(out + len, p, word);
+        len += word;
+        p += word;
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+static Group *find_group(const char *name) {
+    for (int i = 0; i < group_count; i++) {
+        if (strcmp(groups[i].name, name) == 0) return &groups[i];
+    }
+    return NULL;
+}
+
+// Called with groups_mutex held
+static void save_groups() {
+    if (!groups_path[0]) return;
+
+    char tmp[sizeof(groups_path) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", groups_path);
+    FILE *file = fopen(tmp, "w");
+    if (!file) {
+        log_message("Could not save groups to %s", groups_path);
+        return;
+    }
+    for (int i = 0; i < group_count; i++) {
+        fprintf(file, "%s %s\n", groups[i].name, groups[i].members);
+    }
+    if (fclose(file) != 0 || rename(tmp, groups_path) != 0) {
+        log_message("Could not save groups to %s", groups_path);
+        remove(tmp);
+    }
+}
+
+void init_groups() {
+    const char *home = getenv("HOME");
+    if (!home) return;
+    snprintf(groups_path, sizeof(groups_path), "%s/.config/lume/%s", home, GROUPS_FILE);
+
+    FILE *file = fopen(groups_path, "r");
+    if (!file) return;
+
+    char line[GROUP_NAME_LEN + GROUP_MEMBERS_LEN + 2];
+    pthread_mutex_lock(&groups_mutex);
+    while (group_count < GROUPS_MAX && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *members = line + strcspn(line, " ");
+        if (*members) *members++ = '\0';
+
+        Group *g = &groups[group_count];
+        if (!valid_name(line) || find_group(line) ||
+            normalize_members(members, g->members, sizeof(g->members)) < 0 || !g->members[0]) {
+            continue;
+        }
+        memcpy(g->name, line, strlen(line) + 1);   // valid_name() checked the length
+        group_count++;
+    }
+    pthread_mutex_unlock(&groups_mutex);
+    fclose(file);
+}
+
+/*
+ * Define or replace a group. An empty member list removes it. Returns
+ * GROUP_SAVED or GROUP_REMOVED, or one of the negative GROUP_* errors.
+ */
+int groups_set(const char *name, const char *members) {
+    char list[GROUP_MEMBERS_LEN];
+    if (!valid_name(name) || normalize_members(members, list, sizeof(list)) < 0) return GROUP_INVALID;
+
+    pthread_mutex_lock(&groups_mutex);
+    Group *g = find_group(name);
+    int result;
+    if (!list[0]) {
+        if (g) {
+            *g = groups[--group_count];
+            result = GROUP_REMOVED;
+        } else {
+            result = GROUP_UNKNOWN;
+        }
+    } else if (!g && group_count == GROUPS_MAX) {
+        result = GROUP_FULL;
+    } else {
+        if (!g) {
+            g = &groups[group_count++];
+            snprintf(g->name, sizeof(g->name), "%s", name);
+        }
+        memcpy(g->members, list, sizeof(list));
+        result = GROUP_SAVED;
+    }
+    if (result >= 0) save_groups();
+    pthread_mutex_unlock(&groups_mutex);
+    return result;
+}
+
+// Copy the space-separated members of a group; 0 if there is no such group
+int groups_find(const char *name, char *members, size_t size) {
+    pthread_mutex_lock(&groups_mutex);
+    Group *g = find_group(name);
+    if (g) snprintf(members, size, "%s", g->members);
+    pthread_mutex_unlock(&groups_mutex);
+    return g != NULL;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+// Copy up to max group names, sorted; returns how many groups exist
+int groups_names(char names[][GROUP_NAME_LEN], int max) {
+    pthread_mutex_lock(&groups_mutex);
+    int total = group_count;
+    int n = total < max ? total : max;
+    for (int i = 0; i < n; i++) memcpy(names[i], groups[i].name, GROUP_NAME_LEN);
+    pthread_mutex_unlock(&groups_mutex);
+
+    qsort(names, n, GROUP_NAME_LEN, compare_names);
+    return total;
+}
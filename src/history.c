@@ -0,0 +1,109 @@
+#include <string.h>
+#include "../include/history.h"
+
+#define HISTORY_MASK (HISTORY_LINES - 1)
+#define RUN_HEADER 2            // Style byte, length byte
+#define RUN_MAX 255
+
+/*
+ * Chat scrollback. Line bytes live in one fixed arena used as a ring and
+ * each line has a slot in a fixed index ring, so memory is capped and
+ * adding a line never allocates. The oldest lines are evicted when either
+ * ring is full. Lines are numbered by a sequence that only grows, which
+ * lets the view keep its place while old lines fall off. Only the UI
+ * thread touches it, so there is no locking.
+ */
+typedef struct {
+    uint64_t pos;               // Absolute arena offset; modulo the size gives the byte
+    uint16_t len;
+    uint16_t width;
+} HistoryEntry;
+
+static unsigned char arena[HISTORY_ARENA_SIZE];
+static HistoryEntry lines[HISTORY_LINES];
+static uint64_t first_seq;      // Oldest line kept
+static uint64_t end_seq;        // One past the newest line
+static uint64_t arena_head;     // Absolute offset of the next free byte
+
+void history_line_init(HistoryLine *line) {
+    line->len = 0;
+    line->width = 0;
+}
+
+// Append text in one style; control characters become spaces
+void history_line_add(HistoryLine *line, int style, const char *text) {
+    history_line_addn(line, style, text, strlen(text));
+}
+
+void history_line_addn(HistoryLine *line, int style, const char *text, size_t remaining) {
+    while (remaining > 0 && line->len + RUN_HEADER < sizeof(line->data)) {
+        size_t room = sizeof(line->data) - line->len - RUN_HEADER;
+        size_t chunk = remaining < RUN_MAX ? remaining : RUN_MAX;
+        if (chunk > room) chunk = room;
+
+        unsigned char *run = line->data + line->len;
+        run[0] = (unsigned char)style;
+        run[1] = (unsigned char)chunk;
+        for (size_t i = 0; i < chunk; i++) {
+            unsigned char c = (unsigned char)text[i];
+            run[RUN_HEADER + i] = (c < 32 || c == 127) ? ' ' : c;
+        }
+        line->len += RUN_HEADER + chunk;
+        line->width += (int)chunk;
+        text += chunk;
+        remaining -= chunk;
+    }
+}
+
+// Copy a finished line into the store, evicting the oldest to make room
+void history_push(const HistoryLine *line) {
+    uint64_t start = arena_head;
+    size_t offset = start % HISTORY_ARENA_SIZE;
+    // A line never straddles the end of the arena; skip the tail instead
+    if (offset + line->len > HISTORY_ARENA_SIZE) {
+        start += HISTORY_ARENA_SIZE - offset;
+        offset = 0;
+    }
+    uint64_t head = start + line->len;
+
+    while (first_seq < end_seq &&
+           (end_seq - first_seq == HISTORY_LINES || head - lines[first_seq & HISTORY_MASK].pos > HISTORY_ARENA_SIZE)) {
+        first_seq++;
+    }
+
+    memcpy(arena + offset, line->data, line->len);
+    HistoryEntry *entry = &lines[end_seq & HISTORY_MASK];
+    entry->pos = start;
+    entry->len = (uint16_t)line->len;
+    entry->width = (uint16_t)line->width;
+    end_seq++;
+    arena_head = head;
+}
+
+uint64_t history_first() {
+    return first_seq;
+}
+
+uint64_t history_end() {
+    return end_seq;
+}
+
+// Encoded bytes of a kept line, or NULL once it has been evicted
+const unsigned char *history_get(uint64_t seq, size_t *len, int *width) {
+    if (seq < first_seq || seq >= end_seq) return NULL;
+    const HistoryEntry *entry = &lines[seq & HISTORY_MASK];
+    *len = entry->len;
+    *width = entry->width;
+    return arena + entry->pos % HISTORY_ARENA_SIZE;
+}
+
+// Decode the run at *cursor and advance past it; returns 0 at the end
+int history_next_run(const unsigned char **cursor, const unsigned char *end, HistoryRun *run) {
+    const unsigned char *p = *cursor;
+    if (end - p < RUN_HEADER) return 0;
+    run->style = p[0];
+    run->len = p[1];
+    run->text = (const char *)p + RUN_HEADER;
+    *cursor = p + RUN_HEADER + run->len;
+    return 1;
+}
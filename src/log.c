@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../include/log.h"
+#include "../include/app.h"
+
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+/*
+ * Bounded multi-producer, single-consumer ring (Vyukov's sequence-per-slot
+ * design). Any thread claims a slot with one CAS on enqueue_pos, formats
+ * straight into it and publishes it by advancing the slot's sequence; only
+ * the front end's thread (the UI or the daemon) consumes. When the ring is
+ * full a status line is dropped rather than block a network thread, and the
+ * front end reports how many were lost. Chat lines, file offers and the help
+ * listing are never dropped: they go to an overflow list instead, and while
+ * that list is non-empty every new record follows them there (or is dropped,
+ * for a status line) so the order is kept.
+ *
+ * A slot's sequence is stored minus its index, so the zero-initialised
+ * array is already in the "free for the first lap" state.
+ */
+typedef struct {
+    atomic_size_t seq;
+    LogRecord record;
+} LogSlot;
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;              // Owned by the consumer
+static atomic_ulong dropped;
+
+// Records that did not fit the ring, consumed once the ring is empty
+typedef struct LogOverflow {
+    LogRecord record;                   // First, so a record maps back to its node
+    struct LogOverflow *next;
+} LogOverflow;
+
+static LogOverflow *overflow_head = NULL;
+static LogOverflow *overflow_tail = NULL;
+static pthread_mutex_t overflow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int overflow_pending;
+
+static size_t slot_seq(LogSlot *slot, size_t pos, memory_order order) {
+    return atomic_load_explicit(&slot->seq, order) + (pos & LOG_RING_MASK);
+}
+
+static void set_slot_seq(LogSlot *slot, size_t pos, size_t seq) {
+    atomic_store_explicit(&slot->seq, seq - (pos & LOG_RING_MASK), memory_order_release);
+}
+
+// Claim the next free slot; NULL when the consumer is a full lap behind
+static LogSlot *claim_slot(size_t *pos_out) {
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        LogSlot *slot = &ring[pos & LOG_RING_MASK];
+        ptrdiff_t dif = (ptrdiff_t)(slot_seq(slot, pos, memory_order_acquire) - pos);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return slot;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Space for one record of the given kind: a ring slot (*slot_out set), an
+ * overflow node (*slot_out NULL), or NULL if a status line has to be dropped.
+ */
+static LogRecord *claim_record(LogKind kind, LogSlot **slot_out, size_t *pos_out) {
+    if (!atomic_load_explicit(&overflow_pending, memory_order_acquire)) {
+        LogSlot *slot = claim_slot(pos_out);
+        if (slot) {
+            *slot_out = slot;
+            return &slot->record;
+        }
+    }
+    LogOverflow *node = kind == LOG_INFO ? NULL : malloc(sizeof(LogOverflow));
+    if (!node) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    *slot_out = NULL;
+    return &node->record;
+}
+
+static void publish_record(LogRecord *record, LogSlot *slot, size_t pos) {
+    if (slot) {
+        set_slot_seq(slot, pos, pos + 1);
+    } else {
+        LogOverflow *node = (LogOverflow *)record;
+        node->next = NULL;
+        pthread_mutex_lock(&overflow_mutex);
+        if (overflow_tail) overflow_tail->next = node;
+        else overflow_head = node;
+        overflow_tail = node;
+        atomic_store_explicit(&overflow_pending, 1, memory_order_release);
+        pthread_mutex_unlock(&overflow_mutex);
+    }
+    app_notify(APP_EVENT_LOG);
+}
+
+static void log_vformat(LogKind kind, const char *fmt, va_list args) {
+    LogSlot *slot;
+    size_t pos;
+    LogRecord *record = claim_record(kind, &slot, &pos);
+    if (!record) return;
+
+    record->kind = kind;
+    record->when = time(NULL);
+    vsnprintf(record->text, sizeof(record->text), fmt, args);
+    publish_record(record, slot, pos);
+}
+
+// Queue a status line for the chat window
+void log_message(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_vformat(LOG_INFO, fmt, args);
+    va_end(args);
+}
+
+// Queue a chat line; kind is LOG_CHAT_IN or LOG_CHAT_OUT
+void log_chat(LogKind kind, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_vformat(kind, fmt, args);
+    va_end(args);
+}
+
+// Queue a prebuilt record; returns -1 if it had to be dropped
+int log_submit(const LogRecord *record) {
+    LogSlot *slot;
+    size_t pos;
+    LogRecord *copy = claim_record(record->kind, &slot, &pos);
+    if (!copy) return -1;
+
+    *copy = *record;
+    if (copy->when == 0) copy->when = time(NULL);
+    publish_record(copy, slot, pos);
+    return 0;
+}
+
+// Queue the prompt for an incoming file; the front end decides on it
+void log_file_offer(uint32_t offer_id, const char *sender, const char *filename, size_t file_size) {
+    LogRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = LOG_FILE_OFFER;
+    record.offer.id = offer_id;
+    record.offer.file_size = file_size;
+    strncpy(record.offer.sender, sender, sizeof(record.offer.sender) - 1);
+    strncpy(record.offer.filename, filename, sizeof(record.offer.filename) - 1);
+    log_submit(&record);
+}
+
+/*
+ * Hand every published record to the sink in order, stopping at the first
+ * slot still being written. The overflow list is only taken once the ring
+ * is empty, since everything in it is newer. Consumer side: front end
+ * thread only. Returns the number of records drained.
+ */
+int log_drain(LogSink sink, void *arg) {
+    int count = 0;
+    for (;;) {
+        LogSlot *slot = &ring[dequeue_pos & LOG_RING_MASK];
+        if (slot_seq(slot, dequeue_pos, memory_order_acquire) != dequeue_pos + 1) break;
+
+        sink(&slot->record, arg);
+        set_slot_seq(slot, dequeue_pos, dequeue_pos + LOG_RING_SIZE);
+        dequeue_pos++;
+        count++;
+    }
+
+    if (!atomic_load_explicit(&overflow_pending, memory_order_acquire) ||
+        atomic_load_explicit(&enqueue_pos, memory_order_relaxed) != dequeue_pos) {
+        return count;
+    }
+    pthread_mutex_lock(&overflow_mutex);
+    LogOverflow *node = overflow_head;
+    overflow_head = overflow_tail = NULL;
+    atomic_store_explicit(&overflow_pending, 0, memory_order_release);
+    pthread_mutex_unlock(&overflow_mutex);
+
+    while (node) {
+        LogOverflow *next = node->next;
+        sink(&node->record, arg);
+        free(node);
+        node = next;
+        count++;
+    }
+    return count;
+}
+
+// Status lines lost to a full ring since the last call
+unsigned long log_take_dropped() {
+    return atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+}
@@ -7,8 +7,30 @@
 #include <sys/types.h>
 
 #include "../include/network.h"
+#include "../include/conn_pool.h"
+#include "../include/workers.h"
+#include "../include/reactor.h"
+#include "../include/peers.h"
+#include "../include/chatlog.h"
+#include "../include/groups.h"
+#include "../include/daemon.h"
 #include "../include/ui.h"
 
+// Parse "key=<integer>" into *out if the whole value is a number in [min, max]
+static void config_int(const char *line, const char *key, long min, long max, int *out) {
+    size_t key_len = strlen(key);
+    if (strncmp(line, key, key_len) != 0) return;
+
+    const char *val = line + key_len;
+    while (isspace((unsigned char)*val)) val++;
+    char *endptr;
+    long value = strtol(val, &endptr, 10);
+    while (isspace((unsigned char)*endptr)) endptr++;
+    if (endptr != val && (*endptr == '\0' || *endptr == '\r') && value >= min && value <= max) {
+        *out = (int)value;
+    }
+}
+
 /*
  * Load configuration from ~/.config/lume/lume.conf
  *
@@ -16,6 +38,18 @@
  *   username=user
  *   port=8080
  *
+ * Optional tuning keys are applied to app_state directly:
+ *   file_streams=0     (parallel connections per file transfer, 0 = automatic)
+ *   tcp_nodelay=1      (send chat frames immediately instead of waiting on Nagle)
+ *   tcp_cork=1         (cork file bodies so only full segments are sent)
+ *   socket_sndbuf=0    (SO_SNDBUF in bytes for peer connections, 0 = kernel default)
+ *   socket_rcvbuf=0    (SO_RCVBUF in bytes for peer connections, 0 = kernel default)
+ *   multicast=0        (discover peers through a multicast group instead of broadcast)
+ *   multicast_group=239.255.76.77
+ *   worker_threads=4   (threads receiving file bodies, 1-64)
+ *   max_connections=1024 (incoming connections held open before accepting pauses)
+ *   io_uring=0         (move file bodies through io_uring; needs a make IO_URING=1 build)
+ *
  * Returns 1 on success (only if BOTH username and port are present),
  * 0 on failure (including when only one of them is configured).
  */
@@ -76,6 +110,19 @@ int load_config_file(char *username, int *port) {
                 *port = (int)port_val;
                 found_port = 1;
             }
+        } else {
+            config_int(line, "file_streams=", 0, MAX_FILE_STREAMS, &app_state.file_streams);
+            config_int(line, "tcp_nodelay=", 0, 1, &app_state.tcp_nodelay);
+            config_int(line, "tcp_cork=", 0, 1, &app_state.tcp_cork);
+            config_int(line, "socket_sndbuf=", 0, SOCKET_BUFFER_MAX, &app_state.socket_sndbuf);
+            config_int(line, "socket_rcvbuf=", 0, SOCKET_BUFFER_MAX, &app_state.socket_rcvbuf);
+            config_int(line, "multicast=", 0, 1, &app_state.multicast);
+            config_int(line, "worker_threads=", 1, WORKER_THREADS_MAX, &app_state.worker_threads);
+            config_int(line, "max_connections=", 1, REACTOR_CONNECTIONS_LIMIT, &app_state.max_connections);
+            config_int(line, "io_uring=", 0, 1, &app_state.io_uring);
+            if (strncmp(line, "multicast_group=", 16) == 0) {
+                snprintf(app_state.multicast_group, sizeof(app_state.multicast_group), "%.15s", line + 16);
+            }
         }
     }
 
@@ -148,21 +195,38 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
-    if (argc == 3) {
+    // "--daemon [--socket PATH]" goes before the usual arguments
+    int daemon_mode = 0;
+    const char *socket_path = NULL;
+    int first = 1;
+    if (argc > first && strcmp(argv[first], "--daemon") == 0) {
+        daemon_mode = 1;
+        first++;
+        if (argc > first + 1 && strcmp(argv[first], "--socket") == 0) {
+            socket_path = argv[first + 1];
+            first += 2;
+        }
+    }
+    int rest = argc - first;
+
+    // Tuning keys apply even when the identity comes from the command line
+    int have_config = load_config_file(config_username, &config_port);
+
+    if (rest == 2) {
         // 1️⃣ Use command-line arguments
         memset(app_state.local_username, 0, USERNAME_LEN);
-        strncpy(app_state.local_username, argv[1], USERNAME_LEN - 1);
+        strncpy(app_state.local_username, argv[first], USERNAME_LEN - 1);
 
         char *endptr;
-        long val = strtol(argv[2], &endptr, 10);
-        if (*argv[2] != '\0' && *endptr == '\0' && val >= 1 && val <= 65535) {
+        long val = strtol(argv[first + 1], &endptr, 10);
+        if (*argv[first + 1] != '\0' && *endptr == '\0' && val >= 1 && val <= 65535) {
             app_state.local_tcp_port = (int)val;
         } else {
-            fprintf(stderr, "Invalid port: %s. Port must be between 1 and 65535.\n", argv[2]);
+            fprintf(stderr, "Invalid port: %s. Port must be between 1 and 65535.\n", argv[first + 1]);
             return 1;
         }
 
-    } else if (argc == 1 && load_config_file(config_username, &config_port)) {
+    } else if (rest == 0 && have_config) {
         // 2️⃣ Fallback to config file when no CLI arguments are provided
         memset(app_state.local_username, 0, USERNAME_LEN);
         strncpy(app_state.local_username, config_username, USERNAME_LEN - 1);
@@ -170,7 +234,7 @@ int main(int argc, char *argv[]) {
 
     } else {
         // 3️⃣ Invalid args or no config available
-        if (argc == 1) {
+        if (rest == 0) {
             fprintf(stderr, "Error: Configuration file not found at ~/.config/lume/lume.conf\n");
             fprintf(stderr, "Please run '%s config' to set up your profile or provide arguments:\n", argv[0]);
         } else {
@@ -179,6 +243,8 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "  %s <username> <tcp_port>  (Start with specific settings)\n", argv[0]);
         fprintf(stderr, "  %s config                 (Configure interactively)\n", argv[0]);
         fprintf(stderr, "  %s                        (Start using saved config)\n", argv[0]);
+        fprintf(stderr, "  %s --daemon [--socket PATH] [<username> <tcp_port>]\n", argv[0]);
+        fprintf(stderr, "                            (Run without a terminal, controlled over a UNIX socket)\n");
         return 1;
     }
 
@@ -186,16 +252,31 @@ int main(int argc, char *argv[]) {
     if (!get_local_ip(app_state.local_ip, sizeof(app_state.local_ip))) {
         strncpy(app_state.local_ip, "unknown", sizeof(app_state.local_ip));
     }
+    app_state.running = 1;
 
-    init_ui();
+    // The front end registers for core events before any network thread starts
+    if (daemon_mode) {
+        if (init_daemon(socket_path) < 0) return 1;
+    } else {
+        init_ui();
+    }
+    init_chatlog();
+    init_groups();
     init_network_threads();
 
     log_message("Welcome to Lume, %s!", app_state.local_username);
     log_message("Listening on port %d...", app_state.local_tcp_port);
-    log_message("Type /help for available commands");
-
-    handle_input();
+    if (daemon_mode) {
+        run_daemon();
+    } else {
+        log_message("Type /help for available commands");
+        handle_input();
+    }
 
-    cleanup_ui();
+    cleanup_conn_pool();
+    cleanup_peers();
+    cleanup_chatlog();
+    if (daemon_mode) cleanup_daemon();
+    else cleanup_ui();
     return 0;
 }
@@ -5,29 +5,57 @@
 #include <ifaddrs.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <sys/random.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "../include/network.h"
-#include "../include/ui.h"
-
-static ssize_t send_all(int sock, const void *buf, size_t len) {
-    size_t total = 0;
-    const char *p = buf;
-    while (total < len) {
-        ssize_t n = send(sock, p + total, len - total, 0);
-        if (n <= 0) return n;
-        total += n;
+#include "../include/peers.h"
+#include "../include/discovery.h"
+#include "../include/conn_pool.h"
+#include "../include/outgoing.h"
+#include "../include/reactor.h"
+#include "../include/transfer.h"
+#include "../include/stripes.h"
+#include "../include/workers.h"
+#include "../include/chatlog.h"
+#include "../include/wire.h"
+#include "../include/util.h"
+#include "../include/tree.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+/*
+ * Apply the per-socket options from lume.conf to a peer connection. Chat
+ * frames are small and latency bound, so Nagle is off by default; file
+ * bodies get batched separately with TCP_CORK. Buffer sizes only matter
+ * when set before connect() or listen(), since they fix the window scale.
+ */
+void tune_socket(int sock) {
+    int on = app_state.tcp_nodelay ? 1 : 0;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (app_state.socket_sndbuf > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &app_state.socket_sndbuf, sizeof(int));
+    }
+    if (app_state.socket_rcvbuf > 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &app_state.socket_rcvbuf, sizeof(int));
     }
-    return total;
 }
 
-void send_file_response(int sock, int accepted) {
-    MessagePacket response;
-    memset(&response, 0, sizeof(response));
-    response.type = accepted ? MSG_FILE_ACCEPT : MSG_FILE_REJECT;
-    strncpy(response.sender_name, app_state.local_username, USERNAME_LEN - 1);
-    response.payload_len = 0;
-    send_all(sock, &response, sizeof(response));
+/*
+ * Answer a file offer. An acceptance carries the negotiated capabilities
+ * as its payload; when none were agreed it is sent bare.
+ */
+void send_file_response(int sock, int accepted, const FileAccept *accept) {
+    unsigned char payload[WIRE_ACCEPT_MAX];
+    size_t payload_len = 0;
+    if (accepted && accept && accept->flags) payload_len = wire_encode_accept(payload, accept);
+    wire_send_frame(sock, accepted ? MSG_FILE_ACCEPT : MSG_FILE_REJECT, payload, payload_len, 0);
 }
 
 int get_local_ip(char *ip_buffer, size_t buffer_size) {
@@ -63,358 +91,561 @@ int get_local_ip(char *ip_buffer, size_t buffer_size) {
     return found;
 }
 
-void *beacon_sender(void *arg) {
-    (void)arg;
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) return NULL;
-
-    int broadcast = 1;
-    if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &broadcast, sizeof(broadcast)) < 0) {
-        close(sock);
-        return NULL;
+// Report how a received file ended, moving a completed .part into place
+void finish_received_file(const char *part_path, const char *filename, int status) {
+    if (status == TRANSFER_OK) {
+        if (part_path && rename(part_path, filename) < 0) {
+            log_message("Received %s but could not rename it from %s", filename, part_path);
+        } else {
+            log_message("File received: %s", filename);
+        }
+    } else if (status == TRANSFER_WRITE_ERROR) {
+        log_message("Failed to write file: %s", filename);
+    } else if (part_path) {
+        log_message("File transfer interrupted: %s (partial data kept for resume)", filename);
+    } else {
+        log_message("File transfer interrupted: %s", filename);
     }
+}
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(BROADCAST_PORT);
-    addr.sin_addr.s_addr = inet_addr(BROADCAST_IP);
+// Parallel connections we are willing to serve for one offer
+static uint32_t grant_streams(uint32_t requested) {
+    uint32_t streams = requested;
+    if (streams > MAX_FILE_STREAMS) streams = MAX_FILE_STREAMS;
+    // More stripes than workers would only queue behind each other
+    if (streams > (uint32_t)workers_count()) streams = workers_count();
+    return streams;
+}
 
-    BeaconPacket packet;
-    while (app_state.running) {
-        memset(packet.username, 0, USERNAME_LEN);
-        strncpy(packet.username, app_state.local_username, USERNAME_LEN - 1);
-        packet.tcp_port = app_state.local_tcp_port;
+/*
+ * Accept a directory offer and receive the tree over this one connection.
+ * Runs on a worker thread like receive_file(). The tree is built in an
+ * empty .<name>.part created before answering and only renamed to ./<name>
+ * once complete, so an existing ./<name> is refused rather than merged
+ * into. Returns -1 if the stream broke, 0 otherwise.
+ */
+static int receive_tree(int sock, const FileMetadata *meta) {
+    const char *name = meta->filename;
+    if (!(meta->flags & FILE_CAP_STREAM) || !tree_valid_name(name)) {
+        log_message("Rejected directory with an unsafe name: %s", name);
+        send_file_response(sock, 0, NULL);
+        return 0;
+    }
 
-        sendto(sock, &packet, sizeof(packet), 0, (struct sockaddr *)&addr, sizeof(addr));
-        sleep(3);
+    struct stat st;
+    if (lstat(name, &st) == 0) {
+        log_message("Rejected directory %s: it already exists", name);
+        send_file_response(sock, 0, NULL);
+        return 0;
+    }
+    char staging[300];
+    snprintf(staging, sizeof(staging), ".%s.part", name);
+    if (mkdir(staging, 0755) < 0) {
+        log_message("Failed to create %s for directory %s", staging, name);
+        send_file_response(sock, 0, NULL);
+        return 0;
     }
 
-    close(sock);
-    return NULL;
+    FileAccept accept;
+    memset(&accept, 0, sizeof(accept));
+    accept.flags = FILE_CAP_STREAM | FILE_CAP_TREE;
+    accept.streams = 1;
+    send_file_response(sock, 1, &accept);
+
+    int files, failed;
+    int status = tree_receive(sock, staging, meta->file_size, &files, &failed);
+    if (status == TRANSFER_OK) {
+        if (rename(staging, name) < 0) {
+            log_message("Received directory %s but could not rename it from %s", name, staging);
+        } else {
+            log_message("Directory received: %s (%d files)", name, files);
+        }
+        return 0;
+    }
+    rmdir(staging);
+    if (status == TRANSFER_WRITE_ERROR) {
+        log_message("Directory %s discarded: %d entries could not be written", name, failed);
+    } else {
+        log_message("Directory transfer interrupted: %s", name);
+    }
+    return status == TRANSFER_STREAM_ERROR ? -1 : 0;
 }
 
-void *beacon_receiver(void *arg) {
-    (void)arg;
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) return NULL;
-
-    int reuse = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-#ifdef SO_REUSEPORT
-    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
-#endif
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(BROADCAST_PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("UDP bind failed");
-        close(sock);
-        return NULL;
-    }
-
-    BeaconPacket packet;
-    struct sockaddr_in sender_addr;
-    socklen_t sender_len = sizeof(sender_addr);
-
-    while (app_state.running) {
-        ssize_t len = recvfrom(sock, &packet, sizeof(packet), 0, (struct sockaddr *)&sender_addr, &sender_len);
-        if (len == sizeof(packet)) {
-            if (strcmp(packet.username, app_state.local_username) == 0) continue;
-
-            pthread_mutex_lock(&app_state.peer_mutex);
-            int found = 0;
-            for (int i = 0; i < app_state.peer_count; i++) {
-                if (strcmp(app_state.peers[i].username, packet.username) == 0) {
-                    app_state.peers[i].last_seen = time(NULL);
-                    app_state.peers[i].ip_addr = sender_addr.sin_addr;
-                    app_state.peers[i].tcp_port = packet.tcp_port;
-                    found = 1;
-                    break;
-                }
-            }
-            int newly_found = 0;
-            char new_peer_name[USERNAME_LEN];
-            if (!found && app_state.peer_count < MAX_PEERS) {
-                Peer new_peer;
-                memset(&new_peer, 0, sizeof(new_peer));
-                strncpy(new_peer.username, packet.username, USERNAME_LEN - 1);
-                new_peer.ip_addr = sender_addr.sin_addr;
-                new_peer.tcp_port = packet.tcp_port;
-                new_peer.last_seen = time(NULL);
-                app_state.peers[app_state.peer_count++] = new_peer;
-                strncpy(new_peer_name, new_peer.username, USERNAME_LEN - 1);
-                new_peer_name[USERNAME_LEN - 1] = '\0';
-                newly_found = 1;
-            }
-            pthread_mutex_unlock(&app_state.peer_mutex);
-            if (newly_found) {
-                log_message("New peer discovered: %s", new_peer_name);
-            }
-        }
+/*
+ * Accept a file offer and receive its body. Runs on a worker thread with
+ * the socket in blocking mode; the destination is opened before answering
+ * so a local failure can still be reported as a rejection.
+ *
+ * With FILE_CAP_RESUME the data lands in <name>.part. The acceptance
+ * reports how much of it is already held together with its checksum, and
+ * the sender answers with the offset it will actually start from: that
+ * length, or zero if the prefixes differ. With FILE_CAP_STRIPED the range
+ * after that offset is split over several connections, of which this one
+ * carries the first stripe.
+ *
+ * Returns -1 if the stream broke and the connection can no longer be
+ * used, 0 otherwise.
+ */
+int receive_file(int sock, const FileMetadata *meta) {
+    if (meta->flags & FILE_CAP_TREE) return receive_tree(sock, meta);
+
+    const char *filename = strrchr(meta->filename, '/');
+    if (filename) filename++;
+    else filename = meta->filename;
+
+    // Resuming and striping both build on the stream body
+    uint32_t flags = meta->flags & FILE_CAPS_SUPPORTED;
+    if (!(flags & FILE_CAP_STREAM)) flags = 0;
+    uint32_t streams = (flags & FILE_CAP_STRIPED) ? grant_streams(meta->streams) : 1;
+    if (streams < 2) {
+        flags &= ~FILE_CAP_STRIPED;
+        streams = 1;
     }
 
-    close(sock);
-    return NULL;
-}
+    char part_path[300];
+    const char *path = filename;
+    int open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (flags & FILE_CAP_RESUME) {
+        snprintf(part_path, sizeof(part_path), "%s.part", filename);
+        path = part_path;
+        open_flags = O_RDWR | O_CREAT;
+    }
+    const char *resume_path = (flags & FILE_CAP_RESUME) ? part_path : NULL;
 
-void *connection_handler(void *arg) {
-    int sock = *(int *)arg;
-    free(arg);
-
-    MessagePacket header;
-    while (recv(sock, &header, sizeof(header), MSG_WAITALL) > 0) {
-        if (header.type == MSG_TEXT) {
-            char *buffer = malloc(header.payload_len + 1);
-            if (buffer) {
-                if ((size_t)recv(sock, buffer, header.payload_len, MSG_WAITALL) == header.payload_len) {
-                    buffer[header.payload_len] = '\0';
-                    log_message("%s: %s", header.sender_name, buffer);
-                }
-                free(buffer);
-            }
-        } else if (header.type == MSG_FILE_METADATA) {
-            FileMetadata meta;
-            if (recv(sock, &meta, sizeof(meta), MSG_WAITALL) != sizeof(meta)) break;
-            meta.filename[255] = '\0'; // Ensure null termination
-
-            char *filename = strrchr(meta.filename, '/');
-            if (filename) filename++;
-            else filename = meta.filename;
-
-            // Set up pending transfer
-            pthread_mutex_lock(&app_state.file_transfer_mutex);
-            app_state.pending_file_transfer = 1;
-            memset(app_state.pending_sender, 0, USERNAME_LEN);
-            strncpy(app_state.pending_sender, header.sender_name, USERNAME_LEN - 1);
-            memset(app_state.pending_filename, 0, 256);
-            strncpy(app_state.pending_filename, filename, 255);
-            app_state.pending_filesize = meta.file_size;
-            app_state.pending_sock = sock;
-            app_state.pending_transfer_time = time(NULL);
-            pthread_mutex_unlock(&app_state.file_transfer_mutex);
-
-            // Show prompt to user
-            show_file_prompt(app_state.pending_sender, app_state.pending_filename, meta.file_size);
-
-            // Wait for user decision (max 30 seconds)
-            int decision = 0;
-            time_t start_time = time(NULL);
-            while (decision == 0 && (time(NULL) - start_time) < 30) {
-                pthread_mutex_lock(&app_state.file_transfer_mutex);
-                if (app_state.pending_file_transfer == 2) {
-                    decision = 1; // Accept
-                } else if (app_state.pending_file_transfer == -1) {
-                    decision = -1; // Reject
-                }
-                pthread_mutex_unlock(&app_state.file_transfer_mutex);
-
-                if (decision == 0) {
-                    usleep(100000); // 100ms
-                }
-            }
+    int fd = open(path, open_flags, 0644);
+    if (fd < 0) {
+        log_message("Failed to open file for writing: %s", filename);
+        send_file_response(sock, 0, NULL);
+        return 0;
+    }
 
-            // Timeout = reject
-            if (decision == 0) {
-                decision = -1;
-                log_message("File transfer from %s timed out (rejected)", header.sender_name);
-            }
+    FileAccept accept;
+    memset(&accept, 0, sizeof(accept));
+    accept.flags = flags;
+    accept.streams = streams;
+    if (flags & FILE_CAP_RESUME) {
+        off_t held = lseek(fd, 0, SEEK_END);
+        if (held > 0 && (size_t)held <= meta->file_size &&
+            transfer_prefix_crc(fd, held, &accept.prefix_crc) == 0) {
+            accept.resume_offset = held;
+        }
+    }
 
-            // Send response
-            send_file_response(sock, decision == 1);
-
-            // Clear pending transfer
-            pthread_mutex_lock(&app_state.file_transfer_mutex);
-            app_state.pending_file_transfer = 0;
-            app_state.pending_sock = -1;
-            pthread_mutex_unlock(&app_state.file_transfer_mutex);
-
-            // If accepted, receive the file
-            if (decision == 1) {
-                int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd >= 0) {
-                    size_t total_received = 0;
-                    char buffer[CHUNK_SIZE];
-                    while (total_received < meta.file_size) {
-                        MessagePacket chunk_header;
-                        if (recv(sock, &chunk_header, sizeof(chunk_header), MSG_WAITALL) != sizeof(chunk_header)) break;
-                        if (chunk_header.type != MSG_FILE_CHUNK) break;
-
-                        if ((size_t)recv(sock, buffer, chunk_header.payload_len, MSG_WAITALL) != chunk_header.payload_len) break;
-
-                        write(fd, buffer, chunk_header.payload_len);
-                        total_received += chunk_header.payload_len;
-                    }
-                    close(fd);
-                    log_message("File received: %s", filename);
-                } else {
-                    log_message("Failed to open file for writing: %s", filename);
-                }
+    StripedTransfer *striped = NULL;
+    if (flags & FILE_CAP_STRIPED) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        if (getpeername(sock, (struct sockaddr *)&addr, &addr_len) == 0) {
+            striped = stripes_register(meta, addr.sin_addr, fd, resume_path, filename, streams);
+        }
+        if (!striped) {
+            accept.flags &= ~FILE_CAP_STRIPED;
+            accept.streams = 1;
+        }
+    }
+    send_file_response(sock, 1, &accept);
+
+    uint64_t start = 0;
+    if (flags & FILE_CAP_RESUME) {
+        int valid = recv_exact(sock, &start, sizeof(start)) == 0;
+        start = be64toh(start);
+        if (!valid || (start != 0 && start != accept.resume_offset)) {
+            if (valid) log_message("Invalid resume offset for %s", filename);
+            if (striped) {
+                stripes_abort(striped);
             } else {
-                log_message("File transfer rejected: %s", filename);
+                close(fd);
+                finish_received_file(resume_path, filename, TRANSFER_STREAM_ERROR);
             }
-        } else if (header.type == MSG_FILE_ACCEPT) {
-            log_message("File transfer accepted by %s", header.sender_name);
-        } else if (header.type == MSG_FILE_REJECT) {
-            log_message("File transfer rejected by %s", header.sender_name);
+            return -1;
+        }
+        if (start == 0 && ftruncate(fd, 0) < 0) {
+            log_message("Failed to truncate partial file: %s", part_path);
+        }
+        if (start > 0) {
+            log_message("Resuming %s at %llu of %zu bytes", filename, (unsigned long long)start, meta->file_size);
         }
     }
 
-    close(sock);
-    return NULL;
-}
-
-void *tcp_server(void *arg) {
-    (void)arg;
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return NULL;
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(app_state.local_tcp_port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        log_message("Error: Could not bind to TCP port %d. Is it already in use?", app_state.local_tcp_port);
-        close(sock);
-        return NULL;
-    }
-
-    if (listen(sock, 5) < 0) {
-        close(sock);
-        return NULL;
-    }
-
-    while (app_state.running) {
-        struct sockaddr_in client_addr;
-        socklen_t len = sizeof(client_addr);
-        int client_sock = accept(sock, (struct sockaddr *)&client_addr, &len);
-        if (client_sock >= 0) {
-            int *client_sock_ptr = malloc(sizeof(int));
-            *client_sock_ptr = client_sock;
-            pthread_t tid;
-            pthread_create(&tid, NULL, connection_handler, client_sock_ptr);
-            pthread_detach(tid);
-        }
+    // The striped transfer owns fd and reports the outcome when the last stripe ends
+    if (striped) {
+        stripes_begin(striped, start);
+        return stripes_receive(striped, sock, 0) == TRANSFER_STREAM_ERROR ? -1 : 0;
     }
 
-    close(sock);
-    return NULL;
+    int status;
+    if (flags & FILE_CAP_STREAM) {
+        status = receive_file_stream(sock, fd, start, meta->file_size - start, NULL);
+    } else {
+        status = receive_file_body(sock, fd, meta->file_size);
+    }
+    close(fd);
+    finish_received_file(resume_path, filename, status);
+    return status == TRANSFER_STREAM_ERROR ? -1 : 0;
 }
 
 void init_network_threads() {
     pthread_t tid;
-    pthread_create(&tid, NULL, beacon_sender, NULL);
-    pthread_detach(tid);
-    pthread_create(&tid, NULL, beacon_receiver, NULL);
-    pthread_detach(tid);
+    init_peers();
+    init_discovery();
     pthread_create(&tid, NULL, tcp_server, NULL);
     pthread_detach(tid);
+    init_conn_pool();
+    init_outgoing(OUTGOING_THREADS);
+}
+
+/*
+ * Take a pooled connection to the peer and send one frame on it, header
+ * and payload in a single write. A reused socket may have been closed by
+ * the peer since it went idle, so a failed write on one is retried once
+ * over a fresh connection.
+ */
+static PooledConn *send_to_peer(const Peer *peer, int type, const void *payload, size_t len) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        PooledConn *conn = conn_pool_acquire(peer->ip_addr, peer->tcp_port);
+        if (!conn) return NULL;
+
+        if (wire_send_frame(conn->sock, type, payload, len, 0) == 0) {
+            return conn;
+        }
+
+        int reused = conn->reused;
+        conn_pool_discard(conn);
+        if (!reused) return NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Read the answer to a file offer. Capabilities the receiver agreed to
+ * arrive as the payload of MSG_FILE_ACCEPT; a bare acceptance leaves
+ * accept->flags at zero.
+ */
+static int recv_file_response(int sock, FrameHeader *response, FileAccept *accept) {
+    memset(accept, 0, sizeof(*accept));
+    if (wire_recv_header(sock, response) < 0) return -1;
+    if (response->payload_len > MAX_PAYLOAD_LEN) return -1;
+
+    unsigned char payload[WIRE_ACCEPT_MAX];
+    size_t keep = response->payload_len < sizeof(payload) ? response->payload_len : sizeof(payload);
+    if (keep > 0 && recv_exact(sock, payload, keep) < 0) return -1;
+
+    // Skip any fields a newer receiver appended
+    size_t remaining = response->payload_len - keep;
+    while (remaining > 0) {
+        char scratch[256];
+        size_t want = remaining < sizeof(scratch) ? remaining : sizeof(scratch);
+        if (recv_exact(sock, scratch, want) < 0) return -1;
+        remaining -= want;
+    }
+    if (response->type == MSG_FILE_ACCEPT) return wire_decode_accept(payload, keep, accept);
+    return 0;
+}
+
+// Continue from the receiver's partial copy only if it matches our own prefix
+static uint64_t choose_resume_offset(int fd, off_t fsize, const FileAccept *accept, const char *peer_name) {
+    if (accept->resume_offset == 0 || accept->resume_offset > (uint64_t)fsize) return 0;
+
+    uint32_t crc;
+    if (transfer_prefix_crc(fd, accept->resume_offset, &crc) == 0 && crc == accept->prefix_crc) {
+        log_message("Resuming transfer to %s at %llu bytes", peer_name, (unsigned long long)accept->resume_offset);
+        return accept->resume_offset;
+    }
+    log_message("Partial copy at %s does not match, sending from the start", peer_name);
+    return 0;
+}
+
+// Connections to offer for a file of this size
+static uint32_t choose_streams(off_t fsize) {
+    int streams = app_state.file_streams;
+    if (streams <= 0) {
+        streams = fsize / FILE_STREAM_AUTO_BYTES;
+        if (streams > FILE_STREAM_AUTO_MAX) streams = FILE_STREAM_AUTO_MAX;
+    }
+    if (streams < 1) streams = 1;
+    if (streams > MAX_FILE_STREAMS) streams = MAX_FILE_STREAMS;
+    return streams;
+}
+
+static uint64_t new_transfer_id() {
+    static unsigned counter = 0;
+    uint64_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+        id = ((uint64_t)time(NULL) << 32) ^ ((uint64_t)getpid() << 16) ^ __sync_fetch_and_add(&counter, 1);
+    }
+    return id;
+}
+
+typedef struct {
+    Peer peer;
+    int fd;
+    uint64_t transfer_id;
+    uint32_t index;
+    uint64_t offset;
+    uint64_t len;
+    TransferProgress *progress;
+    int status;
+} StripeSender;
+
+// Open an extra connection, claim the stripe and stream its byte range
+static void *stripe_sender(void *arg) {
+    StripeSender *job = arg;
+
+    FileStripe stripe;
+    stripe.transfer_id = job->transfer_id;
+    stripe.index = job->index;
+    unsigned char payload[WIRE_STRIPE_MAX];
+    size_t len = wire_encode_stripe(payload, &stripe);
+
+    job->status = -1;
+    PooledConn *conn = send_to_peer(&job->peer, MSG_FILE_STRIPE, payload, len);
+    if (conn) {
+        job->status = send_file_stream(conn->sock, job->fd, job->offset, job->offset + job->len, job->progress);
+        if (job->status == 0) conn_pool_release(conn);
+        else conn_pool_discard(conn);
+    }
+    return NULL;
+}
+
+/*
+ * Send [start, fsize) as streams parallel stripes. Stripe 0 goes over the
+ * offer's own socket, the others over extra connections driven by their
+ * own threads. Returns -1 if the offer's socket broke, 1 if only another
+ * stripe failed, 0 on success.
+ */
+static int send_striped(int sock, int fd, uint64_t start, off_t fsize, uint32_t streams,
+                        uint64_t transfer_id, const Peer *peer, TransferProgress *progress) {
+    StripeSender jobs[MAX_FILE_STREAMS];
+    pthread_t threads[MAX_FILE_STREAMS];
+    int started[MAX_FILE_STREAMS] = {0};
+
+    for (uint32_t i = 1; i < streams; i++) {
+        jobs[i].peer = *peer;
+        jobs[i].fd = fd;
+        jobs[i].transfer_id = transfer_id;
+        jobs[i].index = i;
+        jobs[i].progress = progress;
+        stripe_range(start, fsize, streams, i, &jobs[i].offset, &jobs[i].len);
+        started[i] = pthread_create(&threads[i], NULL, stripe_sender, &jobs[i]) == 0;
+    }
+
+    uint64_t offset, len;
+    stripe_range(start, fsize, streams, 0, &offset, &len);
+    int status = send_file_stream(sock, fd, offset, offset + len, progress) == 0 ? 0 : -1;
+
+    for (uint32_t i = 1; i < streams; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else stripe_sender(&jobs[i]);
+        if (jobs[i].status != 0 && status == 0) status = 1;
+    }
+    return status;
+}
+
+/*
+ * Send the body in whatever form the receiver agreed to on top of
+ * FILE_CAP_STREAM. Returns -1 if the socket broke, 1 if the transfer
+ * failed but the socket is still in sync, 0 on success.
+ */
+static int send_negotiated_stream(int sock, int fd, off_t fsize, const FileMetadata *meta,
+                                  const FileAccept *accept, const Peer *peer, TransferProgress *progress) {
+    uint64_t start = 0;
+    if (accept->flags & FILE_CAP_RESUME) {
+        start = choose_resume_offset(fd, fsize, accept, peer->username);
+        uint64_t start_be = htobe64(start);
+        if (send_exact(sock, &start_be, sizeof(start_be), 0) < 0) return -1;
+        if (progress) atomic_store(&progress->sent, start);
+    }
+
+    if (accept->flags & FILE_CAP_STRIPED) {
+        if (accept->streams < 2 || accept->streams > meta->streams) return -1;
+        return send_striped(sock, fd, start, fsize, accept->streams, meta->transfer_id, peer, progress);
+    }
+    return send_file_stream(sock, fd, start, fsize, progress) == 0 ? 0 : -1;
+}
+
+void send_text_message(const Peer *peer, const char *msg) {
+    PooledConn *conn = send_to_peer(peer, MSG_TEXT, msg, strlen(msg));
+    if (conn) {
+        log_chat(LOG_CHAT_OUT, "Me -> %s: %s", peer->username, msg);
+        chatlog_append(peer->username, CHATLOG_OUT, msg);
+        conn_pool_release(conn);
+    } else {
+        log_message("Failed to connect to %s", peer->username);
+    }
+}
+
+// Wait for the answer to an offer, giving up early if the send is cancelled
+static int wait_for_response(int sock, TransferProgress *progress) {
+    struct pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    while (!(progress && atomic_load(&progress->cancelled))) {
+        int n = poll(&pfd, 1, FILE_RESPONSE_POLL_MS);
+        if (n > 0) return 0;
+        if (n < 0 && errno != EINTR) return -1;
+    }
+    return -1;
 }
 
-void send_text_message(int peer_index, const char *msg) {
-    if (peer_index < 0 || peer_index >= app_state.peer_count) return;
-
-    Peer peer = app_state.peers[peer_index];
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) return;
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(peer.tcp_port);
-    addr.sin_addr = peer.ip_addr;
-
-    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
-        MessagePacket header;
-        memset(&header, 0, sizeof(header));
-        header.type = MSG_TEXT;
-        strncpy(header.sender_name, app_state.local_username, USERNAME_LEN - 1);
-        header.payload_len = strlen(msg);
-        send_all(sock, &header, sizeof(header));
-        send_all(sock, msg, header.payload_len);
-        log_message("Me -> %s: %s", peer.username, msg);
+// Sends the body of an accepted offer; returns -1, 1 or 0 like send_negotiated_stream()
+typedef int (*SendBody)(int sock, const FileAccept *accept, void *arg, TransferProgress *progress);
+
+/*
+ * Send an offer and, once it is accepted, its body through send_body.
+ * Blocks for the whole exchange. Returns 0 when every byte was delivered.
+ */
+static int offer_and_send(const Peer *peer, const FileMetadata *meta, const char *path,
+                          SendBody send_body, void *arg, TransferProgress *progress) {
+    unsigned char payload[WIRE_OFFER_MAX];
+    size_t payload_len = wire_encode_offer(payload, meta);
+
+    PooledConn *conn = send_to_peer(peer, MSG_FILE_METADATA, payload, payload_len);
+    if (!conn) {
+        log_message("Failed to connect to %s", peer->username);
+        return -1;
+    }
+    int sock = conn->sock;
+    int reusable = 0;
+    int result = -1;
+
+    log_message("Waiting for %s to accept file transfer...", peer->username);
+
+    // Wait for accept/reject response
+    FrameHeader response;
+    FileAccept accept;
+    if (wait_for_response(sock, progress) < 0) {
+        // Cancelled; dropping the connection withdraws the offer
+    } else if (recv_file_response(sock, &response, &accept) == 0) {
+        if (response.type == MSG_FILE_ACCEPT) {
+            log_message("File transfer accepted by %s", peer->username);
+            if (progress) atomic_store(&progress->accepted, 1);
+
+            int status = send_body(sock, &accept, arg, progress);
+            reusable = status >= 0;
+            if (status == 0) {
+                log_message("Sent %s %s to %s", (meta->flags & FILE_CAP_TREE) ? "directory" : "file",
+                            path, peer->username);
+                result = 0;
+            } else if (!(progress && atomic_load(&progress->cancelled))) {
+                log_message("File transfer to %s interrupted: %s", peer->username, path);
+            }
+        } else if (response.type == MSG_FILE_REJECT) {
+            log_message("File transfer rejected by %s", peer->username);
+            reusable = 1;
+        } else {
+            log_message("Invalid response from %s", peer->username);
+        }
     } else {
-        log_message("Failed to connect to %s", peer.username);
+        log_message("No response from %s", peer->username);
     }
-    close(sock);
+
+    if (progress && atomic_load(&progress->cancelled)) {
+        log_message("File transfer to %s cancelled: %s", peer->username, path);
+        reusable = 0;
+    }
+    if (reusable) conn_pool_release(conn);
+    else conn_pool_discard(conn);
+    return result;
 }
 
-void send_file(int peer_index, const char *filepath) {
-    if (peer_index < 0 || peer_index >= app_state.peer_count) return;
+typedef struct {
+    int fd;
+    off_t fsize;
+    const FileMetadata *meta;
+    const Peer *peer;
+} FileBody;
+
+static int send_accepted_file(int sock, const FileAccept *accept, void *arg, TransferProgress *progress) {
+    FileBody *body = arg;
+    if (accept->flags & FILE_CAP_STREAM) {
+        return send_negotiated_stream(sock, body->fd, body->fsize, body->meta, accept, body->peer, progress);
+    }
+    return send_file_body(sock, body->fd, body->fsize, progress) == 0 ? 0 : -1;
+}
+
+static int send_accepted_tree(int sock, const FileAccept *accept, void *arg, TransferProgress *progress) {
+    if (!(accept->flags & FILE_CAP_TREE)) return -1;
+    return tree_send(sock, arg, progress);
+}
+
+/*
+ * Offer a directory and stream the whole tree over the one connection
+ * once accepted. Only peers whose hello announced FILE_CAP_TREE are asked,
+ * since older ones would take the offer for a single file.
+ */
+static int send_tree(const Peer *peer, const char *dirpath, TransferProgress *progress) {
+    PooledConn *conn = conn_pool_acquire(peer->ip_addr, peer->tcp_port);
+    if (!conn) {
+        log_message("Failed to connect to %s", peer->username);
+        return -1;
+    }
+    uint32_t caps = conn->caps;
+    conn_pool_release(conn);
+    if (!(caps & FILE_CAP_TREE)) {
+        log_message("%s cannot receive directories", peer->username);
+        return -1;
+    }
+
+    TreeManifest *tree = tree_scan(dirpath);
+    if (!tree) return -1;
+    if (progress) atomic_store(&progress->total, tree_total_bytes(tree));
+
+    // Offered under its own name, without any leading path or trailing slash
+    char name[256];
+    snprintf(name, sizeof(name), "%s", dirpath);
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/') name[--len] = '\0';
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    if (!tree_valid_name(base)) {
+        log_message("Cannot send %s: name the directory itself, not . or ..", dirpath);
+        tree_free(tree);
+        return -1;
+    }
+
+    FileMetadata meta;
+    memset(&meta, 0, sizeof(meta));
+    snprintf(meta.filename, sizeof(meta.filename), "%s", base);
+    meta.file_size = tree_total_bytes(tree);
+    meta.flags = FILE_CAP_STREAM | FILE_CAP_TREE;
+    meta.streams = 1;
+    meta.transfer_id = new_transfer_id();
+
+    log_message("Offering %s: %d files, %llu bytes", base, tree_file_count(tree),
+                (unsigned long long)tree_total_bytes(tree));
+    int result = offer_and_send(peer, &meta, dirpath, send_accepted_tree, tree, progress);
+    tree_free(tree);
+    return result;
+}
+
+/*
+ * Offer a file or directory to the peer and send it once accepted. Blocks
+ * for the whole exchange, so it runs on the outgoing transfer threads
+ * rather than the UI. Returns 0 when every byte was delivered.
+ */
+int send_file(const Peer *peer, const char *filepath, TransferProgress *progress) {
+    struct stat st;
+    if (stat(filepath, &st) == 0 && S_ISDIR(st.st_mode)) return send_tree(peer, filepath, progress);
 
     int fd = open(filepath, O_RDONLY);
     if (fd < 0) {
         log_message("Failed to open file: %s", filepath);
-        return;
+        return -1;
     }
 
     off_t fsize = lseek(fd, 0, SEEK_END);
     lseek(fd, 0, SEEK_SET);
 
-    Peer peer = app_state.peers[peer_index];
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        close(fd);
-        return;
-    }
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(peer.tcp_port);
-    addr.sin_addr = peer.ip_addr;
-
-    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
-        MessagePacket header;
-        memset(&header, 0, sizeof(header));
-        header.type = MSG_FILE_METADATA;
-        strncpy(header.sender_name, app_state.local_username, USERNAME_LEN - 1);
-        header.payload_len = sizeof(FileMetadata);
-        send_all(sock, &header, sizeof(header));
-
-        FileMetadata meta;
-        memset(&meta, 0, sizeof(meta));
-        strncpy(meta.filename, filepath, 255);
-        meta.file_size = fsize;
-        send_all(sock, &meta, sizeof(meta));
-
-        log_message("Waiting for %s to accept file transfer...", peer.username);
-
-        // Wait for accept/reject response
-        MessagePacket response;
-        if (recv(sock, &response, sizeof(response), MSG_WAITALL) == sizeof(response)) {
-            if (response.type == MSG_FILE_ACCEPT) {
-                log_message("File transfer accepted by %s", peer.username);
-
-                // Send file chunks
-                char buffer[CHUNK_SIZE];
-                ssize_t bytes_read;
-                while ((bytes_read = read(fd, buffer, sizeof(buffer))) > 0) {
-                    memset(&header, 0, sizeof(header));
-                    header.type = MSG_FILE_CHUNK;
-                    strncpy(header.sender_name, app_state.local_username, USERNAME_LEN - 1);
-                    header.payload_len = bytes_read;
-                    if (send_all(sock, &header, sizeof(header)) <= 0) break;
-                    if (send_all(sock, buffer, bytes_read) <= 0) break;
-                }
-                log_message("Sent file %s to %s", filepath, peer.username);
-            } else if (response.type == MSG_FILE_REJECT) {
-                log_message("File transfer rejected by %s", peer.username);
-            } else {
-                log_message("Invalid response from %s", peer.username);
-            }
-        } else {
-            log_message("No response from %s", peer.username);
-        }
-    } else {
-        log_message("Failed to connect to %s", peer.username);
-    }
-    close(sock);
+    FileMetadata meta;
+    memset(&meta, 0, sizeof(meta));
+    strncpy(meta.filename, filepath, 255);
+    meta.file_size = fsize;
+    meta.flags = FILE_CAPS_SUPPORTED & ~FILE_CAP_TREE;
+    meta.streams = choose_streams(fsize);
+    meta.transfer_id = new_transfer_id();
+
+    FileBody body = {fd, fsize, &meta, peer};
+    int result = offer_and_send(peer, &meta, filepath, send_accepted_file, &body, progress);
     close(fd);
+    return result;
 }
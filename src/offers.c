@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/offers.h"
+#include "../include/reactor.h"
+
+/*
+ * Incoming file offers waiting for /accept or /reject, oldest first. The
+ * reactor adds and withdraws them; the UI records decisions, which wake
+ * the reactor so an answer goes out immediately. An offer stays queued
+ * until the reactor has taken its decision.
+ */
+typedef struct PendingOffer {
+    uint32_t id;
+    int decision;
+    void *owner;                // Reactor connection the offer arrived on
+    struct PendingOffer *next;
+} PendingOffer;
+
+static PendingOffer *offers = NULL;
+static uint32_t next_offer_id = 1;
+static pthread_mutex_t offers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Queue an offer and return the id the user refers to it by
+uint32_t offers_add(void *owner) {
+    PendingOffer *offer = calloc(1, sizeof(PendingOffer));
+    if (!offer) return 0;
+
+    offer->decision = OFFER_PENDING;
+    offer->owner = owner;
+
+    pthread_mutex_lock(&offers_mutex);
+    offer->id = next_offer_id++;
+    if (next_offer_id == 0) next_offer_id = 1;
+    PendingOffer **link = &offers;
+    while (*link) link = &(*link)->next;
+    *link = offer;
+    pthread_mutex_unlock(&offers_mutex);
+    return offer->id;
+}
+
+/*
+ * Accept or reject a pending offer. An id of 0 picks the only pending
+ * offer; on success *id is set to the offer that was decided. Returns 0,
+ * OFFER_UNKNOWN or OFFER_AMBIGUOUS.
+ */
+int offers_decide(uint32_t *id, int decision) {
+    pthread_mutex_lock(&offers_mutex);
+    PendingOffer *match = NULL;
+    int pending = 0;
+    for (PendingOffer *offer = offers; offer; offer = offer->next) {
+        if (offer->decision != OFFER_PENDING) continue;
+        pending++;
+        if (offer->id == *id || (*id == 0 && !match)) match = offer;
+    }
+
+    int result = 0;
+    if (!match) {
+        result = OFFER_UNKNOWN;
+    } else if (*id == 0 && pending > 1) {
+        result = OFFER_AMBIGUOUS;
+    } else {
+        match->decision = decision;
+        *id = match->id;
+    }
+    pthread_mutex_unlock(&offers_mutex);
+
+    if (result == 0) reactor_wake();
+    return result;
+}
+
+// Take the oldest decided offer off the queue and return its owner, or NULL
+void *offers_next_decided(int *decision) {
+    pthread_mutex_lock(&offers_mutex);
+    PendingOffer **link = &offers;
+    while (*link && (*link)->decision == OFFER_PENDING) link = &(*link)->next;
+
+    void *owner = NULL;
+    PendingOffer *offer = *link;
+    if (offer) {
+        *link = offer->next;
+        *decision = offer->decision;
+        owner = offer->owner;
+    }
+    pthread_mutex_unlock(&offers_mutex);
+    free(offer);
+    return owner;
+}
+
+// Remove an offer that timed out or was cancelled; returns its decision so far
+int offers_withdraw(uint32_t id) {
+    pthread_mutex_lock(&offers_mutex);
+    PendingOffer **link = &offers;
+    while (*link && (*link)->id != id) link = &(*link)->next;
+
+    int decision = OFFER_PENDING;
+    PendingOffer *offer = *link;
+    if (offer) {
+        *link = offer->next;
+        decision = offer->decision;
+    }
+    pthread_mutex_unlock(&offers_mutex);
+    free(offer);
+    return decision;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../include/outgoing.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+typedef struct OutgoingTransfer {
+    uint32_t id;
+    Peer peer;
+    char path[OUTGOING_PATH_LEN];
+    off_t size;                 // 0 for a directory; its total is in progress
+    int directory;
+    int active;                 // Picked up by a sender thread
+    TransferProgress progress;
+    struct OutgoingTransfer *next;
+} OutgoingTransfer;
+
+// Queued and active sends in submission order
+static OutgoingTransfer *transfers = NULL;
+static uint32_t next_transfer_id = 1;
+static pthread_mutex_t outgoing_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t outgoing_cond = PTHREAD_COND_INITIALIZER;
+
+static void unlink_transfer(OutgoingTransfer *t) {
+    OutgoingTransfer **link = &transfers;
+    while (*link && *link != t) link = &(*link)->next;
+    if (*link) *link = t->next;
+}
+
+static void *outgoing_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&outgoing_mutex);
+        OutgoingTransfer *t;
+        while (1) {
+            t = transfers;
+            while (t && t->active) t = t->next;
+            if (t) break;
+            pthread_cond_wait(&outgoing_cond, &outgoing_mutex);
+        }
+        t->active = 1;
+        pthread_mutex_unlock(&outgoing_mutex);
+
+        send_file(&t->peer, t->path, &t->progress);
+
+        pthread_mutex_lock(&outgoing_mutex);
+        unlink_transfer(t);
+        pthread_mutex_unlock(&outgoing_mutex);
+        free(t);
+    }
+    return NULL;
+}
+
+void init_outgoing(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t tid;
+        pthread_create(&tid, NULL, outgoing_main, NULL);
+        pthread_detach(tid);
+    }
+}
+
+// Queue a file or directory for the peer; returns its id, or 0 if it cannot be sent
+uint32_t outgoing_enqueue(const Peer *peer, const char *path) {
+    if (strlen(path) >= OUTGOING_PATH_LEN) {
+        log_message("Path too long to send: %s", path);
+        return 0;
+    }
+    struct stat st;
+    if (stat(path, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+        log_message("Failed to open file: %s", path);
+        return 0;
+    }
+
+    OutgoingTransfer *t = calloc(1, sizeof(OutgoingTransfer));
+    if (!t) return 0;
+    t->peer = *peer;
+    strcpy(t->path, path);
+    t->directory = S_ISDIR(st.st_mode);
+    t->size = t->directory ? 0 : st.st_size;
+
+    pthread_mutex_lock(&outgoing_mutex);
+    t->id = next_transfer_id++;
+    if (next_transfer_id == 0) next_transfer_id = 1;
+    OutgoingTransfer **link = &transfers;
+    while (*link) link = &(*link)->next;
+    *link = t;
+    pthread_cond_signal(&outgoing_cond);
+    pthread_mutex_unlock(&outgoing_mutex);
+    return t->id;
+}
+
+/*
+ * Stop a send. A queued one is dropped at once; an active one is flagged
+ * and stops at its next chunk, or while still waiting for an answer.
+ * Returns 0 if no such transfer exists.
+ */
+int outgoing_cancel(uint32_t id) {
+    pthread_mutex_lock(&outgoing_mutex);
+    OutgoingTransfer *t = transfers;
+    while (t && t->id != id) t = t->next;
+
+    int found = t != NULL;
+    int queued = t && !t->active;
+    char path[OUTGOING_PATH_LEN] = "";
+    if (queued) {
+        unlink_transfer(t);
+        strncpy(path, t->path, sizeof(path) - 1);
+        free(t);
+    } else if (t) {
+        atomic_store(&t->progress.cancelled, 1);
+    }
+    pthread_mutex_unlock(&outgoing_mutex);
+
+    if (queued) log_message("Removed queued transfer #%u: %s", id, path);
+    else if (found) log_message("Cancelling transfer #%u", id);
+    return found;
+}
+
+// Print every queued and active send with its progress
+void outgoing_list() {
+    pthread_mutex_lock(&outgoing_mutex);
+    int count = 0;
+    for (OutgoingTransfer *t = transfers; t; t = t->next) count++;
+
+    char (*lines)[384] = count ? malloc(count * sizeof(*lines)) : NULL;
+    int n = 0;
+    for (OutgoingTransfer *t = transfers; t && lines; t = t->next) {
+        unsigned long long sent = atomic_load(&t->progress.sent);
+        unsigned long long size = t->directory ? atomic_load(&t->progress.total) : (unsigned long long)t->size;
+        int percent = size > 0 ? (int)(sent * 100 / size) : 100;
+        if (!t->active) {
+            snprintf(lines[n++], sizeof(*lines), "#%u %s -> %s: queued", t->id, t->path, t->peer.username);
+        } else if (!atomic_load(&t->progress.accepted)) {
+            snprintf(lines[n++], sizeof(*lines), "#%u %s -> %s: waiting for accept", t->id, t->path, t->peer.username);
+        } else {
+            snprintf(lines[n++], sizeof(*lines), "#%u %s -> %s: %d%% of %llu bytes",
+                     t->id, t->path, t->peer.username, percent, size);
+        }
+    }
+    pthread_mutex_unlock(&outgoing_mutex);
+
+    if (n == 0) log_message("No outgoing transfers");
+    for (int i = 0; i < n; i++) log_message("%s", lines[i]);
+    free(lines);
+}
@@ -0,0 +1,452 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../include/peers.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+/*
+ * Peers live in a growable array in discovery order, with two open-addressed
+ * indexes (by username and by ip:port) holding positions into it. Ids are
+ * handed out in increasing order, so the array is also sorted by id.
+ * Expiry compacts the array and rebuilds the indexes in one pass; it is the
+ * only removal, so beacon updates and lookups stay O(1).
+ */
+typedef struct {
+    Peer *entries;
+    int count;
+    int capacity;
+    int *by_name;                   // Position + 1 per bucket, 0 when empty
+    int *by_addr;
+    uint32_t buckets;               // Power of two, twice the capacity
+} PeerTable;
+
+/*
+ * Readers never lock. Writers (the beacon receiver and the reaper) edit a
+ * private master table under peers_mutex and publish an immutable copy of
+ * it whenever the set of peers or an address changes. A beacon that only
+ * refreshes last_seen touches the master alone, so published copies carry
+ * last_seen as of their publication.
+ *
+ * Replaced snapshots are reclaimed RCU-style: readers register in one of
+ * two epochs, and a retired snapshot is freed only after the epoch that
+ * was current when it was retired has no readers left. Writers never wait
+ * for readers; an outstanding reader only delays the free.
+ */
+typedef struct PeerSnapshot {
+    PeerTable table;
+    struct PeerSnapshot *next;      // Link in the retire lists
+} PeerSnapshot;
+
+static PeerTable master;
+static _Atomic(PeerSnapshot *) current = NULL;
+static atomic_uint epoch = 0;
+static atomic_int readers[2];
+static PeerSnapshot *retired = NULL;    // Replaced since the last epoch flip
+static PeerSnapshot *grace = NULL;      // Waiting for grace_epoch to drain
+static unsigned grace_epoch;
+
+static uint32_t next_id = 1;
+static atomic_uint changes = 0;         // Bumped whenever the set of peers changes
+static int peers_running = 0;
+static pthread_t reaper_tid;
+static pthread_mutex_t peers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t peers_cond = PTHREAD_COND_INITIALIZER;
+
+// FNV-1a
+static uint32_t hash_name(const char *username) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t hash_addr(struct in_addr ip_addr, int tcp_port) {
+    uint32_t h = ip_addr.s_addr ^ ((uint32_t)tcp_port * 0x9e3779b1u);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static int find_name(const PeerTable *t, const char *username) {
+    if (!t->buckets) return -1;
+    uint32_t mask = t->buckets - 1;
+    for (uint32_t b = hash_name(username) & mask; t->by_name[b]; b = (b + 1) & mask) {
+        if (strcmp(t->entries[t->by_name[b] - 1].username, username) == 0) return t->by_name[b] - 1;
+    }
+    return -1;
+}
+
+static int find_addr(const PeerTable *t, struct in_addr ip_addr, int tcp_port) {
+    if (!t->buckets) return -1;
+    uint32_t mask = t->buckets - 1;
+    for (uint32_t b = hash_addr(ip_addr, tcp_port) & mask; t->by_addr[b]; b = (b + 1) & mask) {
+        const Peer *peer = &t->entries[t->by_addr[b] - 1];
+        if (peer->ip_addr.s_addr == ip_addr.s_addr && peer->tcp_port == tcp_port) return t->by_addr[b] - 1;
+    }
+    return -1;
+}
+
+// First position whose id is not below the given one
+static int lower_bound(const PeerTable *t, uint32_t id) {
+    int lo = 0, hi = t->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (t->entries[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int find_id(const PeerTable *t, uint32_t id) {
+    int pos = lower_bound(t, id);
+    return pos < t->count && t->entries[pos].id == id ? pos : -1;
+}
+
+static void index_entry(PeerTable *t, int pos) {
+    uint32_t mask = t->buckets - 1;
+    uint32_t b = hash_name(t->entries[pos].username) & mask;
+    while (t->by_name[b]) b = (b + 1) & mask;
+    t->by_name[b] = pos + 1;
+
+    b = hash_addr(t->entries[pos].ip_addr, t->entries[pos].tcp_port) & mask;
+    while (t->by_addr[b]) b = (b + 1) & mask;
+    t->by_addr[b] = pos + 1;
+}
+
+static void rebuild_indexes(PeerTable *t) {
+    memset(t->by_name, 0, t->buckets * sizeof(int));
+    memset(t->by_addr, 0, t->buckets * sizeof(int));
+    for (int i = 0; i < t->count; i++) index_entry(t, i);
+}
+
+static int grow_table(PeerTable *t) {
+    int new_capacity = t->capacity ? t->capacity * 2 : PEER_TABLE_MIN;
+    Peer *new_entries = realloc(t->entries, new_capacity * sizeof(Peer));
+    if (!new_entries) return -1;
+    t->entries = new_entries;
+
+    int *name_index = calloc(new_capacity * 2, sizeof(int));
+    int *addr_index = calloc(new_capacity * 2, sizeof(int));
+    if (!name_index || !addr_index) {
+        free(name_index);
+        free(addr_index);
+        return -1;
+    }
+    free(t->by_name);
+    free(t->by_addr);
+    t->by_name = name_index;
+    t->by_addr = addr_index;
+    t->buckets = new_capacity * 2;
+    t->capacity = new_capacity;
+    rebuild_indexes(t);
+    return 0;
+}
+
+static void free_snapshots(PeerSnapshot *list) {
+    while (list) {
+        PeerSnapshot *next = list->next;
+        free(list);
+        list = next;
+    }
+}
+
+/*
+ * Free the grace batch once its epoch has drained, then start a new grace
+ * period for anything retired since. Flipping the epoch only after the
+ * previous one drained keeps new readers from piling into an epoch that is
+ * still being waited on.
+ */
+static void reclaim_locked() {
+    if (grace && atomic_load(&readers[grace_epoch]) == 0) {
+        free_snapshots(grace);
+        grace = NULL;
+    }
+    if (!grace && retired) {
+        grace = retired;
+        retired = NULL;
+        grace_epoch = atomic_fetch_add(&epoch, 1) & 1;
+    }
+}
+
+// Copy the master into one immutable block and make it the current version
+static void publish_locked() {
+    atomic_fetch_add(&changes, 1);
+    size_t entries_size = master.count * sizeof(Peer);
+    size_t index_size = master.buckets * sizeof(int);
+    PeerSnapshot *snap = malloc(sizeof(PeerSnapshot) + entries_size + 2 * index_size);
+    if (!snap) return;  // Readers keep the previous version until the next change
+
+    char *p = (char *)(snap + 1);
+    snap->table.entries = (Peer *)p;
+    snap->table.by_name = (int *)(p + entries_size);
+    snap->table.by_addr = (int *)(p + entries_size + index_size);
+    snap->table.count = master.count;
+    snap->table.capacity = master.count;
+    snap->table.buckets = master.buckets;
+    snap->next = NULL;
+    memcpy(snap->table.entries, master.entries, entries_size);
+    memcpy(snap->table.by_name, master.by_name, index_size);
+    memcpy(snap->table.by_addr, master.by_addr, index_size);
+
+    PeerSnapshot *old = atomic_exchange(&current, snap);
+    if (old) {
+        old->next = retired;
+        retired = old;
+    }
+    reclaim_locked();
+    app_notify(APP_EVENT_PEERS);
+}
+
+// Enter a read-side section; the snapshot stays valid until read_end()
+static const PeerTable *read_begin(unsigned *slot) {
+    for (;;) {
+        unsigned e = atomic_load(&epoch) & 1;
+        atomic_fetch_add(&readers[e], 1);
+        if ((atomic_load(&epoch) & 1) == e) {
+            *slot = e;
+            break;
+        }
+        atomic_fetch_sub(&readers[e], 1);
+    }
+    PeerSnapshot *snap = atomic_load(&current);
+    return snap ? &snap->table : NULL;
+}
+
+static void read_end(unsigned slot) {
+    atomic_fetch_sub(&readers[slot], 1);
+}
+
+/*
+ * Drop every peer not heard from within PEER_EXPIRY_TIMEOUT, keeping the
+ * survivors in order. Names of dropped peers are logged once the table
+ * lock is released, so logging never runs under it.
+ */
+static void expire_peers_locked() {
+    time_t cutoff = time(NULL) - PEER_EXPIRY_TIMEOUT;
+    int expired = 0;
+    for (int i = 0; i < master.count; i++) {
+        if (master.entries[i].last_seen <= cutoff) expired++;
+    }
+    if (expired == 0) return;
+
+    char (*names)[USERNAME_LEN] = malloc(expired * sizeof(*names));
+    int kept = 0, dropped = 0;
+    for (int i = 0; i < master.count; i++) {
+        if (master.entries[i].last_seen > cutoff) {
+            master.entries[kept++] = master.entries[i];
+        } else if (names) {
+            memcpy(names[dropped++], master.entries[i].username, USERNAME_LEN);
+        }
+    }
+    master.count = kept;
+    rebuild_indexes(&master);
+    publish_locked();
+
+    pthread_mutex_unlock(&peers_mutex);
+    for (int i = 0; i < dropped; i++) {
+        log_message("Peer left: %s", names[i]);
+    }
+    free(names);
+    pthread_mutex_lock(&peers_mutex);
+}
+
+static void *peer_reaper(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&peers_mutex);
+    while (peers_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += PEER_REAP_INTERVAL;
+        pthread_cond_timedwait(&peers_cond, &peers_mutex, &deadline);
+        if (!peers_running) break;
+        expire_peers_locked();
+        reclaim_locked();
+    }
+    pthread_mutex_unlock(&peers_mutex);
+    return NULL;
+}
+
+void init_peers() {
+    pthread_mutex_lock(&peers_mutex);
+    peers_running = 1;
+    pthread_mutex_unlock(&peers_mutex);
+    pthread_create(&reaper_tid, NULL, peer_reaper, NULL);
+}
+
+void cleanup_peers() {
+    pthread_mutex_lock(&peers_mutex);
+    if (!peers_running) {
+        pthread_mutex_unlock(&peers_mutex);
+        return;
+    }
+    peers_running = 0;
+    pthread_cond_signal(&peers_cond);
+    pthread_mutex_unlock(&peers_mutex);
+    pthread_join(reaper_tid, NULL);
+
+    pthread_mutex_lock(&peers_mutex);
+    PeerSnapshot *last = atomic_exchange(&current, NULL);
+    if (last) {
+        last->next = retired;
+        retired = last;
+    }
+    // Let both epochs drain so no reader still holds a snapshot
+    atomic_fetch_add(&epoch, 1);
+    while (atomic_load(&readers[0]) || atomic_load(&readers[1])) sched_yield();
+    free_snapshots(grace);
+    free_snapshots(retired);
+    grace = retired = NULL;
+
+    free(master.entries);
+    free(master.by_name);
+    free(master.by_addr);
+    memset(&master, 0, sizeof(master));
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+/*
+ * Record a beacon. A known username is refreshed in place; an unknown
+ * username at a known address takes over that entry, since the peer was
+ * restarted under a new name. Returns PEER_UPDATED, PEER_ADDED or
+ * PEER_RENAMED, or -1 if the table could not grow. Sets *publish when
+ * readers must be shown the change.
+ */
+static int update_locked(const char *username, struct in_addr ip_addr, int tcp_port, time_t now,
+                         Peer *out, int *publish) {
+    int result = PEER_UPDATED;
+    int pos = find_name(&master, username);
+    if (pos < 0) {
+        pos = find_addr(&master, ip_addr, tcp_port);
+        if (pos >= 0) result = PEER_RENAMED;
+    }
+    if (pos < 0) {
+        if (master.count == master.capacity && grow_table(&master) < 0) return -1;
+        pos = master.count++;
+        memset(&master.entries[pos], 0, sizeof(Peer));
+        master.entries[pos].id = next_id++;
+        result = PEER_ADDED;
+    }
+
+    Peer *peer = &master.entries[pos];
+    int moved = peer->ip_addr.s_addr != ip_addr.s_addr || peer->tcp_port != tcp_port;
+    if (result != PEER_UPDATED) {
+        memset(peer->username, 0, USERNAME_LEN);
+        strncpy(peer->username, username, USERNAME_LEN - 1);
+    }
+    peer->ip_addr = ip_addr;
+    peer->tcp_port = tcp_port;
+    peer->last_seen = now;
+
+    if (result == PEER_ADDED) index_entry(&master, pos);
+    else if (result == PEER_RENAMED || moved) rebuild_indexes(&master);
+    if (result != PEER_UPDATED || moved) *publish = 1;
+
+    *out = *peer;
+    return result;
+}
+
+/*
+ * Apply a batch of beacons under one lock acquisition, publishing at most
+ * one new snapshot for all of them. Each update's result and resulting
+ * entry are filled in. Returns -1 once the table has been shut down.
+ */
+int peers_update(PeerUpdate *updates, int count) {
+    pthread_mutex_lock(&peers_mutex);
+    if (!peers_running) {
+        pthread_mutex_unlock(&peers_mutex);
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    int publish = 0;
+    for (int i = 0; i < count; i++) {
+        PeerUpdate *u = &updates[i];
+        u->result = update_locked(u->username, u->ip_addr, u->tcp_port, now, &u->peer, &publish);
+    }
+    if (publish) publish_locked();
+    pthread_mutex_unlock(&peers_mutex);
+    return 0;
+}
+
+// Changes whenever a peer is added, renamed, moved or expires
+unsigned peers_changes() {
+    return atomic_load(&changes);
+}
+
+// Copy out the peer with the given id; returns 0 if it has expired
+int peers_find(uint32_t id, Peer *out) {
+    unsigned slot;
+    const PeerTable *t = read_begin(&slot);
+    int pos = t ? find_id(t, id) : -1;
+    if (pos >= 0 && out) *out = t->entries[pos];
+    read_end(slot);
+    return pos >= 0;
+}
+
+int peers_find_by_name(const char *username, Peer *out) {
+    unsigned slot;
+    const PeerTable *t = read_begin(&slot);
+    int pos = t ? find_name(t, username) : -1;
+    if (pos >= 0 && out) *out = t->entries[pos];
+    read_end(slot);
+    return pos >= 0;
+}
+
+int peers_find_by_addr(struct in_addr ip_addr, int tcp_port, Peer *out) {
+    unsigned slot;
+    const PeerTable *t = read_begin(&slot);
+    int pos = t ? find_addr(t, ip_addr, tcp_port) : -1;
+    if (pos >= 0 && out) *out = t->entries[pos];
+    read_end(slot);
+    return pos >= 0;
+}
+
+// Copy up to max peers in id order; returns how many are known in total
+int peers_list(Peer *out, int max) {
+    unsigned slot;
+    const PeerTable *t = read_begin(&slot);
+    int total = t ? t->count : 0;
+    if (total > 0) memcpy(out, t->entries, (total < max ? total : max) * sizeof(Peer));
+    read_end(slot);
+    return total;
+}
+
+/*
+ * Resolve a selection to a peer and its 0-based position. If the selected
+ * peer has expired, the one that moved into its place is used instead.
+ * Returns the number of known peers; out is only filled when non-zero.
+ */
+int peers_resolve(uint32_t id, Peer *out, int *position) {
+    unsigned slot;
+    const PeerTable *t = read_begin(&slot);
+    int total = t ? t->count : 0;
+    if (total > 0) {
+        int pos = lower_bound(t, id);
+        if (pos == t->count) pos = 0;
+        if (out) *out = t->entries[pos];
+        if (position) *position = pos;
+    }
+    read_end(slot);
+    return total;
+}
+
+// Id of the peer delta positions away from the selection, wrapping; 0 if none
+uint32_t peers_step(uint32_t id, int delta) {
+    unsigned slot;
+    const PeerTable *t = read_begin(&slot);
+    uint32_t result = 0;
+    if (t && t->count > 0) {
+        int pos = lower_bound(t, id);
+        if (pos == t->count) pos = 0;
+        pos = ((pos + delta) % t->count + t->count) % t->count;
+        result = t->entries[pos].id;
+    }
+    read_end(slot);
+    return result;
+}
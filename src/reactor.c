@@ -0,0 +1,585 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "../include/network.h"
+#include "../include/reactor.h"
+#include "../include/workers.h"
+#include "../include/stripes.h"
+#include "../include/offers.h"
+#include "../include/chatlog.h"
+#include "../include/wire.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+typedef enum {
+    CONN_READ_HELLO,
+    CONN_READ_HEADER,
+    CONN_READ_PAYLOAD,
+    CONN_AWAIT_DECISION,
+    CONN_WAIT_WORKER,                   // Input off until a worker ring has room
+    CONN_IN_WORKER
+} ConnState;
+
+typedef struct Connection {
+    int sock;
+    ConnState state;
+
+    // Hello or frame header being assembled, then its payload
+    unsigned char head[WIRE_HELLO_MAX];
+    size_t head_got;
+    size_t head_want;
+    FrameHeader header;
+    char *payload;                      // Kept across frames, see reserve_payload()
+    size_t payload_cap;
+    size_t payload_got;
+
+    // File offer waiting for the local user, or stripe being received
+    FileMetadata meta;
+    FileStripe stripe;
+    char sender[USERNAME_LEN];          // From the peer's hello
+    uint32_t caps;
+    uint32_t offer_id;
+    time_t offer_time;
+
+    int failed;                         // Set by a worker when the socket broke
+    WorkFn job;                         // Blocking job it is handed to
+    struct Connection *prev;
+    struct Connection *next;
+    struct Connection *waiting_next;    // Queue of jobs no worker could take yet
+    struct Connection *returned_next;   // Worker -> reactor hand-back queue
+} Connection;
+
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static int listen_tag, wake_tag;        // Addresses identify non-peer fds in epoll
+static Connection *connections = NULL;
+static int connection_count = 0;
+static int awaiting_count = 0;
+static int listen_fd = -1;
+static int accept_paused = 0;
+static time_t accept_pause_logged = 0;
+static Connection *waiting_head = NULL;
+static Connection *waiting_tail = NULL;
+
+static Connection *returned_head = NULL;
+static pthread_mutex_t returned_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void set_nonblocking(int sock, int on) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return;
+    fcntl(sock, F_SETFL, on ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+static int watch_connection(Connection *conn) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->sock, &ev);
+}
+
+static void close_connection(Connection *conn) {
+    if (conn->state == CONN_AWAIT_DECISION) {
+        awaiting_count--;
+        offers_withdraw(conn->offer_id);
+        log_message("File transfer from %s cancelled by sender", conn->sender);
+    }
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else connections = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+
+    close(conn->sock);
+    free(conn->payload);
+    free(conn);
+    connection_count--;
+}
+
+static void release_payload(Connection *conn) {
+    free(conn->payload);
+    conn->payload = NULL;
+    conn->payload_cap = 0;
+}
+
+/*
+ * Make room for the payload of the frame just parsed. The buffer outlives
+ * the frame, so a steady stream of chat messages reuses one allocation;
+ * only oversized ones are given back once dispatched.
+ */
+static int reserve_payload(Connection *conn, size_t len) {
+    if (len + 1 <= conn->payload_cap) return 0;
+    size_t cap = len + 1 < REACTOR_PAYLOAD_MIN ? REACTOR_PAYLOAD_MIN : len + 1;
+    char *payload = realloc(conn->payload, cap);
+    if (!payload) return -1;
+    conn->payload = payload;
+    conn->payload_cap = cap;
+    return 0;
+}
+
+// Wake the event loop from another thread
+void reactor_wake() {
+    uint64_t one = 1;
+    if (wake_fd >= 0 && write(wake_fd, &one, sizeof(one)) < 0) {
+        // The counter only saturates if the reactor is gone
+    }
+}
+
+// Give a connection back to the reactor from a worker thread
+static void return_connection(Connection *conn, int failed) {
+    conn->failed = failed;
+    set_nonblocking(conn->sock, 1);
+
+    pthread_mutex_lock(&returned_mutex);
+    conn->returned_next = returned_head;
+    returned_head = conn;
+    pthread_mutex_unlock(&returned_mutex);
+
+    reactor_wake();
+}
+
+static void receive_file_job(void *arg) {
+    Connection *conn = arg;
+    return_connection(conn, receive_file(conn->sock, &conn->meta) < 0);
+}
+
+static void receive_stripe_job(void *arg) {
+    Connection *conn = arg;
+    return_connection(conn, receive_stripe(conn->sock, &conn->stripe) < 0);
+}
+
+/*
+ * Detach a connection from epoll and run a blocking job on it in a worker,
+ * e.g. answering a file offer and receiving the body. The worker hands it
+ * back through the wake eventfd when done. If every worker ring is full the
+ * connection waits, unread, until start_waiting_jobs() finds room; the peer
+ * just sees a slow answer. Returns -1 if there are no workers at all.
+ */
+static int hand_to_worker(Connection *conn, WorkFn job) {
+    if (workers_count() == 0) return -1;
+
+    release_payload(conn);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+    set_nonblocking(conn->sock, 0);
+    conn->job = job;
+    conn->state = CONN_IN_WORKER;
+    // Jobs already waiting go first
+    if (!waiting_head && workers_submit(job, conn) == 0) return 0;
+
+    conn->state = CONN_WAIT_WORKER;
+    conn->waiting_next = NULL;
+    if (waiting_tail) waiting_tail->waiting_next = conn;
+    else waiting_head = conn;
+    waiting_tail = conn;
+    return 0;
+}
+
+// Hand waiting connections to workers, oldest first, while rings have room
+static void start_waiting_jobs() {
+    while (waiting_head) {
+        Connection *conn = waiting_head;
+        conn->state = CONN_IN_WORKER;
+        if (workers_submit(conn->job, conn) < 0) {
+            conn->state = CONN_WAIT_WORKER;
+            return;
+        }
+        waiting_head = conn->waiting_next;
+        if (!waiting_head) waiting_tail = NULL;
+    }
+}
+
+static void handle_file_offer(Connection *conn) {
+    if (wire_decode_offer((const unsigned char *)conn->payload, conn->header.payload_len, &conn->meta) < 0) {
+        send_file_response(conn->sock, 0, NULL);
+        return;
+    }
+    conn->meta.flags &= conn->caps;
+
+    const char *filename = strrchr(conn->meta.filename, '/');
+    if (filename) filename++;
+    else filename = conn->meta.filename;
+
+    // Queue the offer; the connection idles until the user decides
+    conn->offer_id = offers_add(conn);
+    if (conn->offer_id == 0) {
+        send_file_response(conn->sock, 0, NULL);
+        return;
+    }
+    conn->state = CONN_AWAIT_DECISION;
+    conn->offer_time = time(NULL);
+    awaiting_count++;
+
+    // Directories are shown with a trailing slash
+    char shown[sizeof(conn->meta.filename) + 1];
+    snprintf(shown, sizeof(shown), "%s%s", filename, (conn->meta.flags & FILE_CAP_TREE) ? "/" : "");
+    log_file_offer(conn->offer_id, conn->sender, shown, conn->meta.file_size);
+}
+
+static void dispatch_frame(Connection *conn) {
+    FrameHeader *header = &conn->header;
+
+    if (header->type == MSG_TEXT) {
+        const char *text = conn->payload;
+        log_chat(LOG_CHAT_IN, "%s: %s", conn->sender, text);
+        chatlog_append(conn->sender, CHATLOG_IN, text);
+    } else if (header->type == MSG_FILE_METADATA) {
+        handle_file_offer(conn);
+    } else if (header->type == MSG_FILE_ACCEPT) {
+        log_message("File transfer accepted by %s", conn->sender);
+    } else if (header->type == MSG_FILE_REJECT) {
+        log_message("File transfer rejected by %s", conn->sender);
+    } else if (header->type == MSG_FILE_STRIPE) {
+        if (wire_decode_stripe((const unsigned char *)conn->payload, header->payload_len, &conn->stripe) < 0) {
+            conn->failed = 1;
+            return;
+        }
+        if (hand_to_worker(conn, receive_stripe_job) < 0) conn->failed = 1;
+    }
+    // Stray MSG_FILE_CHUNK frames (e.g. after a failed open) are skipped whole
+}
+
+// Take the peer's identity from its hello and answer with ours
+static int finish_hello(Connection *conn, const WireHello *hello) {
+    memcpy(conn->sender, hello->username, USERNAME_LEN);
+    conn->caps = hello->caps;
+
+    // The socket is fresh, so the reply fits in its send buffer
+    unsigned char reply[WIRE_HELLO_MAX];
+    size_t len = wire_encode_hello(reply);
+    return send(conn->sock, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len ? 0 : -1;
+}
+
+/*
+ * Drain everything the socket has buffered, assembling frames as the bytes
+ * arrive. Edge-triggered epoll only reports new data once, so this must run
+ * until recv() reports EAGAIN or the connection leaves the reading states.
+ */
+static void process_input(Connection *conn) {
+    while (conn->state == CONN_READ_HELLO || conn->state == CONN_READ_HEADER ||
+           conn->state == CONN_READ_PAYLOAD) {
+        // Hellos and headers are read exactly, never past their last byte
+        char *dst;
+        size_t want;
+        if (conn->state == CONN_READ_PAYLOAD) {
+            dst = conn->payload + conn->payload_got;
+            want = conn->header.payload_len - conn->payload_got;
+        } else {
+            dst = (char *)conn->head + conn->head_got;
+            want = conn->head_want - conn->head_got;
+        }
+
+        ssize_t n = want > 0 ? recv(conn->sock, dst, want, 0) : 0;
+        if (want > 0 && n == 0) {
+            close_connection(conn);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            close_connection(conn);
+            return;
+        }
+
+        if (conn->state == CONN_READ_HELLO) {
+            conn->head_got += n;
+            if (conn->head_got < conn->head_want) continue;
+            WireHello hello;
+            int need = wire_parse_hello(conn->head, conn->head_got, &hello);
+            if (need > 0) {
+                conn->head_want = need;
+                continue;
+            }
+            if (need < 0 || finish_hello(conn, &hello) < 0) {
+                close_connection(conn);
+                return;
+            }
+            conn->head_got = 0;
+            conn->head_want = 2;
+            conn->state = CONN_READ_HEADER;
+            continue;
+        }
+
+        if (conn->state == CONN_READ_HEADER) {
+            conn->head_got += n;
+            if (conn->head_got < conn->head_want) continue;
+            int need = wire_parse_header(conn->head, conn->head_got, &conn->header);
+            if (need > 0) {
+                conn->head_want = need;
+                continue;
+            }
+            conn->head_got = 0;
+            conn->head_want = 2;
+            if (need < 0 || conn->header.payload_len > MAX_PAYLOAD_LEN) {
+                close_connection(conn);
+                return;
+            }
+            if (reserve_payload(conn, conn->header.payload_len) < 0) {
+                close_connection(conn);
+                return;
+            }
+            conn->payload_got = 0;
+            conn->state = CONN_READ_PAYLOAD;
+        } else {
+            conn->payload_got += n;
+        }
+
+        if (conn->state == CONN_READ_PAYLOAD && conn->payload_got == conn->header.payload_len) {
+            conn->payload[conn->payload_got] = '\0';
+            conn->state = CONN_READ_HEADER;
+            dispatch_frame(conn);
+            // Owned by a worker now, or waiting for one
+            if (conn->state == CONN_IN_WORKER || conn->state == CONN_WAIT_WORKER) return;
+            if (conn->payload_cap > REACTOR_PAYLOAD_KEEP) release_payload(conn);
+            if (conn->failed) {
+                close_connection(conn);
+                return;
+            }
+        }
+    }
+}
+
+static int accept_saturated() {
+    return connection_count >= app_state.max_connections || workers_saturated() || waiting_head != NULL;
+}
+
+static void watch_listener(int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+}
+
+/*
+ * Stop watching the listening socket. New connections wait in its backlog
+ * until the event loop finds capacity again and resumes accepting.
+ */
+static void pause_accepting(const char *reason) {
+    if (accept_paused) return;
+    accept_paused = 1;
+    watch_listener(0);
+
+    time_t now = time(NULL);
+    if (now - accept_pause_logged >= ACCEPT_PAUSE_LOG_SEC) {
+        accept_pause_logged = now;
+        log_message("Not accepting connections for now: %s", reason);
+    }
+}
+
+static void accept_connections() {
+    while (1) {
+        if (accept_saturated()) {
+            pause_accepting(connection_count >= app_state.max_connections ?
+                            "connection limit reached" : "file transfers are queued");
+            return;
+        }
+
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // With EPOLLET a descriptor shortage would otherwise stall until the next connection
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                pause_accepting("out of descriptors or memory");
+            }
+            return;
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(sock);
+            continue;
+        }
+        conn->sock = sock;
+        conn->state = CONN_READ_HELLO;
+        conn->head_want = WIRE_HELLO_PREFIX;
+        conn->next = connections;
+        if (connections) connections->prev = conn;
+        connections = conn;
+        connection_count++;
+
+        if (watch_connection(conn) < 0) {
+            close_connection(conn);
+            continue;
+        }
+        // Data may already be queued; with EPOLLET no edge would report it
+        process_input(conn);
+    }
+}
+
+// Resume once there is room; the backlog is drained at once since no edge will report it
+static void resume_accepting() {
+    if (!accept_paused || accept_saturated()) return;
+    accept_paused = 0;
+    watch_listener(EPOLLIN | EPOLLET);
+    accept_connections();
+}
+
+static void resume_returned_connections() {
+    uint64_t count;
+    if (read(wake_fd, &count, sizeof(count)) < 0) {
+        // Nothing pending; spurious wakeup
+    }
+
+    pthread_mutex_lock(&returned_mutex);
+    Connection *conn = returned_head;
+    returned_head = NULL;
+    pthread_mutex_unlock(&returned_mutex);
+
+    while (conn) {
+        Connection *next = conn->returned_next;
+        conn->state = CONN_READ_HEADER;
+        if (conn->failed || watch_connection(conn) < 0) {
+            close_connection(conn);
+        } else {
+            process_input(conn);
+        }
+        conn = next;
+    }
+}
+
+static void finish_file_offer(Connection *conn, int accepted) {
+    awaiting_count--;
+
+    // The worker answers an acceptance once the destination is ready
+    if (accepted) {
+        if (hand_to_worker(conn, receive_file_job) < 0) {
+            send_file_response(conn->sock, 0, NULL);
+            log_message("File transfer from %s refused: no worker thread is running", conn->sender);
+            conn->state = CONN_READ_HEADER;
+            close_connection(conn);
+        }
+    } else {
+        send_file_response(conn->sock, 0, NULL);
+        const char *filename = strrchr(conn->meta.filename, '/');
+        log_message("File transfer rejected: %s", filename ? filename + 1 : conn->meta.filename);
+        conn->state = CONN_READ_HEADER;
+        process_input(conn);
+    }
+}
+
+// Answer offers the local user has decided on since the last wakeup
+static void apply_file_decisions() {
+    int decision;
+    Connection *conn;
+    while ((conn = offers_next_decided(&decision)) != NULL) {
+        finish_file_offer(conn, decision == OFFER_ACCEPTED);
+    }
+}
+
+// Reject offers left unanswered for FILE_DECISION_TIMEOUT
+static void expire_file_offers() {
+    if (awaiting_count == 0) return;
+
+    time_t now = time(NULL);
+    Connection *conn = connections;
+    while (conn) {
+        Connection *next = conn->next;
+        if (conn->state == CONN_AWAIT_DECISION && now - conn->offer_time >= FILE_DECISION_TIMEOUT) {
+            // A decision that raced the timeout still counts
+            int decision = offers_withdraw(conn->offer_id);
+            if (decision == OFFER_PENDING) {
+                log_message("File transfer from %s timed out (rejected)", conn->sender);
+            }
+            finish_file_offer(conn, decision == OFFER_ACCEPTED);
+        }
+        conn = next;
+    }
+}
+
+/*
+ * Single-threaded event loop owning the listening socket and every peer
+ * connection. Frames are parsed incrementally on non-blocking sockets;
+ * only file bodies, which block on disk, are passed to the worker set.
+ * Accepting pauses while max_connections are open or the workers are
+ * backed up, leaving further connections in the listen backlog; a body no
+ * worker ring has room for waits with its connection unread.
+ */
+void *tcp_server(void *arg) {
+    (void)arg;
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) return NULL;
+
+    // Pooled connections leave TIME_WAIT entries on our port when we exit
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    // Accepted sockets inherit TCP_NODELAY and the buffer sizes from here
+    tune_socket(sock);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(app_state.local_tcp_port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_message("Error: Could not bind to TCP port %d. Is it already in use?", app_state.local_tcp_port);
+        close(sock);
+        return NULL;
+    }
+
+    // The kernel caps this at net.core.somaxconn
+    if (listen(sock, SOMAXCONN) < 0) {
+        close(sock);
+        return NULL;
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epoll_fd < 0 || wake_fd < 0) {
+        log_message("Error: Could not start the connection event loop");
+        close(sock);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+    ev.data.ptr = &wake_tag;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    listen_fd = sock;
+
+    int started = init_workers(app_state.worker_threads);
+    if (started < app_state.worker_threads) {
+        log_message("Warning: Only %d of %d worker threads started", started, app_state.worker_threads);
+    }
+
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    while (app_state.running) {
+        int n = epoll_wait(epoll_fd, events, REACTOR_MAX_EVENTS, REACTOR_TICK_MS);
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listen_tag) {
+                accept_connections();
+            } else if (events[i].data.ptr == &wake_tag) {
+                resume_returned_connections();
+            } else {
+                Connection *conn = events[i].data.ptr;
+                if (conn->state == CONN_AWAIT_DECISION) {
+                    // The sender should be silent until we answer
+                    if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                        close_connection(conn);
+                    }
+                } else {
+                    process_input(conn);
+                }
+            }
+        }
+        // Deciding can close a connection, so it waits until no event of this batch can name it
+        apply_file_decisions();
+        expire_file_offers();
+        sweep_striped_transfers();
+        start_waiting_jobs();
+        resume_accepting();
+    }
+
+    close(sock);
+    return NULL;
+}
@@ -0,0 +1,327 @@
+#include <stdlib.h>
+#include <string.h>
+#include "../include/search.h"
+#include "../include/history.h"
+
+/*
+ * Inverted index over the chat history: each word maps to the history
+ * line numbers it appears on. Line numbers only grow, so a posting list
+ * is kept as varint deltas, usually one byte per line. Lines evicted from
+ * history are dropped in a sweep once the index has doubled in size,
+ * which only moves each list's base forward. Only the UI thread uses it.
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t name;              // Offset of the word in names
+    uint32_t name_len;
+    uint32_t count;             // Postings, some possibly evicted since the last sweep
+    uint64_t base;              // The first delta is taken from here
+    uint64_t last;              // Newest posting, or base when empty
+    unsigned char *postings;
+    uint32_t len;
+    uint32_t cap;
+} Term;
+
+typedef struct {
+    Term *terms;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *slots;            // Open addressing; term position + 1, 0 when free
+    uint32_t buckets;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
+    size_t bytes;               // Postings and names in use
+    size_t sweep_at;
+} SearchIndex;
+
+static SearchIndex dict;
+
+static int is_word_char(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+// Next word of *text, lowercased into word; returns its length, 0 at the end
+static size_t next_word(const char **text, char *word) {
+    const unsigned char *p = (const unsigned char *)*text;
+    while (*p && !is_word_char(*p)) p++;
+    size_t len = 0;
+    for (; *p && is_word_char(*p); p++) {
+        if (len < SEARCH_WORD_MAX) word[len++] = (char)(*p >= 'A' && *p <= 'Z' ? *p + 32 : *p);
+    }
+    *text = (const char *)p;
+    return len;
+}
+
+// FNV-1a
+static uint32_t hash_word(const char *word, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)word[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void index_term(SearchIndex *d, uint32_t pos) {
+    uint32_t mask = d->buckets - 1;
+    uint32_t b = d->terms[pos].hash & mask;
+    while (d->slots[b]) b = (b + 1) & mask;
+    d->slots[b] = pos + 1;
+}
+
+static Term *find_term(const char *word, size_t len, uint32_t hash) {
+    if (!dict.buckets) return NULL;
+    uint32_t mask = dict.buckets - 1;
+    for (uint32_t b = hash & mask; dict.slots[b]; b = (b + 1) & mask) {
+        Term *t = &dict.terms[dict.slots[b] - 1];
+        if (t->hash == hash && t->name_len == len && memcmp(dict.names + t->name, word, len) == 0) return t;
+    }
+    return NULL;
+}
+
+static int grow_terms() {
+    uint32_t capacity = dict.capacity ? dict.capacity * 2 : 1024;
+    Term *terms = realloc(dict.terms, capacity * sizeof(Term));
+    if (!terms) return -1;
+    dict.terms = terms;
+
+    uint32_t *slots = calloc(capacity * 2, sizeof(uint32_t));
+    if (!slots) return -1;
+    free(dict.slots);
+    dict.slots = slots;
+    dict.buckets = capacity * 2;
+    dict.capacity = capacity;
+    for (uint32_t i = 0; i < dict.count; i++) index_term(&dict, i);
+    return 0;
+}
+
+static Term *add_term(const char *word, size_t len, uint32_t hash) {
+    if (dict.count == dict.capacity && grow_terms() < 0) return NULL;
+    if (dict.names_len + len > dict.names_cap) {
+        size_t cap = dict.names_cap ? dict.names_cap * 2 : 16384;
+        char *names = realloc(dict.names, cap);
+        if (!names) return NULL;
+        dict.names = names;
+        dict.names_cap = cap;
+    }
+    memcpy(dict.names + dict.names_len, word, len);
+
+    Term *t = &dict.terms[dict.count];
+    memset(t, 0, sizeof(*t));
+    t->hash = hash;
+    t->name = (uint32_t)dict.names_len;
+    t->name_len = (uint32_t)len;
+    index_term(&dict, dict.count++);
+    dict.names_len += len;
+    dict.bytes += len;
+    return t;
+}
+
+static int append_posting(Term *t, uint64_t seq) {
+    if (t->len + 10 > t->cap) {
+        uint32_t cap = t->cap ? t->cap * 2 : 8;
+        while (cap < t->len + 10) cap *= 2;
+        unsigned char *postings = realloc(t->postings, cap);
+        if (!postings) return -1;
+        t->postings = postings;
+        dict.bytes += cap - t->cap;
+        t->cap = cap;
+    }
+    uint64_t delta = seq - t->last;
+    while (delta >= 0x80) {
+        t->postings[t->len++] = (unsigned char)(delta | 0x80);
+        delta >>= 7;
+    }
+    t->postings[t->len++] = (unsigned char)delta;
+    t->last = seq;
+    t->count++;
+    return 0;
+}
+
+static uint64_t read_varint(const unsigned char **p) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (**p & 0x80) {
+        value |= (uint64_t)(*(*p)++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (uint64_t)*(*p)++ << shift;
+    return value;
+}
+
+// Drop the postings of lines before first; returns 0 once the term is empty
+static int prune_term(Term *t, uint64_t first) {
+    const unsigned char *p = t->postings;
+    const unsigned char *end = p + t->len;
+    uint64_t seq = t->base;
+    while (p < end) {
+        const unsigned char *at = p;
+        uint64_t next = seq + read_varint(&p);
+        if (next >= first) {
+            p = at;
+            break;
+        }
+        seq = next;
+        t->count--;
+    }
+
+    // The remaining deltas are unchanged, only their starting point moves
+    t->base = seq;
+    t->len = (uint32_t)(end - p);
+    memmove(t->postings, p, t->len);
+    if (t->len == 0) {
+        free(t->postings);
+        return 0;
+    }
+    if (t->cap > 2 * t->len + 16) {
+        unsigned char *postings = realloc(t->postings, t->len);
+        if (postings) {
+            t->postings = postings;
+            t->cap = t->len;
+        }
+    }
+    return 1;
+}
+
+// Rebuild the index without lines that have left the history
+static void sweep() {
+    uint64_t first = history_first();
+    char *names = malloc(dict.names_cap);
+    if (!names) return;
+
+    uint32_t kept = 0;
+    size_t names_len = 0;
+    size_t bytes = 0;
+    for (uint32_t i = 0; i < dict.count; i++) {
+        Term t = dict.terms[i];
+        if (!prune_term(&t, first)) continue;
+        memcpy(names + names_len, dict.names + t.name, t.name_len);
+        t.name = (uint32_t)names_len;
+        names_len += t.name_len;
+        bytes += t.name_len + t.cap;
+        dict.terms[kept++] = t;
+    }
+    free(dict.names);
+    dict.names = names;
+    dict.names_len = names_len;
+    dict.count = kept;
+    dict.bytes = bytes;
+
+    memset(dict.slots, 0, dict.buckets * sizeof(uint32_t));
+    for (uint32_t i = 0; i < dict.count; i++) index_term(&dict, i);
+    dict.sweep_at = bytes * 2 > SEARCH_SWEEP_MIN ? bytes * 2 : SEARCH_SWEEP_MIN;
+}
+
+// Index the words of history line seq; lines must be added in order
+void search_add(uint64_t seq, const char *text) {
+    char word[SEARCH_WORD_MAX];
+    size_t len;
+    while ((len = next_word(&text, word)) != 0) {
+        if (len < 2) continue;      // Too common to be worth a list
+        uint32_t hash = hash_word(word, len);
+        Term *t = find_term(word, len, hash);
+        if (!t) t = add_term(word, len, hash);
+        if (!t || (t->count > 0 && t->last == seq)) continue;
+        append_posting(t, seq);
+    }
+
+    if (dict.sweep_at == 0) dict.sweep_at = SEARCH_SWEEP_MIN;
+    if (dict.bytes > dict.sweep_at) sweep();
+}
+
+typedef struct {
+    const Term *term;
+    const unsigned char *p;
+    const unsigned char *end;
+    uint64_t seq;
+    int weight;
+    int active;
+} Cursor;
+
+static void advance(Cursor *c) {
+    if (c->p < c->end) c->seq += read_varint(&c->p);
+    else c->active = 0;
+}
+
+/*
+ * Find history lines with any of the query's words. A line scores the
+ * weights of the words it holds, rarer words weighing more, and ties go
+ * to the newer line. Fills hits best first and returns how many; *total
+ * is the number of matching lines still in history.
+ */
+int search_query(const char *query, uint64_t *hits, int max_hits, int *total) {
+    Cursor cursors[SEARCH_TERMS_MAX];
+    int n = 0;
+    uint64_t lines = history_end() - history_first();
+
+    char word[SEARCH_WORD_MAX];
+    size_t len;
+    while (n < SEARCH_TERMS_MAX && (len = next_word(&query, word)) != 0) {
+        if (len < 2) continue;
+        Term *t = find_term(word, len, hash_word(word, len));
+        if (!t || t->count == 0) continue;
+
+        int duplicate = 0;
+        for (int i = 0; i < n; i++) duplicate |= cursors[i].term == t;
+        if (duplicate) continue;
+
+        // Weight grows with log2 of how rare the word is
+        int weight = 1;
+        for (uint64_t ratio = lines / t->count; ratio > 1; ratio >>= 1) weight++;
+
+        Cursor *c = &cursors[n++];
+        c->term = t;
+        c->p = t->postings;
+        c->end = t->postings + t->len;
+        c->seq = t->base;
+        c->weight = weight;
+        c->active = 1;
+        advance(c);
+    }
+
+    if (max_hits > SEARCH_RESULTS) max_hits = SEARCH_RESULTS;
+    int scores[SEARCH_RESULTS];
+    int found = 0;
+    uint64_t first = history_first();
+    *total = 0;
+
+    // Merge the lists in line order, scoring each line once
+    while (1) {
+        uint64_t seq = UINT64_MAX;
+        for (int i = 0; i < n; i++) {
+            if (cursors[i].active && cursors[i].seq < seq) seq = cursors[i].seq;
+        }
+        if (seq == UINT64_MAX) break;
+
+        int score = 0;
+        for (int i = 0; i < n; i++) {
+            if (cursors[i].active && cursors[i].seq == seq) {
+                score += cursors[i].weight;
+                advance(&cursors[i]);
+            }
+        }
+        if (seq < first) continue;
+        (*total)++;
+
+        // Lines arrive oldest first, so a tie places the new one ahead
+        int pos = 0;
+        while (pos < found && scores[pos] > score) pos++;
+        if (pos >= max_hits) continue;
+        int last = found < max_hits ? found : max_hits - 1;
+        memmove(&scores[pos + 1], &scores[pos], (last - pos) * sizeof(int));
+        memmove(&hits[pos + 1], &hits[pos], (last - pos) * sizeof(uint64_t));
+        scores[pos] = score;
+        hits[pos] = seq;
+        if (found < max_hits) found++;
+    }
+    return found;
+}
+
+void cleanup_search() {
+    for (uint32_t i = 0; i < dict.count; i++) free(dict.terms[i].postings);
+    free(dict.terms);
+    free(dict.slots);
+    free(dict.names);
+    memset(&dict, 0, sizeof(dict));
+}
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "../include/stripes.h"
+#include "../include/transfer.h"
+#include "../include/app.h"
+#include "../include/log.h"
+
+typedef enum {
+    STRIPES_PENDING,     // Accepted, waiting for the sender's start offset
+    STRIPES_RUNNING,
+    STRIPES_ABORTED
+} StripesState;
+
+struct StripedTransfer {
+    uint64_t id;
+    struct in_addr peer;
+    int fd;
+    char part_path[300];             // Empty when writing the destination directly
+    char filename[256];
+    uint64_t start;
+    uint64_t end;
+    uint32_t streams;
+    StripesState state;
+    uint32_t claimed;                // Bit per stripe that has a connection
+    uint32_t done;                   // Stripes that finished, successfully or not
+    int failed;
+    int write_failed;
+    uint64_t received[MAX_FILE_STREAMS];
+    time_t created;
+    struct StripedTransfer *next;
+};
+
+static StripedTransfer *transfers = NULL;
+static pthread_mutex_t stripes_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripes_cond = PTHREAD_COND_INITIALIZER;
+
+static void unlink_transfer(StripedTransfer *t) {
+    StripedTransfer **link = &transfers;
+    while (*link && *link != t) link = &(*link)->next;
+    if (*link) *link = t->next;
+}
+
+/*
+ * Close out a transfer once every stripe has reported. On failure a
+ * resumable .part file is cut back to the longest prefix that arrived
+ * intact, so the next offer can resume from there.
+ */
+static void finalize_transfer(StripedTransfer *t) {
+    const char *part_path = t->part_path[0] ? t->part_path : NULL;
+
+    if (t->state == STRIPES_ABORTED) {
+        close(t->fd);
+        finish_received_file(part_path, t->filename, TRANSFER_STREAM_ERROR);
+        free(t);
+        return;
+    }
+
+    int status = TRANSFER_OK;
+    for (uint32_t i = 0; i < t->streams; i++) {
+        uint64_t offset, len;
+        stripe_range(t->start, t->end, t->streams, i, &offset, &len);
+        if (t->received[i] < len) {
+            if (part_path && ftruncate(t->fd, offset + t->received[i]) < 0) {
+                log_message("Failed to truncate partial file: %s", part_path);
+            }
+            status = TRANSFER_STREAM_ERROR;
+            break;
+        }
+    }
+    if (status == TRANSFER_OK && t->failed) status = TRANSFER_STREAM_ERROR;
+    if (status == TRANSFER_OK && t->write_failed) status = TRANSFER_WRITE_ERROR;
+
+    close(t->fd);
+    finish_received_file(part_path, t->filename, status);
+    free(t);
+}
+
+// Record one stripe's outcome; returns 1 when it was the last one
+static int stripe_done_locked(StripedTransfer *t, uint32_t index, int status, uint64_t received) {
+    t->received[index] = received;
+    if (status == TRANSFER_STREAM_ERROR) t->failed = 1;
+    if (status == TRANSFER_WRITE_ERROR) t->write_failed = 1;
+    t->done++;
+    if (t->done < t->streams) return 0;
+    unlink_transfer(t);
+    return 1;
+}
+
+// Count stripes that never got a connection as failed
+static int drop_unclaimed_locked(StripedTransfer *t) {
+    int last = 0;
+    for (uint32_t i = 0; i < t->streams; i++) {
+        if (!(t->claimed & (1u << i))) {
+            t->claimed |= 1u << i;
+            last = stripe_done_locked(t, i, TRANSFER_STREAM_ERROR, 0);
+        }
+    }
+    return last;
+}
+
+/*
+ * Track an accepted striped offer. Stripe 0 belongs to the connection that
+ * made the offer; the others are claimed as their connections arrive.
+ */
+StripedTransfer *stripes_register(const FileMetadata *meta, struct in_addr peer, int fd,
+                                  const char *part_path, const char *filename, uint32_t streams) {
+    StripedTransfer *t = calloc(1, sizeof(StripedTransfer));
+    if (!t) return NULL;
+
+    t->id = meta->transfer_id;
+    t->peer = peer;
+    t->fd = fd;
+    if (part_path) strncpy(t->part_path, part_path, sizeof(t->part_path) - 1);
+    strncpy(t->filename, filename, sizeof(t->filename) - 1);
+    t->end = meta->file_size;
+    t->streams = streams;
+    t->state = STRIPES_PENDING;
+    t->claimed = 1;
+    t->created = time(NULL);
+
+    pthread_mutex_lock(&stripes_mutex);
+    t->next = transfers;
+    transfers = t;
+    pthread_mutex_unlock(&stripes_mutex);
+    return t;
+}
+
+// The sender's start offset is known; stripe connections may proceed
+void stripes_begin(StripedTransfer *t, uint64_t start) {
+    pthread_mutex_lock(&stripes_mutex);
+    t->start = start;
+    t->state = STRIPES_RUNNING;
+    pthread_cond_broadcast(&stripes_cond);
+    pthread_mutex_unlock(&stripes_mutex);
+}
+
+// The offer's own connection failed before the body started
+void stripes_abort(StripedTransfer *t) {
+    pthread_mutex_lock(&stripes_mutex);
+    t->state = STRIPES_ABORTED;
+    pthread_cond_broadcast(&stripes_cond);
+    int last = stripe_done_locked(t, 0, TRANSFER_STREAM_ERROR, 0);
+    if (!last) last = drop_unclaimed_locked(t);
+    pthread_mutex_unlock(&stripes_mutex);
+    if (last) finalize_transfer(t);
+}
+
+// Receive one stripe's byte range on a blocking socket
+int stripes_receive(StripedTransfer *t, int sock, uint32_t index) {
+    uint64_t offset, len;
+    stripe_range(t->start, t->end, t->streams, index, &offset, &len);
+
+    size_t received = 0;
+    int status = receive_file_stream(sock, t->fd, offset, len, &received);
+
+    pthread_mutex_lock(&stripes_mutex);
+    int last = stripe_done_locked(t, index, status, received);
+    pthread_mutex_unlock(&stripes_mutex);
+    if (last) finalize_transfer(t);
+    return status;
+}
+
+/*
+ * Serve an extra connection announced by MSG_FILE_STRIPE. It must come from
+ * the same host as the offer and claim a stripe nobody else holds. Returns
+ * -1 when the connection can no longer be used.
+ */
+int receive_stripe(int sock, const FileStripe *stripe) {
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(sock, (struct sockaddr *)&addr, &addr_len) < 0) return -1;
+
+    pthread_mutex_lock(&stripes_mutex);
+    StripedTransfer *t = transfers;
+    while (t && t->id != stripe->transfer_id) t = t->next;
+
+    if (!t || t->peer.s_addr != addr.sin_addr.s_addr || t->state == STRIPES_ABORTED ||
+        stripe->index == 0 || stripe->index >= t->streams ||
+        (t->claimed & (1u << stripe->index))) {
+        pthread_mutex_unlock(&stripes_mutex);
+        return -1;
+    }
+    t->claimed |= 1u << stripe->index;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += STRIPE_JOIN_TIMEOUT;
+    while (t->state == STRIPES_PENDING) {
+        if (pthread_cond_timedwait(&stripes_cond, &stripes_mutex, &deadline) != 0) break;
+    }
+
+    if (t->state != STRIPES_RUNNING) {
+        int last = stripe_done_locked(t, stripe->index, TRANSFER_STREAM_ERROR, 0);
+        pthread_mutex_unlock(&stripes_mutex);
+        if (last) finalize_transfer(t);
+        return -1;
+    }
+    pthread_mutex_unlock(&stripes_mutex);
+
+    return stripes_receive(t, sock, stripe->index) == TRANSFER_STREAM_ERROR ? -1 : 0;
+}
+
+// Give up on stripes whose connections never arrived
+void sweep_striped_transfers() {
+    time_t now = time(NULL);
+    StripedTransfer *finished = NULL;
+
+    pthread_mutex_lock(&stripes_mutex);
+    StripedTransfer *t = transfers;
+    while (t) {
+        StripedTransfer *next = t->next;
+        if (now - t->created >= STRIPE_JOIN_TIMEOUT && drop_unclaimed_locked(t)) {
+            t->next = finished;
+            finished = t;
+        }
+        t = next;
+    }
+    pthread_mutex_unlock(&stripes_mutex);
+
+    while (finished) {
+        StripedTransfer *next = finished->next;
+        finalize_transfer(finished);
+        finished = next;
+    }
+}
@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include "../include/network.h"
+#include "../include/transfer.h"
+#include "../include/wire.h"
+#include "../include/uring.h"
+#include "../include/util.h"
+#include "../include/app.h"
+
+// The kernel refuses zero-copy for this pair of descriptors
+static int zero_copy_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+/*
+ * Send len bytes of the file starting at offset. The bytes go straight from
+ * the page cache to the socket with sendfile(); once the kernel refuses
+ * that for this descriptor pair, *zero_copy is cleared and the rest of the
+ * transfer is copied through the caller's buffer.
+ */
+static int send_range(int sock, int fd, off_t offset, size_t len, int *zero_copy, char *buffer) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n;
+        if (*zero_copy) {
+            off_t pos = offset + sent;
+            n = sendfile(sock, fd, &pos, len - sent);
+            if (n < 0 && zero_copy_unsupported(errno)) {
+                *zero_copy = 0;
+                continue;
+            }
+        } else {
+            size_t want = len - sent < TRANSFER_COPY_SIZE ? len - sent : TRANSFER_COPY_SIZE;
+            n = pread(fd, buffer, want, offset + sent);
+            if (n > 0 && send_exact(sock, buffer, n, 0) < 0) return -1;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1; // Socket error, or the file shrank under us
+        sent += n;
+    }
+    return 0;
+}
+
+/*
+ * The ring for a stream body of len bytes, or NULL to stay on sendfile()
+ * and splice(). Opt-in with io_uring=1: on loopback with a warm page cache
+ * the zero-copy path is still faster.
+ */
+static UringEngine *body_ring(off_t len) {
+    return app_state.io_uring && len >= URING_MIN_RANGE ? uring_engine() : NULL;
+}
+
+/*
+ * Send the next chunk of the body through the ring when there is one. If
+ * the kernel refuses the ring's operations before any byte moved, this and
+ * every later chunk of the body take the plain path.
+ */
+static int send_stream_range(UringEngine **ring, int sock, int fd, off_t offset, size_t len,
+                             int *zero_copy, char *buffer) {
+    if (*ring) {
+        int status = uring_send_chunk(*ring, len);
+        if (status != URING_UNSUPPORTED) return status == URING_OK ? 0 : -1;
+        *ring = NULL;
+    }
+    return send_range(sock, fd, offset, len, zero_copy, buffer);
+}
+
+/*
+ * Cork the socket for the length of a file body so only full segments
+ * leave, however the chunk prefixes and sendfile() calls line up.
+ * Uncorking pushes out the tail at once.
+ */
+static void cork_socket(int sock, int on) {
+    if (app_state.tcp_cork) setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static int send_cancelled(TransferProgress *progress) {
+    return progress && atomic_load(&progress->cancelled);
+}
+
+static void count_sent(TransferProgress *progress, size_t len) {
+    if (progress) atomic_fetch_add(&progress->sent, len);
+}
+
+static int send_chunk_frames(int sock, int fd, off_t size, TransferProgress *progress) {
+    char buffer[TRANSFER_COPY_SIZE];
+    int zero_copy = 1;
+    off_t offset = 0;
+
+    while (offset < size) {
+        if (send_cancelled(progress)) return -1;
+        size_t len = size - offset < CHUNK_SIZE ? (size_t)(size - offset) : CHUNK_SIZE;
+        unsigned char header[WIRE_HEADER_MAX];
+        size_t header_len = wire_encode_header(header, MSG_FILE_CHUNK, len);
+        // MSG_MORE lets each header share a segment with its body
+        if (send_exact(sock, header, header_len, MSG_MORE) < 0) return -1;
+        if (send_range(sock, fd, offset, len, &zero_copy, buffer) < 0) return -1;
+        count_sent(progress, len);
+        offset += len;
+    }
+    return 0;
+}
+
+// Stream the file as MSG_FILE_CHUNK frames, for receivers without FILE_CAP_STREAM
+int send_file_body(int sock, int fd, off_t size, TransferProgress *progress) {
+    cork_socket(sock, 1);
+    int status = send_chunk_frames(sock, fd, size, progress);
+    cork_socket(sock, 0);
+    return status;
+}
+
+/*
+ * Pick the next stream chunk so that one chunk takes roughly
+ * STREAM_CHUNK_TARGET_MS at the rate the last one drained into the socket.
+ * Growth and shrinkage are limited to a factor of two per chunk.
+ */
+static size_t adapt_chunk_size(size_t current, size_t bytes, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+
+    size_t target = STREAM_CHUNK_MAX;
+    if (elapsed > 0) {
+        double ideal = bytes / elapsed * STREAM_CHUNK_TARGET_MS / 1000.0;
+        if (ideal < STREAM_CHUNK_MAX) target = (size_t)ideal;
+    }
+
+    if (target > current * 2) target = current * 2;
+    if (target < current / 2) target = current / 2;
+    if (target < STREAM_CHUNK_MIN) target = STREAM_CHUNK_MIN;
+    if (target > STREAM_CHUNK_MAX) target = STREAM_CHUNK_MAX;
+    return target;
+}
+
+/*
+ * Stream the bytes of the file between offset and end as [u32 length][bytes]
+ * chunks in network byte order, ended by a zero length. Chunk sizes follow
+ * the measured throughput between STREAM_CHUNK_MIN and STREAM_CHUNK_MAX.
+ * A cancellation leaves the stream unterminated, so the receiver keeps
+ * what arrived as a resumable prefix.
+ */
+static int send_length_prefixed(int sock, int fd, off_t offset, off_t end, TransferProgress *progress) {
+    char buffer[TRANSFER_COPY_SIZE];
+    int zero_copy = 1;
+    size_t chunk = STREAM_CHUNK_MIN;
+    UringEngine *ring = body_ring(end - offset);
+    if (ring) uring_send_begin(ring, sock, fd, offset, end);
+    UringEngine *session = ring;
+
+    int status = 0;
+    while (offset < end && status == 0) {
+        if (send_cancelled(progress)) {
+            status = -1;
+            break;
+        }
+        size_t len = end - offset < (off_t)chunk ? (size_t)(end - offset) : chunk;
+        uint32_t prefix = htonl((uint32_t)len);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (send_exact(sock, &prefix, sizeof(prefix), MSG_MORE) < 0 ||
+            send_stream_range(&ring, sock, fd, offset, len, &zero_copy, buffer) < 0) {
+            status = -1;
+            break;
+        }
+
+        count_sent(progress, len);
+        chunk = adapt_chunk_size(chunk, len, &start);
+        offset += len;
+    }
+    if (session) uring_finish(session);
+    if (status < 0) return -1;
+
+    uint32_t terminator = 0;
+    return send_exact(sock, &terminator, sizeof(terminator), 0);
+}
+
+int send_file_stream(int sock, int fd, off_t offset, off_t end, TransferProgress *progress) {
+    cork_socket(sock, 1);
+    int status = send_length_prefixed(sock, fd, offset, end, progress);
+    cork_socket(sock, 0);
+    return status;
+}
+
+typedef struct {
+    int pipefd[2];
+    int have_pipe;
+    int sock_splice;    // socket -> pipe is supported
+    int file_splice;    // pipe -> file is supported
+    int write_failed;
+    int fd;
+    off_t offset;       // Where the next byte lands in the file
+    UringEngine *ring;  // Takes over from splice when built with IO_URING=1
+    UringEngine *session; // Ring to finish, even after falling back from it
+    char buffer[TRANSFER_COPY_SIZE];
+} ReceiveState;
+
+static void init_receive_state(ReceiveState *st, int sock, int fd, off_t offset, UringEngine *ring) {
+    st->fd = fd;
+    st->offset = offset;
+    st->ring = ring;
+    st->write_failed = 0;
+    if (ring) uring_receive_begin(ring, sock, fd, offset, &st->write_failed);
+    st->session = ring;
+    st->have_pipe = pipe2(st->pipefd, O_CLOEXEC) == 0;
+    st->sock_splice = st->have_pipe;
+    st->file_splice = st->have_pipe;
+    if (st->have_pipe) {
+        fcntl(st->pipefd[1], F_SETPIPE_SZ, TRANSFER_PIPE_SIZE);
+    }
+}
+
+static int finish_receive_state(ReceiveState *st, int status) {
+    if (st->session) uring_finish(st->session);
+    if (st->have_pipe) {
+        close(st->pipefd[0]);
+        close(st->pipefd[1]);
+    }
+    if (status == TRANSFER_OK && st->write_failed) status = TRANSFER_WRITE_ERROR;
+    return status;
+}
+
+static void store(ReceiveState *st, const char *data, size_t len) {
+    if (!st->write_failed && pwrite(st->fd, data, len, st->offset) != (ssize_t)len) {
+        st->write_failed = 1;
+    }
+    st->offset += len;
+}
+
+// Move bytes already in the pipe to the file, copying if splice is refused
+static void drain_pipe(ReceiveState *st, size_t len) {
+    while (len > 0) {
+        if (st->file_splice && !st->write_failed) {
+            ssize_t n = splice(st->pipefd[0], NULL, st->fd, &st->offset, len, SPLICE_F_MOVE);
+            if (n > 0) {
+                len -= n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && zero_copy_unsupported(errno)) st->file_splice = 0;
+            else st->write_failed = 1;
+        }
+
+        size_t want = len < sizeof(st->buffer) ? len : sizeof(st->buffer);
+        ssize_t n = read(st->pipefd[0], st->buffer, want);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        store(st, st->buffer, n);
+        len -= n;
+    }
+}
+
+static int receive_chunk(ReceiveState *st, int sock, size_t len) {
+    if (st->ring) {
+        int status = uring_receive_chunk(st->ring, len);
+        if (status != URING_UNSUPPORTED) {
+            st->offset += len;
+            return status == URING_OK ? 0 : -1;
+        }
+        // Nothing was read yet, so the plain path can take the whole chunk
+        st->ring = NULL;
+    }
+
+    while (len > 0 && st->sock_splice) {
+        ssize_t n = splice(sock, NULL, st->pipefd[1], NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (!zero_copy_unsupported(errno)) return -1;
+            st->sock_splice = 0;
+            break;
+        }
+        drain_pipe(st, n);
+        len -= n;
+    }
+
+    while (len > 0) {
+        size_t want = len < sizeof(st->buffer) ? len : sizeof(st->buffer);
+        if (recv_exact(sock, st->buffer, want) < 0) return -1;
+        store(st, st->buffer, want);
+        len -= want;
+    }
+    return 0;
+}
+
+// Receive size bytes of MSG_FILE_CHUNK frames into the start of fd
+int receive_file_body(int sock, int fd, size_t size) {
+    ReceiveState st;
+    init_receive_state(&st, sock, fd, 0, NULL);
+
+    int status = TRANSFER_OK;
+    size_t received = 0;
+    while (received < size) {
+        FrameHeader header;
+        if (wire_recv_header(sock, &header) < 0 ||
+            header.type != MSG_FILE_CHUNK ||
+            header.payload_len > CHUNK_SIZE ||
+            receive_chunk(&st, sock, header.payload_len) < 0) {
+            status = TRANSFER_STREAM_ERROR;
+            break;
+        }
+        received += header.payload_len;
+    }
+    return finish_receive_state(&st, status);
+}
+
+/*
+ * Receive a length-delimited stream of exactly size bytes into fd at
+ * offset. Chunk bodies are spliced from the socket through a pipe into the
+ * file so they never enter user space; when either splice is refused they
+ * are copied with pwrite(); with IO_URING=1 they go through registered
+ * buffers instead. Writes never move the file position, so several
+ * streams can fill disjoint ranges of one descriptor at once. The number of
+ * bytes that reached the file is stored in *received.
+ */
+int receive_file_stream(int sock, int fd, off_t offset, size_t size, size_t *received_out) {
+    ReceiveState st;
+    init_receive_state(&st, sock, fd, offset, body_ring(size));
+
+    int status = TRANSFER_OK;
+    size_t received = 0;
+    while (1) {
+        uint32_t prefix;
+        if (recv_exact(sock, &prefix, sizeof(prefix)) < 0) {
+            status = TRANSFER_STREAM_ERROR;
+            break;
+        }
+        size_t len = ntohl(prefix);
+        if (len == 0) {
+            if (received != size) status = TRANSFER_STREAM_ERROR;
+            break;
+        }
+        if (len > STREAM_CHUNK_MAX || len > size - received ||
+            receive_chunk(&st, sock, len) < 0) {
+            status = TRANSFER_STREAM_ERROR;
+            break;
+        }
+        received += len;
+    }
+    if (received_out) *received_out = received;
+    return finish_receive_state(&st, status);
+}
+
+/*
+ * Split [start, end) into the byte range carried by one of streams
+ * connections. Ranges are aligned to STREAM_CHUNK_MIN and the last one
+ * takes the remainder, so both ends derive identical boundaries.
+ */
+void stripe_range(uint64_t start, uint64_t end, uint32_t streams, uint32_t index,
+                  uint64_t *offset, uint64_t *len) {
+    uint64_t span = (end - start) / streams;
+    span = (span + STREAM_CHUNK_MIN - 1) / STREAM_CHUNK_MIN * STREAM_CHUNK_MIN;
+
+    uint64_t first = start + span * index;
+    if (first > end) first = end;
+    uint64_t last = index + 1 == streams ? end : first + span;
+    if (last > end) last = end;
+
+    *offset = first;
+    *len = last - first;
+}
+
+// Slicing-by-8 tables for the reflected CRC-32 polynomial
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0xEDB88320u & -(c & 1));
+        crc_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+        }
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    return crc;
+}
+
+// CRC-32 of the first len bytes of fd, used to validate a resume point
+int transfer_prefix_crc(int fd, off_t len, uint32_t *crc_out) {
+    pthread_once(&crc_once, init_crc_table);
+
+    unsigned char *buffer = malloc(TRANSFER_CRC_BLOCK);
+    if (!buffer) return -1;
+
+    uint32_t crc = 0xFFFFFFFFu;
+    off_t offset = 0;
+    while (offset < len) {
+        size_t want = len - offset < TRANSFER_CRC_BLOCK ? (size_t)(len - offset) : TRANSFER_CRC_BLOCK;
+        ssize_t n = pread(fd, buffer, want, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            free(buffer);
+            return -1;
+        }
+        crc = crc32_update(crc, buffer, n);
+        offset += n;
+    }
+    free(buffer);
+    *crc_out = crc ^ 0xFFFFFFFFu;
+    return 0;
+}
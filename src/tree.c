@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "../include/tree.h"
+#include "../include/wire.h"
+#include "../include/util.h"
+#include "../include/log.h"
+
+/*
+ * Directory transfers. Once the offer is accepted the sender writes, on
+ * the same connection,
+ *
+ *   u32 manifest length | manifest | [u32 length | file data]... | u32 0
+ *
+ * with lengths in network byte order. The manifest is a varint entry
+ * count, then per entry varint kind, mode, size and path length followed
+ * by the path below the root, '/'-separated, parents before children.
+ * The chunks carry the contents of every file in manifest order back to
+ * back, so small files share a chunk and a write instead of costing a
+ * round trip each.
+ */
+typedef struct {
+    int kind;                   // TREE_DIR or TREE_FILE
+    uint32_t mode;              // Permission bits
+    uint64_t size;
+    size_t path;                // Offset of the NUL-terminated path in paths
+} TreeEntry;
+
+struct TreeManifest {
+    int root_fd;                // Sender: the directory being sent
+    TreeEntry *entries;
+    int count;
+    int capacity;
+    char *paths;
+    size_t paths_len;
+    size_t paths_capacity;
+    uint64_t total;             // Bytes in all files
+    int files;
+    int skipped;                // Links, special files and anything too deep or long
+    int failed;                 // Out of memory while scanning
+    unsigned char *manifest;    // Encoded for the wire
+    size_t manifest_len;
+};
+
+static TreeManifest *new_manifest() {
+    TreeManifest *tree = calloc(1, sizeof(TreeManifest));
+    if (tree) tree->root_fd = -1;
+    return tree;
+}
+
+void tree_free(TreeManifest *tree) {
+    if (!tree) return;
+    if (tree->root_fd >= 0) close(tree->root_fd);
+    free(tree->entries);
+    free(tree->paths);
+    free(tree->manifest);
+    free(tree);
+}
+
+static int add_entry(TreeManifest *tree, int kind, uint32_t mode, uint64_t size, const char *path, size_t len) {
+    if (tree->count == tree->capacity) {
+        int capacity = tree->capacity ? tree->capacity * 2 : 256;
+        TreeEntry *entries = realloc(tree->entries, capacity * sizeof(TreeEntry));
+        if (!entries) return -1;
+        tree->entries = entries;
+        tree->capacity = capacity;
+    }
+    if (tree->paths_len + len + 1 > tree->paths_capacity) {
+        size_t capacity = tree->paths_capacity ? tree->paths_capacity * 2 : 16384;
+        while (capacity < tree->paths_len + len + 1) capacity *= 2;
+        char *paths = realloc(tree->paths, capacity);
+        if (!paths) return -1;
+        tree->paths = paths;
+        tree->paths_capacity = capacity;
+    }
+
+    TreeEntry *e = &tree->entries[tree->count++];
+    e->kind = kind;
+    e->mode = mode;
+    e->size = size;
+    e->path = tree->paths_len;
+    memcpy(tree->paths + tree->paths_len, path, len);
+    tree->paths[tree->paths_len + len] = '\0';
+    tree->paths_len += len + 1;
+
+    if (kind == TREE_FILE) {
+        tree->total += size;
+        tree->files++;
+    }
+    return 0;
+}
+
+static const char *entry_path(const TreeManifest *tree, const TreeEntry *e) {
+    return tree->paths + e->path;
+}
+
+/*
+ * Add everything below dir_fd, whose path below the root is path[0..len).
+ * Takes ownership of dir_fd. Symbolic links are never followed, so the
+ * scan cannot leave the tree or loop.
+ */
+static void scan_dir(TreeManifest *tree, int dir_fd, char *path, size_t len, int depth) {
+    DIR *dir = fdopendir(dir_fd);
+    if (!dir) {
+        close(dir_fd);
+        tree->skipped++;
+        return;
+    }
+
+    struct dirent *de;
+    while (!tree->failed && (de = readdir(dir)) != NULL) {
+        const char *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        size_t name_len = strlen(name);
+        size_t sub_len = len + (len > 0) + name_len;
+        struct stat st;
+        if (sub_len >= TREE_PATH_MAX || tree->count >= TREE_ENTRIES_MAX ||
+            fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            tree->skipped++;
+            continue;
+        }
+        if (len > 0) path[len] = '/';
+        memcpy(path + len + (len > 0), name, name_len + 1);
+
+        if (S_ISREG(st.st_mode)) {
+            if (add_entry(tree, TREE_FILE, st.st_mode & 0777, st.st_size, path, sub_len) < 0) tree->failed = 1;
+        } else if (S_ISDIR(st.st_mode) && depth < TREE_DEPTH_MAX) {
+            int sub = openat(dirfd(dir), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (sub < 0) {
+                tree->skipped++;
+            } else if (add_entry(tree, TREE_DIR, st.st_mode & 0777, 0, path, sub_len) < 0) {
+                close(sub);
+                tree->failed = 1;
+            } else {
+                scan_dir(tree, sub, path, sub_len, depth + 1);
+            }
+        } else {
+            tree->skipped++;
+        }
+        path[len] = '\0';
+    }
+    closedir(dir);
+}
+
+static int encode_manifest(TreeManifest *tree) {
+    size_t capacity = WIRE_VARINT_MAX + (size_t)tree->count * 4 * WIRE_VARINT_MAX + tree->paths_len;
+    tree->manifest = malloc(capacity);
+    if (!tree->manifest) return -1;
+
+    unsigned char *p = tree->manifest;
+    p += wire_put_varint(p, tree->count);
+    for (int i = 0; i < tree->count; i++) {
+        const TreeEntry *e = &tree->entries[i];
+        const char *path = entry_path(tree, e);
+        size_t len = strlen(path);
+        p += wire_put_varint(p, e->kind);
+        p += wire_put_varint(p, e->mode);
+        p += wire_put_varint(p, e->size);
+        p += wire_put_varint(p, len);
+        memcpy(p, path, len);
+        p += len;
+    }
+    tree->manifest_len = p - tree->manifest;
+    return tree->manifest_len <= TREE_MANIFEST_MAX ? 0 : -1;
+}
+
+/*
+ * List the directory at root for sending. Blocks on the file system, so it
+ * runs on the outgoing transfer threads. Returns NULL (logged) on failure.
+ */
+TreeManifest *tree_scan(const char *root) {
+    TreeManifest *tree = new_manifest();
+    if (!tree) return NULL;
+
+    tree->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int scan_fd = tree->root_fd >= 0 ? dup(tree->root_fd) : -1;
+    if (scan_fd < 0) {
+        log_message("Failed to open directory: %s", root);
+        tree_free(tree);
+        return NULL;
+    }
+
+    char path[TREE_PATH_MAX] = "";
+    scan_dir(tree, scan_fd, path, 0, 0);
+    if (tree->failed || encode_manifest(tree) < 0) {
+        log_message("Directory too large to send: %s", root);
+        tree_free(tree);
+        return NULL;
+    }
+    if (tree->skipped > 0) {
+        log_message("Skipping %d entries in %s: links, special files, or nested too deep", tree->skipped, root);
+    }
+    return tree;
+}
+
+uint64_t tree_total_bytes(const TreeManifest *tree) {
+    return tree->total;
+}
+
+int tree_file_count(const TreeManifest *tree) {
+    return tree->files;
+}
+
+// Send [u32 length][data] in one call, resuming after short writes
+static int send_prefixed(int sock, const void *data, size_t len) {
+    uint32_t prefix = htonl((uint32_t)len);
+    struct iovec iov[2];
+    iov[0].iov_base = &prefix;
+    iov[0].iov_len = sizeof(prefix);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return sendmsg_exact(sock, iov, len > 0 ? 2 : 1, 0);
+}
+
+/*
+ * Blocks of packed file data, filled by a reader thread running up to
+ * TREE_PREFETCH_BLOCKS ahead of the socket, so disk reads and opens
+ * overlap with sending.
+ */
+typedef struct {
+    const TreeManifest *tree;
+    char *blocks[TREE_PREFETCH_BLOCKS];
+    size_t lens[TREE_PREFETCH_BLOCKS];
+    int head;                   // Next block to send
+    int filled;                 // Blocks ready to send
+    int finished;               // The reader published its last block
+    int stop;                   // The sender gave up
+    int unreadable;             // Files that vanished or shrank since the scan
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} Prefetch;
+
+/*
+ * Fill block with the next file bytes in manifest order. A file that can
+ * no longer be read in full is padded with zeros, which keeps the stream
+ * in step with the sizes the manifest promised.
+ */
+static size_t fill_block(Prefetch *pf, char *block, int *index, int *fd, uint64_t *left) {
+    const TreeManifest *tree = pf->tree;
+    size_t len = 0;
+    while (len < TREE_BLOCK_SIZE) {
+        if (*left == 0) {
+            if (*fd >= 0) close(*fd);
+            *fd = -1;
+            while (*index < tree->count && tree->entries[*index].kind != TREE_FILE) (*index)++;
+            if (*index == tree->count) break;
+            const TreeEntry *e = &tree->entries[(*index)++];
+            *left = e->size;
+            if (*left == 0) continue;
+            *fd = openat(tree->root_fd, entry_path(tree, e), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (*fd < 0) pf->unreadable++;
+        }
+
+        size_t want = *left < TREE_BLOCK_SIZE - len ? *left : TREE_BLOCK_SIZE - len;
+        ssize_t n = *fd >= 0 ? read(*fd, block + len, want) : 0;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (*fd >= 0) {
+                close(*fd);
+                *fd = -1;
+                pf->unreadable++;
+            }
+            memset(block + len, 0, want);
+            n = want;
+        }
+        len += n;
+        *left -= n;
+    }
+    return len;
+}
+
+static void *prefetch_main(void *arg) {
+    Prefetch *pf = arg;
+    int index = 0;
+    int fd = -1;
+    uint64_t left = 0;
+    int slot = 0;
+
+    while (1) {
+        pthread_mutex_lock(&pf->mutex);
+        while (pf->filled == TREE_PREFETCH_BLOCKS && !pf->stop) pthread_cond_wait(&pf->cond, &pf->mutex);
+        int stop = pf->stop;
+        pthread_mutex_unlock(&pf->mutex);
+        if (stop) break;
+
+        size_t len = fill_block(pf, pf->blocks[slot], &index, &fd, &left);
+
+        pthread_mutex_lock(&pf->mutex);
+        if (len > 0) {
+            pf->lens[slot] = len;
+            pf->filled++;
+        }
+        pf->finished = len < TREE_BLOCK_SIZE;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+        if (len < TREE_BLOCK_SIZE) break;
+        slot = (slot + 1) % TREE_PREFETCH_BLOCKS;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+static int send_blocks(int sock, Prefetch *pf, TransferProgress *progress) {
+    while (1) {
+        if (progress && atomic_load(&progress->cancelled)) return -1;
+
+        pthread_mutex_lock(&pf->mutex);
+        while (pf->filled == 0 && !pf->finished) pthread_cond_wait(&pf->cond, &pf->mutex);
+        if (pf->filled == 0) {
+            pthread_mutex_unlock(&pf->mutex);
+            return 0;
+        }
+        int slot = pf->head;
+        size_t len = pf->lens[slot];
+        pthread_mutex_unlock(&pf->mutex);
+
+        if (send_prefixed(sock, pf->blocks[slot], len) < 0) return -1;
+        if (progress) atomic_fetch_add(&progress->sent, len);
+
+        pthread_mutex_lock(&pf->mutex);
+        pf->head = (slot + 1) % TREE_PREFETCH_BLOCKS;
+        pf->filled--;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->mutex);
+    }
+}
+
+/*
+ * Send the manifest and the packed contents of every file. Returns -1 if
+ * the socket broke or the send was cancelled, 0 otherwise.
+ */
+int tree_send(int sock, const TreeManifest *tree, TransferProgress *progress) {
+    if (send_prefixed(sock, tree->manifest, tree->manifest_len) < 0) return -1;
+
+    Prefetch pf;
+    memset(&pf, 0, sizeof(pf));
+    pf.tree = tree;
+    char *memory = malloc((size_t)TREE_PREFETCH_BLOCKS * TREE_BLOCK_SIZE);
+    if (!memory) return -1;
+    for (int i = 0; i < TREE_PREFETCH_BLOCKS; i++) pf.blocks[i] = memory + (size_t)i * TREE_BLOCK_SIZE;
+    pthread_mutex_init(&pf.mutex, NULL);
+    pthread_cond_init(&pf.cond, NULL);
+
+    int status = -1;
+    pthread_t reader;
+    if (pthread_create(&reader, NULL, prefetch_main, &pf) == 0) {
+        status = send_blocks(sock, &pf, progress);
+
+        pthread_mutex_lock(&pf.mutex);
+        pf.stop = 1;
+        pthread_cond_broadcast(&pf.cond);
+        pthread_mutex_unlock(&pf.mutex);
+        pthread_join(reader, NULL);
+    }
+    if (status == 0) status = send_prefixed(sock, NULL, 0);
+    if (status == 0 && pf.unreadable > 0) {
+        log_message("%d files changed or vanished while being sent; zeros were sent in their place", pf.unreadable);
+    }
+
+    pthread_cond_destroy(&pf.cond);
+    pthread_mutex_destroy(&pf.mutex);
+    free(memory);
+    return status;
+}
+
+// A single path component that cannot climb out of or alias its directory
+static int valid_component(const char *name, size_t len) {
+    if (len == 0 || len > 255) return 0;
+    if (len == 1 && name[0] == '.') return 0;
+    if (len == 2 && name[0] == '.' && name[1] == '.') return 0;
+    return memchr(name, '/', len) == NULL && memchr(name, '\0', len) == NULL;
+}
+
+// Whether name can be the directory a tree is received into
+int tree_valid_name(const char *name) {
+    return valid_component(name, strlen(name));
+}
+
+// A relative path made only of valid components
+static int valid_path(const char *path, size_t len) {
+    if (len == 0 || len >= TREE_PATH_MAX) return 0;
+    size_t start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || path[i] == '/') {
+            if (!valid_component(path + start, i - start)) return 0;
+            start = i + 1;
+        }
+    }
+    return 1;
+}
+
+// Check and store every entry; -1 if the manifest is malformed or unsafe
+static int decode_manifest(TreeManifest *tree, const unsigned char *buf, size_t len, uint64_t total) {
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + len;
+    uint64_t count;
+    if (wire_get_varint(&p, end, &count) < 0 || count > TREE_ENTRIES_MAX) return -1;
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t kind, mode, size, path_len;
+        if (wire_get_varint(&p, end, &kind) < 0 || wire_get_varint(&p, end, &mode) < 0 ||
+            wire_get_varint(&p, end, &size) < 0 || wire_get_varint(&p, end, &path_len) < 0 ||
+            (kind != TREE_DIR && kind != TREE_FILE) || path_len > (uint64_t)(end - p) ||
+            !valid_path((const char *)p, path_len) || size > total - tree->total ||
+            add_entry(tree, (int)kind, (uint32_t)(mode & 0777), size, (const char *)p, path_len) < 0) {
+            return -1;
+        }
+        p += path_len;
+    }
+    return tree->total == total ? 0 : -1;
+}
+
+static int recv_prefix(int sock, uint32_t *len) {
+    if (recv_exact(sock, len, sizeof(*len)) < 0) return -1;
+    *len = ntohl(*len);
+    return 0;
+}
+
+/*
+ * Creates entries below the root directory. Every component is opened
+ * relative to its parent with O_NOFOLLOW, so a symbolic link already in
+ * the destination cannot redirect a write outside it. The parent of the
+ * last file is kept open, since files arrive grouped by directory.
+ */
+typedef struct {
+    const TreeManifest *tree;
+    int root_fd;
+    int dir_fd;
+    char dir[TREE_PATH_MAX];    // Path of dir_fd below the root
+    int index;                  // Entry being written
+    int fd;
+    uint64_t left;              // Its bytes still to come
+    int failed;                 // Files or directories that could not be written
+} TreeWriter;
+
+// Open the directory at path[0..len) below the root, creating what is missing
+static int open_dir(int root_fd, const char *path, size_t len) {
+    int fd = openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char component[256];
+    size_t start = 0;
+    for (size_t i = 0; fd >= 0 && i <= len && len > 0; i++) {
+        if (i < len && path[i] != '/') continue;
+        memcpy(component, path + start, i - start);
+        component[i - start] = '\0';
+        start = i + 1;
+
+        if (mkdirat(fd, component, 0755) < 0 && errno != EEXIST) {
+            close(fd);
+            return -1;
+        }
+        int next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        close(fd);
+        fd = next;
+    }
+    return fd;
+}
+
+static int writer_parent(TreeWriter *w, const char *path, const char **base) {
+    const char *slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    *base = slash ? slash + 1 : path;
+
+    if (w->dir_fd >= 0 && strlen(w->dir) == len && memcmp(w->dir, path, len) == 0) return w->dir_fd;
+    if (w->dir_fd >= 0) close(w->dir_fd);
+    w->dir_fd = open_dir(w->root_fd, path, len);
+    memcpy(w->dir, path, len);
+    w->dir[len] = '\0';
+    return w->dir_fd;
+}
+
+// Move on to the next file in the manifest, creating directories passed on the way
+static int writer_next_file(TreeWriter *w) {
+    const TreeManifest *tree = w->tree;
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+
+    while (w->index < tree->count) {
+        const TreeEntry *e = &tree->entries[w->index++];
+        const char *path = entry_path(tree, e);
+        if (e->kind == TREE_DIR) {
+            int fd = w->root_fd >= 0 ? open_dir(w->root_fd, path, strlen(path)) : -1;
+            if (fd < 0) w->failed++;
+            else close(fd);
+            continue;
+        }
+
+        const char *base;
+        int dir_fd = w->root_fd >= 0 ? writer_parent(w, path, &base) : -1;
+        w->fd = dir_fd >= 0 ? openat(dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                                     e->mode ? e->mode : 0644) : -1;
+        if (w->fd < 0) w->failed++;
+        w->left = e->size;
+        if (w->left > 0) return 1;
+        if (w->fd >= 0) close(w->fd);
+        w->fd = -1;
+    }
+    return 0;
+}
+
+// Spread one chunk over the files it packs
+static void writer_store(TreeWriter *w, const char *data, size_t len) {
+    while (len > 0) {
+        if (w->left == 0 && !writer_next_file(w)) return;
+        size_t n = len < w->left ? len : (size_t)w->left;
+        if (w->fd >= 0 && write(w->fd, data, n) != (ssize_t)n) {
+            close(w->fd);
+            w->fd = -1;
+            w->failed++;
+        }
+        data += n;
+        len -= n;
+        w->left -= n;
+    }
+}
+
+// Undo a transfer that did not complete, children before their parents
+static void remove_entries(int root_fd, const TreeManifest *tree) {
+    for (int i = tree->count - 1; i >= 0; i--) {
+        const TreeEntry *e = &tree->entries[i];
+        unlinkat(root_fd, entry_path(tree, e), e->kind == TREE_DIR ? AT_REMOVEDIR : 0);
+    }
+}
+
+/*
+ * Receive a directory into dir, which the caller has created empty. The
+ * whole manifest is checked before anything is created: every path must
+ * be relative and free of "." and ".." components, and the sizes must add
+ * up to the offered total. Unless the status is TRANSFER_OK, whatever was
+ * written below dir is removed again. The number of files and of entries
+ * that could not be written are stored in *files_out and *failed_out.
+ * Returns a TRANSFER_* status.
+ */
+int tree_receive(int sock, const char *dir, uint64_t total, int *files_out, int *failed_out) {
+    *files_out = 0;
+    *failed_out = 0;
+
+    uint32_t manifest_len;
+    if (recv_prefix(sock, &manifest_len) < 0 || manifest_len == 0 || manifest_len > TREE_MANIFEST_MAX) {
+        return TRANSFER_STREAM_ERROR;
+    }
+    unsigned char *manifest = malloc(manifest_len);
+    char *buffer = malloc(TREE_BLOCK_SIZE);
+    TreeManifest *tree = new_manifest();
+    int status = TRANSFER_STREAM_ERROR;
+    if (!manifest || !buffer || !tree || recv_exact(sock, manifest, manifest_len) < 0) goto done;
+    if (decode_manifest(tree, manifest, manifest_len, total) < 0) {
+        log_message("Refused directory %s: its manifest is malformed or leaves the directory", dir);
+        goto done;
+    }
+    *files_out = tree->files;
+
+    TreeWriter w;
+    memset(&w, 0, sizeof(w));
+    w.tree = tree;
+    w.dir_fd = -1;
+    w.fd = -1;
+    w.root_fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+    uint64_t received = 0;
+    while (1) {
+        uint32_t len;
+        if (recv_prefix(sock, &len) < 0) break;
+        if (len == 0) {
+            if (received == total) status = TRANSFER_OK;
+            break;
+        }
+        if (len > TREE_BLOCK_SIZE || len > total - received || recv_exact(sock, buffer, len) < 0) break;
+        writer_store(&w, buffer, len);
+        received += len;
+    }
+    // Empty files and directories after the last byte
+    if (status == TRANSFER_OK) {
+        while (writer_next_file(&w)) {}
+    }
+
+    if (w.fd >= 0) close(w.fd);
+    if (w.dir_fd >= 0) close(w.dir_fd);
+    if (w.root_fd < 0) w.failed = tree->count;
+    *failed_out = w.failed;
+    if (status == TRANSFER_OK && w.failed > 0) status = TRANSFER_WRITE_ERROR;
+    if (w.root_fd >= 0) {
+        if (status != TRANSFER_OK) remove_entries(w.root_fd, tree);
+        close(w.root_fd);
+    }
+
+done:
+    free(manifest);
+    free(buffer);
+    tree_free(tree);
+    return status;
+}
@@ -1,14 +1,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdarg.h>
 #include <ncurses.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include "../include/ui.h"
+#include "../include/peers.h"
+#include "../include/offers.h"
+#include "../include/outgoing.h"
+#include "../include/history.h"
+#include "../include/search.h"
+#include "../include/groups.h"
+#include "../include/fanout.h"
 
-AppState app_state;
+UiState ui_state;
+
+// Regions changed since the last frame; any thread may add to them
+static atomic_int dirty = UI_DIRTY_HEADER | UI_DIRTY_CHAT | UI_DIRTY_INPUT;
+static int wake_fd = -1;
+
+static void ui_notify(int events);
 
 void init_ui() {
     initscr();
@@ -29,72 +45,83 @@ void init_ui() {
     int max_y, max_x;
     getmaxyx(stdscr, max_y, max_x);
 
-    app_state.win_header = newwin(3, max_x, 0, 0);
-    app_state.win_chat = newwin(max_y - 6, max_x, 3, 0);
-    app_state.win_input = newwin(3, max_x, max_y - 3, 0);
-
-    wbkgd(app_state.win_header, COLOR_PAIR(1));
-    wbkgd(app_state.win_chat, COLOR_PAIR(1));
-    wbkgd(app_state.win_input, COLOR_PAIR(1));
+    ui_state.win_header = newwin(3, max_x, 0, 0);
+    ui_state.win_chat = newwin(max_y - 6, max_x, 3, 0);
+    ui_state.win_input = newwin(3, max_x, max_y - 3, 0);
 
-    scrollok(app_state.win_chat, TRUE);
+    wbkgd(ui_state.win_header, COLOR_PAIR(1));
+    wbkgd(ui_state.win_chat, COLOR_PAIR(1));
+    wbkgd(ui_state.win_input, COLOR_PAIR(1));
 
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&app_state.peer_mutex, NULL);
-    pthread_mutex_init(&app_state.chat_mutex, &attr);
-    pthread_mutexattr_destroy(&attr);
+    ui_state.selected_peer_id = 0;
 
-    app_state.peer_count = 0;
-    app_state.selected_peer_index = -1;
-    app_state.running = 1;
-
-    pthread_mutex_init(&app_state.file_transfer_mutex, NULL);
-    app_state.pending_file_transfer = 0;
-    app_state.pending_sock = -1;
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    app_set_notify(ui_notify);
 
     refresh();
 }
 
 void cleanup_ui() {
-    delwin(app_state.win_header);
-    delwin(app_state.win_chat);
-    delwin(app_state.win_input);
+    app_set_notify(NULL);
+    cleanup_search();
+    delwin(ui_state.win_header);
+    delwin(ui_state.win_chat);
+    delwin(ui_state.win_input);
     endwin();
-    pthread_mutex_destroy(&app_state.peer_mutex);
-    pthread_mutex_destroy(&app_state.chat_mutex);
-    pthread_mutex_destroy(&app_state.file_transfer_mutex);
+    if (wake_fd >= 0) close(wake_fd);
+    wake_fd = -1;
+}
+
+/*
+ * Mark regions for redrawing and wake the input loop. The wakeup is only
+ * written when a region was clean, since a set flag already has one in
+ * flight; the loop drains the eventfd before taking the flags.
+ */
+void ui_invalidate(int regions) {
+    int before = atomic_fetch_or(&dirty, regions);
+    if ((before & regions) == regions || wake_fd < 0) return;
+
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        // Counter full: a wakeup is already pending
+    }
 }
 
-void draw_interface() {
-    pthread_mutex_lock(&app_state.peer_mutex);
+// Core changes map onto the regions that show them
+static void ui_notify(int events) {
+    int regions = 0;
+    if (events & APP_EVENT_LOG) regions |= UI_DIRTY_CHAT;
+    if (events & APP_EVENT_PEERS) regions |= UI_DIRTY_HEADER;
+    ui_invalidate(regions);
+}
 
-    werase(app_state.win_header);
-    box(app_state.win_header, 0, 0);
+static void draw_header() {
+    werase(ui_state.win_header);
+    box(ui_state.win_header, 0, 0);
 
     int max_y, max_x;
-    getmaxyx(app_state.win_header, max_y, max_x);
+    getmaxyx(ui_state.win_header, max_y, max_x);
     (void)max_y;  // Unused, but needed for getmaxyx
 
     // Display local user info with IP address
-    mvwprintw(app_state.win_header, 1, 2, "Lume - %s [%s:%d]",
+    mvwprintw(ui_state.win_header, 1, 2, "Lume - %s [%s:%d]",
             app_state.local_username,
             app_state.local_ip,
             app_state.local_tcp_port);
 
-    if (app_state.peer_count > 0) {
-        if (app_state.selected_peer_index == -1) app_state.selected_peer_index = 0;
-        if (app_state.selected_peer_index >= app_state.peer_count) app_state.selected_peer_index = 0;
+    Peer selected;
+    int position = 0;
+    int peer_count = peers_resolve(ui_state.selected_peer_id, &selected, &position);
+    if (peer_count > 0) {
+        ui_state.selected_peer_id = selected.id;
 
-        Peer selected = app_state.peers[app_state.selected_peer_index];
         char ip_str[INET_ADDRSTRLEN];
         if (inet_ntop(AF_INET, &selected.ip_addr, ip_str, sizeof(ip_str)) == NULL) {
             strncpy(ip_str, "?", sizeof(ip_str));
             ip_str[sizeof(ip_str) - 1] = '\0';
         }
 
-        wattron(app_state.win_header, COLOR_PAIR(3));
+        wattron(ui_state.win_header, COLOR_PAIR(3));
 
         // Calculate length of local user info to prevent overlap
         int local_info_len = snprintf(NULL, 0, "Lume - %s [%s:%d]",
@@ -110,184 +137,445 @@ void draw_interface() {
             peer_col = max_x / 2;
         }
 
-        mvwprintw(app_state.win_header, 1, peer_col, "To: %s [%s:%d] (%d/%d)",
+        mvwprintw(ui_state.win_header, 1, peer_col, "To: %s [%s:%d] (%d/%d)",
                 selected.username,
                 ip_str,
                 selected.tcp_port,
-                app_state.selected_peer_index + 1,
-                app_state.peer_count);
-        wattroff(app_state.win_header, COLOR_PAIR(3));
+                position + 1,
+                peer_count);
+        wattroff(ui_state.win_header, COLOR_PAIR(3));
     } else {
-        wattron(app_state.win_header, COLOR_PAIR(2));
+        wattron(ui_state.win_header, COLOR_PAIR(2));
         // Right-align "Scanning for peers..." to prevent overlap
         const char *scan_msg = "Scanning for peers...";
         int scan_col = max_x - strlen(scan_msg) - 3;
         if (scan_col < 2) {
             scan_col = 2;
         }
-        mvwprintw(app_state.win_header, 1, scan_col, "%s", scan_msg);
-        wattroff(app_state.win_header, COLOR_PAIR(2));
+        mvwprintw(ui_state.win_header, 1, scan_col, "%s", scan_msg);
+        wattroff(ui_state.win_header, COLOR_PAIR(2));
     }
-    wnoutrefresh(app_state.win_header);
-    pthread_mutex_unlock(&app_state.peer_mutex);
+    wnoutrefresh(ui_state.win_header);
+}
+
+static void draw_input(const char *input_buf) {
+    werase(ui_state.win_input);
+    box(ui_state.win_input, 0, 0);
+    mvwprintw(ui_state.win_input, 1, 2, "> ");
+    mvwprintw(ui_state.win_input, 1, 4, "%s", input_buf);
+}
 
-    box(app_state.win_input, 0, 0);
-    mvwprintw(app_state.win_input, 1, 2, "> ");
-    wnoutrefresh(app_state.win_input);
+// Chat view: one past the line on the bottom row, unless following the newest
+static uint64_t view_end;
+static int view_following = 1;
 
-    wnoutrefresh(app_state.win_chat);
+static void push_text(int style, const char *text) {
+    HistoryLine line;
+    history_line_init(&line);
+    history_line_add(&line, style, text);
+    history_push(&line);
 }
 
-void log_message(const char *fmt, ...) {
-    pthread_mutex_lock(&app_state.chat_mutex);
+// A "key - description" line of the help or offer listings
+static void push_entry(int key_style, const char *key, const char *description) {
+    char padded[32];
+    snprintf(padded, sizeof(padded), "  %-16s", key);
 
-    time_t rawtime;
-    const struct tm *timeinfo;
-    char timestamp[12];
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
-    strftime(timestamp, sizeof(timestamp), "[%H:%M:%S] ", timeinfo);
+    HistoryLine line;
+    history_line_init(&line);
+    history_line_add(&line, key_style, padded);
+    history_line_add(&line, 1, description);
+    history_push(&line);
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(5) | A_DIM);
-    wprintw(app_state.win_chat, "%s", timestamp);
-    wattroff(app_state.win_chat, COLOR_PAIR(5) | A_DIM);
+static void add_log_line(const LogRecord *record) {
+    struct tm timeinfo;
+    char timestamp[12];
+    localtime_r(&record->when, &timeinfo);
+    strftime(timestamp, sizeof(timestamp), "[%H:%M:%S] ", &timeinfo);
 
     int color = 2;
-    if (strstr(fmt, "Me ->") == fmt) {
-        color = 3;
-    } else if (strstr(fmt, ": ") != NULL && strstr(fmt, "Me ->") == NULL) {
-        color = 4;
-    }
+    if (record->kind == LOG_CHAT_OUT) color = 3;
+    else if (record->kind == LOG_CHAT_IN) color = 4;
+
+    HistoryLine line;
+    history_line_init(&line);
+    history_line_add(&line, 5 | HISTORY_DIM, timestamp);
+    history_line_add(&line, color, record->text);
+    history_push(&line);
+    search_add(history_end() - 1, record->text);
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(color));
+static void add_help() {
+    push_text(1, "");
+    push_text(2 | HISTORY_BOLD, "Available commands:");
+    push_entry(3, "/file <path>", "- Send a file or directory to the selected peer");
+    push_entry(3, "/all <msg>", "- Send a message to every online peer");
+    push_entry(3, "/to <grp> <msg>", "- Send a message to the members of a group");
+    push_entry(3, "/group [name..]", "- List groups, or set a group's users; none removes it");
+    push_entry(3, "/transfers", "- List queued and running outgoing transfers");
+    push_entry(3, "/cancel <id>", "- Cancel an outgoing transfer");
+    push_entry(3, "/search <words>", "- Find earlier messages");
+    push_entry(3, "/accept [id]", "- Accept an incoming file transfer");
+    push_entry(3, "/reject [id]", "- Reject an incoming file transfer");
+    push_entry(3, "/help", "- Show this help message");
+    push_text(1, "");
+    push_text(2 | HISTORY_BOLD, "Controls:");
+    push_entry(4, "UP/DOWN", "- Select peer");
+    push_entry(4, "PGUP/PGDN", "- Scroll chat history");
+    push_entry(4, "ESC", "- Quit");
+    push_text(1, "");
+}
 
-    va_list args;
-    va_start(args, fmt);
-    vw_printw(app_state.win_chat, fmt, args);
-    wprintw(app_state.win_chat, "\n");
-    va_end(args);
+static void add_file_prompt(const LogRecord *record) {
+    char text[320];
+    uint32_t offer_id = record->offer.id;
+
+    push_text(1, "");
+    snprintf(text, sizeof(text), "Incoming file transfer #%u:", offer_id);
+    push_text(2 | HISTORY_BOLD, text);
+    snprintf(text, sizeof(text), "  From: %s", record->offer.sender);
+    push_text(4, text);
+    snprintf(text, sizeof(text), "  File: %s", record->offer.filename);
+    push_text(4, text);
+    snprintf(text, sizeof(text), "  Size: %zu bytes", record->offer.file_size);
+    push_text(4, text);
+    push_text(1, "");
+    snprintf(text, sizeof(text), "/accept %u", offer_id);
+    push_entry(3, text, "- Accept the file");
+    snprintf(text, sizeof(text), "/reject %u", offer_id);
+    push_entry(3, text, "- Reject the file");
+    push_text(1, "");
+    push_text(2 | HISTORY_DIM, "(Will auto-reject in 30 seconds)");
+    push_text(1, "");
+}
 
-    wattroff(app_state.win_chat, COLOR_PAIR(color));
+// Store one drained log record in the chat history
+static void add_record(const LogRecord *record, void *arg) {
+    (void)arg;
+    if (record->kind == LOG_HELP) add_help();
+    else if (record->kind == LOG_FILE_OFFER) add_file_prompt(record);
+    else add_log_line(record);
+}
 
-    wnoutrefresh(app_state.win_chat);
-    doupdate();
-    pthread_mutex_unlock(&app_state.chat_mutex);
+static attr_t history_attrs(int style) {
+    attr_t attrs = COLOR_PAIR(style & HISTORY_PAIR_MASK);
+    if (style & HISTORY_BOLD) attrs |= A_BOLD;
+    if (style & HISTORY_DIM) attrs |= A_DIM;
+    return attrs;
 }
 
-void show_help() {
-    pthread_mutex_lock(&app_state.chat_mutex);
+// Screen rows a history line wraps to
+static int line_rows(uint64_t seq, int cols) {
+    size_t len;
+    int width;
+    if (!history_get(seq, &len, &width) || width == 0) return 1;
+    return (width + cols - 1) / cols;
+}
 
-    // Add spacing before help message
-    wprintw(app_state.win_chat, "\n");
+// Draw a line wrapped to the window with its first row at top; rows above 0 are cut off
+static void draw_history_line(uint64_t seq, int top, int cols) {
+    size_t len;
+    int width;
+    const unsigned char *cursor = history_get(seq, &len, &width);
+    if (!cursor) return;
+
+    const unsigned char *end = cursor + len;
+    int row = top, col = 0;
+    HistoryRun run;
+    while (history_next_run(&cursor, end, &run)) {
+        wattrset(ui_state.win_chat, history_attrs(run.style));
+        size_t done = 0;
+        while (done < run.len) {
+            int chunk = (int)(run.len - done);
+            if (chunk > cols - col) chunk = cols - col;
+            if (row >= 0) mvwaddnstr(ui_state.win_chat, row, col, run.text + done, chunk);
+            done += (size_t)chunk;
+            col += chunk;
+            if (col == cols) {
+                row++;
+                col = 0;
+            }
+        }
+    }
+    wattrset(ui_state.win_chat, A_NORMAL);
+}
 
-    // Print help header with color
-    wattron(app_state.win_chat, COLOR_PAIR(2) | A_BOLD);
-    wprintw(app_state.win_chat, "Available commands:\n");
-    wattroff(app_state.win_chat, COLOR_PAIR(2) | A_BOLD);
+/*
+ * Paint the slice of history that fits the chat window. Only the lines
+ * on screen are visited, so the cost depends on the window and not on
+ * how much history is kept.
+ */
+static void draw_chat() {
+    int rows, cols;
+    getmaxyx(ui_state.win_chat, rows, cols);
+    werase(ui_state.win_chat);
+
+    uint64_t first = history_first();
+    uint64_t end = history_end();
+    if (view_following || view_end >= end) {
+        view_following = 1;
+        view_end = end;
+    } else if (view_end <= first) {
+        view_end = first + 1;   // The lines we were looking at were evicted
+    }
 
-    // Print commands with color
-    wattron(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "  /file <path>");
-    wattroff(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "\t \t- Send a file to the selected peer\n");
+    int bottom = rows;
+    if (!view_following) {
+        bottom--;
+        wattron(ui_state.win_chat, COLOR_PAIR(2) | A_DIM);
+        mvwprintw(ui_state.win_chat, bottom, 0, "-- %llu newer lines below, PgDn to scroll --",
+                  (unsigned long long)(end - view_end));
+        wattroff(ui_state.win_chat, COLOR_PAIR(2) | A_DIM);
+    }
 
-    wattron(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "  /accept");
-    wattroff(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "\t \t- Accept an incoming file transfer\n");
+    // Find the line on the top row, then draw down from it
+    uint64_t seq = view_end;
+    int top = bottom;
+    while (top > 0 && seq > first) {
+        seq--;
+        top -= line_rows(seq, cols);
+    }
+    if (top > 0) top = 0;       // Less than a screenful fills from the top
+    for (; seq < view_end; seq++) {
+        draw_history_line(seq, top, cols);
+        top += line_rows(seq, cols);
+    }
+    wnoutrefresh(ui_state.win_chat);
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "  /reject");
-    wattroff(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "\t \t- Reject an incoming file transfer\n");
+// Rows moved by one PgUp/PgDn; the scrolled view gives a row to the status line
+static int chat_page(int *cols) {
+    int rows;
+    getmaxyx(ui_state.win_chat, rows, *cols);
+    return rows > 2 ? rows - 1 : 1;
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "  /help");
-    wattroff(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "\t \t \t- Show this help message\n");
+// Smallest bottom for a full page, so scrolling back stops with the oldest line on top
+static uint64_t oldest_view_end(int page, int cols) {
+    uint64_t first = history_first();
+    uint64_t end = history_end();
+    uint64_t bottom = first;
+    int filled = 0;
+    while (bottom < end && filled < page) {
+        filled += line_rows(bottom, cols);
+        bottom++;
+    }
+    return bottom;
+}
 
-    wprintw(app_state.win_chat, "\n");
+// Scroll back a page, keeping the old top line on screen
+static void scroll_chat_up() {
+    int cols;
+    int page = chat_page(&cols);
+    uint64_t first = history_first();
+    uint64_t end = view_following ? history_end() : view_end;
+
+    uint64_t top = end;
+    int filled = 0;
+    while (top > first && filled < page) {
+        top--;
+        filled += line_rows(top, cols);
+    }
 
-    // Print controls header with color
-    wattron(app_state.win_chat, COLOR_PAIR(2) | A_BOLD);
-    wprintw(app_state.win_chat, "Controls:\n");
-    wattroff(app_state.win_chat, COLOR_PAIR(2) | A_BOLD);
+    uint64_t new_end = top + 1 < end ? top + 1 : top;
+    uint64_t oldest = oldest_view_end(page, cols);
+    if (new_end < oldest) new_end = oldest;
+    if (new_end >= end) return;     // Oldest line already on top
+    view_end = new_end;
+    view_following = 0;
+}
+
+// Scroll forward a page, keeping the old bottom line on screen
+static void scroll_chat_down() {
+    if (view_following) return;
 
-    // Print controls with color
-    wattron(app_state.win_chat, COLOR_PAIR(4));
-    wprintw(app_state.win_chat, "  UP/DOWN");
-    wattroff(app_state.win_chat, COLOR_PAIR(4));
-    wprintw(app_state.win_chat, "\t \t- Select peer\n");
+    int cols;
+    int page = chat_page(&cols);
+    uint64_t end = history_end();
+
+    uint64_t bottom = view_end;
+    int filled = 0;
+    while (bottom < end && filled < page) {
+        filled += line_rows(bottom, cols);
+        bottom++;
+    }
 
-    wattron(app_state.win_chat, COLOR_PAIR(4));
-    wprintw(app_state.win_chat, "  ESC");
-    wattroff(app_state.win_chat, COLOR_PAIR(4));
-    wprintw(app_state.win_chat, "\t \t \t- Quit\n");
+    if (bottom >= end) view_following = 1;
+    else view_end = bottom - 1 > view_end ? bottom - 1 : bottom;
+}
 
-    // Add spacing after help message
-    wprintw(app_state.win_chat, "\n");
+/*
+ * Push the regions that changed to the terminal. The input window is
+ * always refreshed last so the cursor ends up on the prompt.
+ */
+static void render(const char *input_buf) {
+    int regions = atomic_exchange(&dirty, 0);
+    if (!regions) return;
+
+    if (regions & UI_DIRTY_HEADER) draw_header();
+    if (regions & UI_DIRTY_CHAT) {
+        // Everything queued since the last frame goes out in one doupdate()
+        log_drain(add_record, NULL);
+        unsigned long lost = log_take_dropped();
+        if (lost > 0) {
+            char text[64];
+            snprintf(text, sizeof(text), "(%lu log lines dropped)", lost);
+            push_text(2 | HISTORY_DIM, text);
+        }
+        draw_chat();
+    }
+    if (regions & UI_DIRTY_INPUT) draw_input(input_buf);
+    wnoutrefresh(ui_state.win_input);
+    doupdate();
+}
 
-    wrefresh(app_state.win_chat);
-    pthread_mutex_unlock(&app_state.chat_mutex);
+void show_help() {
+    LogRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = LOG_HELP;
+    log_submit(&record);
 }
 
-void show_file_prompt(const char *sender, const char *filename, size_t filesize) {
-    pthread_mutex_lock(&app_state.chat_mutex);
+/*
+ * Record a decision on a pending offer named by its id. Without an id the
+ * only pending offer is used, as long as there is exactly one.
+ */
+static void decide_file_transfer(const char *arg, int decision) {
+    uint32_t id = 0;
+    while (*arg == ' ') arg++;
+    if (*arg) {
+        char *endptr;
+        unsigned long val = strtoul(arg, &endptr, 10);
+        if (endptr == arg || *endptr != '\0' || val == 0 || val > UINT32_MAX) {
+            log_message("Invalid transfer id: %s", arg);
+            return;
+        }
+        id = (uint32_t)val;
+    }
 
-    wprintw(app_state.win_chat, "\n");
+    int result = offers_decide(&id, decision);
+    if (result == 0) {
+        log_message("File transfer #%u %s", id, decision == OFFER_ACCEPTED ? "accepted" : "rejected");
+    } else if (result == OFFER_AMBIGUOUS) {
+        log_message("Several file transfers are pending; give the id, e.g. /accept <id>");
+    } else if (*arg) {
+        log_message("No pending file transfer #%u", id);
+    } else {
+        log_message("No pending file transfer");
+    }
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(2) | A_BOLD);
-    wprintw(app_state.win_chat, "Incoming file transfer:\n");
-    wattroff(app_state.win_chat, COLOR_PAIR(2) | A_BOLD);
+void accept_file_transfer(const char *arg) {
+    decide_file_transfer(arg, OFFER_ACCEPTED);
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(4));
-    wprintw(app_state.win_chat, "  From: %s\n", sender);
-    wprintw(app_state.win_chat, "  File: %s\n", filename);
-    wprintw(app_state.win_chat, "  Size: %zu bytes\n", filesize);
-    wattroff(app_state.win_chat, COLOR_PAIR(4));
+void reject_file_transfer(const char *arg) {
+    decide_file_transfer(arg, OFFER_REJECTED);
+}
 
-    wprintw(app_state.win_chat, "\n");
+static void cancel_transfer(const char *arg) {
+    char *endptr;
+    unsigned long id = strtoul(arg, &endptr, 10);
+    if (endptr == arg || *endptr != '\0' || id == 0 || id > UINT32_MAX) {
+        log_message("Usage: /cancel <id>");
+    } else if (!outgoing_cancel((uint32_t)id)) {
+        log_message("No outgoing transfer #%lu", id);
+    }
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "  /accept");
-    wattroff(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, " - Accept the file\n");
+static void report_fanout(int result, const char *group) {
+    if (result == FANOUT_NO_PEERS) log_message("No peers online");
+    else if (result == FANOUT_NO_GROUP) log_message("No group named %s", group);
+    else if (result == FANOUT_FAILED) log_message("Could not start sending the message");
+}
 
-    wattron(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, "  /reject");
-    wattroff(app_state.win_chat, COLOR_PAIR(3));
-    wprintw(app_state.win_chat, " - Reject the file\n");
+static void send_to_all(const char *msg) {
+    while (*msg == ' ') msg++;
+    if (*msg == '\0') log_message("Usage: /all <message>");
+    else report_fanout(fanout_to_all(msg), NULL);
+}
 
-    wprintw(app_state.win_chat, "\n");
-    wattron(app_state.win_chat, COLOR_PAIR(2) | A_DIM);
-    wprintw(app_state.win_chat, "(Will auto-reject in 30 seconds)\n");
-    wattroff(app_state.win_chat, COLOR_PAIR(2) | A_DIM);
-    wprintw(app_state.win_chat, "\n");
+static void send_to_group(char *arg) {
+    while (*arg == ' ') arg++;
+    char *msg = arg + strcspn(arg, " ");
+    if (*msg) *msg++ = '\0';
+    while (*msg == ' ') msg++;
+    if (*arg == '\0' || *msg == '\0') log_message("Usage: /to <group> <message>");
+    else report_fanout(fanout_to_group(arg, msg), arg);
+}
 
-    wrefresh(app_state.win_chat);
-    pthread_mutex_unlock(&app_state.chat_mutex);
+static void list_groups() {
+    char names[GROUPS_MAX][GROUP_NAME_LEN];
+    int count = groups_names(names, GROUPS_MAX);
+    if (count == 0) {
+        log_message("No groups yet; define one with /group <name> <users...>");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        char members[GROUP_MEMBERS_LEN];
+        if (groups_find(names[i], members, sizeof(members))) log_message("%s: %s", names[i], members);
+    }
 }
 
-void accept_file_transfer() {
-    pthread_mutex_lock(&app_state.file_transfer_mutex);
-    if (app_state.pending_file_transfer) {
-        app_state.pending_file_transfer = 2; // Signal acceptance
-        log_message("File transfer accepted");
-    } else {
-        log_message("No pending file transfer");
+static void edit_group(char *arg) {
+    while (*arg == ' ') arg++;
+    if (*arg == '\0') {
+        list_groups();
+        return;
     }
-    pthread_mutex_unlock(&app_state.file_transfer_mutex);
+    char *members = arg + strcspn(arg, " ");
+    if (*members) *members++ = '\0';
+
+    int result = groups_set(arg, members);
+    if (result == GROUP_SAVED) log_message("Group %s saved", arg);
+    else if (result == GROUP_REMOVED) log_message("Group %s removed", arg);
+    else if (result == GROUP_UNKNOWN) log_message("No group named %s", arg);
+    else if (result == GROUP_FULL) log_message("Cannot define more than %d groups", GROUPS_MAX);
+    else log_message("Group names use letters, digits, '-' and '_'");
 }
 
-void reject_file_transfer() {
-    pthread_mutex_lock(&app_state.file_transfer_mutex);
-    if (app_state.pending_file_transfer) {
-        app_state.pending_file_transfer = -1; // Signal rejection
-        log_message("File transfer rejected");
+// Show the best matches for the words, each with its original colours
+static void search_chat(const char *query) {
+    while (*query == ' ') query++;
+    if (*query == '\0') {
+        log_message("Usage: /search <words>");
+        return;
+    }
+
+    uint64_t hits[SEARCH_RESULTS];
+    int total;
+    int found = search_query(query, hits, SEARCH_RESULTS, &total);
+
+    char text[320];
+    if (found == 0) {
+        snprintf(text, sizeof(text), "No messages match \"%s\"", query);
+        push_text(2, text);
+    } else if (total > found) {
+        snprintf(text, sizeof(text), "%d matches for \"%s\", best %d:", total, query, found);
+        push_text(2 | HISTORY_BOLD, text);
     } else {
-        log_message("No pending file transfer");
+        snprintf(text, sizeof(text), "%d matches for \"%s\":", total, query);
+        push_text(2 | HISTORY_BOLD, text);
+    }
+
+    for (int i = 0; i < found; i++) {
+        size_t len;
+        int width;
+        const unsigned char *cursor = history_get(hits[i], &len, &width);
+        if (!cursor) continue;
+
+        HistoryLine line;
+        history_line_init(&line);
+        history_line_add(&line, 1, "  ");
+        const unsigned char *end = cursor + len;
+        HistoryRun run;
+        while (history_next_run(&cursor, end, &run)) history_line_addn(&line, run.style, run.text, run.len);
+        history_push(&line);
     }
-    pthread_mutex_unlock(&app_state.file_transfer_mutex);
+
+    view_following = 1;
+    atomic_fetch_or(&dirty, UI_DIRTY_CHAT);
 }
 
 void handle_input() {
@@ -295,53 +583,82 @@ void handle_input() {
     int input_pos = 0;
     memset(input_buf, 0, sizeof(input_buf));
 
-    wtimeout(app_state.win_input, 100);
-    keypad(app_state.win_input, TRUE);
+    // Keys are read without blocking once poll() reports stdin readable
+    wtimeout(ui_state.win_input, 0);
+    keypad(ui_state.win_input, TRUE);
+
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
+    int nfds = wake_fd >= 0 ? 2 : 1;
 
     while (app_state.running) {
-        pthread_mutex_lock(&app_state.chat_mutex);
-        werase(app_state.win_input);
-        draw_interface();
-        mvwprintw(app_state.win_input, 1, 4, "%s", input_buf);
-        wnoutrefresh(app_state.win_input);
-        doupdate();
-        pthread_mutex_unlock(&app_state.chat_mutex);
-
-        int ch = wgetch(app_state.win_input);
-        if (ch != ERR) {
-            pthread_mutex_lock(&app_state.chat_mutex);
+        render(input_buf);
+
+        // Sleep until a key arrives or another thread invalidates a region
+        if (poll(fds, nfds, -1) < 0 && errno != EINTR) break;
+        if (nfds == 2 && (fds[1].revents & POLLIN)) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0) {
+                // Already drained
+            }
+        }
+
+        // ncurses may hold buffered keys beyond what poll() saw, so drain it
+        int ch;
+        while (app_state.running && (ch = wgetch(ui_state.win_input)) != ERR) {
             if (ch == KEY_UP) {
-                pthread_mutex_lock(&app_state.peer_mutex);
-                if (app_state.peer_count > 0) {
-                    app_state.selected_peer_index =
-                        (app_state.selected_peer_index + 1) % app_state.peer_count;
-                }
-                pthread_mutex_unlock(&app_state.peer_mutex);
+                ui_state.selected_peer_id = peers_step(ui_state.selected_peer_id, 1);
+                atomic_fetch_or(&dirty, UI_DIRTY_HEADER);
 
             } else if (ch == KEY_DOWN) {
-                pthread_mutex_lock(&app_state.peer_mutex);
-                if (app_state.peer_count > 0) {
-                    app_state.selected_peer_index =
-                        (app_state.selected_peer_index - 1 + app_state.peer_count) % app_state.peer_count;
-                }
-                pthread_mutex_unlock(&app_state.peer_mutex);
+                ui_state.selected_peer_id = peers_step(ui_state.selected_peer_id, -1);
+                atomic_fetch_or(&dirty, UI_DIRTY_HEADER);
+
+            } else if (ch == KEY_PPAGE) {
+                scroll_chat_up();
+                atomic_fetch_or(&dirty, UI_DIRTY_CHAT);
+
+            } else if (ch == KEY_NPAGE) {
+                scroll_chat_down();
+                atomic_fetch_or(&dirty, UI_DIRTY_CHAT);
 
             } else if (ch == '\n') {
                 if (input_pos > 0) {
                     if (strcmp(input_buf, "/help") == 0) {
                         show_help();
-                    } else if (strcmp(input_buf, "/accept") == 0) {
-                        accept_file_transfer();
-                    } else if (strcmp(input_buf, "/reject") == 0) {
-                        reject_file_transfer();
-                    } else if (strncmp(input_buf, "/file ", 6) == 0) {
-                        send_file(app_state.selected_peer_index, input_buf + 6);
+                    } else if (strncmp(input_buf, "/accept", 7) == 0 && (input_buf[7] == '\0' || input_buf[7] == ' ')) {
+                        accept_file_transfer(input_buf + 7);
+                    } else if (strncmp(input_buf, "/reject", 7) == 0 && (input_buf[7] == '\0' || input_buf[7] == ' ')) {
+                        reject_file_transfer(input_buf + 7);
+                    } else if (strcmp(input_buf, "/transfers") == 0) {
+                        outgoing_list();
+                    } else if (strncmp(input_buf, "/search", 7) == 0 && (input_buf[7] == '\0' || input_buf[7] == ' ')) {
+                        search_chat(input_buf + 7);
+                    } else if (strncmp(input_buf, "/cancel ", 8) == 0) {
+                        cancel_transfer(input_buf + 8);
+                    } else if (strncmp(input_buf, "/all ", 5) == 0) {
+                        send_to_all(input_buf + 5);
+                    } else if (strncmp(input_buf, "/to ", 4) == 0) {
+                        send_to_group(input_buf + 4);
+                    } else if (strncmp(input_buf, "/group", 6) == 0 && (input_buf[6] == '\0' || input_buf[6] == ' ')) {
+                        edit_group(input_buf + 6);
                     } else {
-                        send_text_message(app_state.selected_peer_index, input_buf);
+                        Peer peer;
+                        if (!peers_find(ui_state.selected_peer_id, &peer)) {
+                            log_message("No peer selected");
+                        } else if (strncmp(input_buf, "/file ", 6) == 0) {
+                            uint32_t id = outgoing_enqueue(&peer, input_buf + 6);
+                            if (id) log_message("Queued transfer #%u: %s to %s", id, input_buf + 6, peer.username);
+                        } else {
+                            send_text_message(&peer, input_buf);
+                        }
                     }
                     memset(input_buf, 0, sizeof(input_buf));
                     input_pos = 0;
-                    werase(app_state.win_input);
+                    werase(ui_state.win_input);
                 }
 
             } else if (ch == KEY_BACKSPACE || ch == 127) {
@@ -407,9 +724,7 @@ void handle_input() {
             } else if (ch == 27) {
                 app_state.running = 0;
             }
-            pthread_mutex_unlock(&app_state.chat_mutex);
+            atomic_fetch_or(&dirty, UI_DIRTY_INPUT);
         }
-
-        usleep(10000);
     }
 }
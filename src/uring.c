@@ -0,0 +1,502 @@
+#include <stdlib.h>
+#include "../include/uring.h"
+
+#ifdef LUME_IO_URING
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "../include/log.h"
+
+/*
+ * io_uring engine for file bodies, built with `make IO_URING=1`. Each
+ * thread that moves file bodies gets one ring with URING_BUFFERS
+ * registered buffers, kept until the thread exits. A body is one session
+ * (begin, one call per length-prefixed chunk, finish) so the pipeline
+ * survives chunk boundaries: sending keeps every free buffer reading ahead
+ * through the whole range while the oldest full one goes to the socket;
+ * receiving keeps file writes of earlier chunks in flight while the socket
+ * fills the next buffer. Each chunk call returns once its bytes have left
+ * or entered the socket, so the caller can put the next prefix on the wire
+ * in order. The ring is driven through the raw system calls, so there is
+ * no dependency on liburing.
+ */
+typedef enum {
+    SLOT_FREE,
+    SLOT_FILLING,               // File read (send) or socket read (receive) under way
+    SLOT_FULL,                  // Waiting for its turn on the socket
+    SLOT_DRAINING               // Socket write (send) or file write (receive) under way
+} SlotState;
+
+typedef struct {
+    SlotState state;
+    off_t file_offset;          // Where the slot's bytes sit in the file
+    size_t len;                 // Bytes the slot carries
+    size_t done;                // Of those, filled so far
+    size_t drained;             // Of those, sent or written so far
+} Slot;
+
+struct UringEngine {
+    int fd;
+    unsigned sq_mask;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned cq_mask;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned unsubmitted;       // Queued since the last io_uring_enter()
+    unsigned inflight;          // Submitted and not yet completed
+    int broken;                 // Operations were left in flight; never reuse
+    char *buffers;              // URING_BUFFERS * URING_BUFFER_SIZE, registered
+
+    // Body being moved; set up by uring_send_begin() or uring_receive_begin()
+    Slot slots[URING_BUFFERS];
+    int sock;
+    int file;
+    off_t read_pos;             // Send: next file byte to read ahead
+    off_t end;                  // Send: end of the range
+    off_t write_pos;            // Receive: where the next socket byte lands
+    int next_fill;              // Slot the next read goes into
+    int next_drain;             // Send: slot next on the socket
+    int socket_busy;            // A socket operation is in flight
+    size_t moved;               // Bytes through the socket this session
+    int failed;                 // A chunk failed; finishing only waits
+    int *write_failed;          // Receive: set when a file write fails
+};
+
+// user_data carries the slot and which half of its round trip completed
+#define OP_FILL 0
+#define OP_DRAIN 1
+#define USER_DATA(slot, op) ((uint64_t)(slot) << 1 | (op))
+
+static atomic_int unavailable_logged = 0;
+static pthread_key_t engine_key;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+// Marks a thread on which io_uring could not be set up
+static char unavailable;
+
+static void unmap_rings(UringEngine *e) {
+    if (e->sqes) munmap(e->sqes, e->sqes_size);
+    if (e->cq_ring && e->cq_ring != e->sq_ring) munmap(e->cq_ring, e->cq_ring_size);
+    if (e->sq_ring) munmap(e->sq_ring, e->sq_ring_size);
+}
+
+static int map_rings(UringEngine *e, struct io_uring_params *p) {
+    e->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    e->cq_ring_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    int single = p->features & IORING_FEAT_SINGLE_MMAP;
+    if (single && e->cq_ring_size > e->sq_ring_size) e->sq_ring_size = e->cq_ring_size;
+
+    e->sq_ring = mmap(NULL, e->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      e->fd, IORING_OFF_SQ_RING);
+    if (e->sq_ring == MAP_FAILED) {
+        e->sq_ring = NULL;
+        return -1;
+    }
+    e->cq_ring = e->sq_ring;
+    if (!single) {
+        e->cq_ring = mmap(NULL, e->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          e->fd, IORING_OFF_CQ_RING);
+        if (e->cq_ring == MAP_FAILED) {
+            e->cq_ring = NULL;
+            return -1;
+        }
+    }
+    e->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    e->sqes = mmap(NULL, e->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   e->fd, IORING_OFF_SQES);
+    if (e->sqes == MAP_FAILED) {
+        e->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = e->sq_ring;
+    char *cq = e->cq_ring;
+    e->sq_head = (_Atomic unsigned *)(sq + p->sq_off.head);
+    e->sq_tail = (_Atomic unsigned *)(sq + p->sq_off.tail);
+    e->sq_mask = *(unsigned *)(sq + p->sq_off.ring_mask);
+    e->sq_array = (unsigned *)(sq + p->sq_off.array);
+    e->cq_head = (_Atomic unsigned *)(cq + p->cq_off.head);
+    e->cq_tail = (_Atomic unsigned *)(cq + p->cq_off.tail);
+    e->cq_mask = *(unsigned *)(cq + p->cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+static void uring_close(UringEngine *e);
+
+static UringEngine *uring_open() {
+    UringEngine *e = calloc(1, sizeof(UringEngine));
+    if (!e) return NULL;
+    e->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    e->fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+    if (e->fd < 0) goto fail;
+    if (map_rings(e, &params) < 0) goto fail;
+
+    e->buffers = mmap(NULL, (size_t)URING_BUFFERS * URING_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e->buffers == MAP_FAILED) {
+        e->buffers = NULL;
+        goto fail;
+    }
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = e->buffers + (size_t)i * URING_BUFFER_SIZE;
+        iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    if (syscall(__NR_io_uring_register, e->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) < 0) goto fail;
+    return e;
+
+fail:
+    if (!atomic_exchange(&unavailable_logged, 1)) {
+        log_message("io_uring unavailable (%s); using sendfile and splice", strerror(errno));
+    }
+    uring_close(e);
+    return NULL;
+}
+
+static void uring_close(UringEngine *e) {
+    if (e->buffers) munmap(e->buffers, (size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    unmap_rings(e);
+    if (e->fd >= 0) close(e->fd);
+    free(e);
+}
+
+static void release_engine(void *value) {
+    if (value != &unavailable) uring_close(value);
+}
+
+static void create_engine_key() {
+    pthread_key_create(&engine_key, release_engine);
+}
+
+/*
+ * The calling thread's engine, set up on first use. Returns NULL when
+ * io_uring is missing, disabled or short of locked memory, in which case
+ * the caller keeps to sendfile() and splice(); the first such failure is
+ * logged and the thread does not try again.
+ */
+UringEngine *uring_engine() {
+    pthread_once(&engine_once, create_engine_key);
+    UringEngine *e = pthread_getspecific(engine_key);
+    if (e == (UringEngine *)&unavailable) return NULL;
+    if (e && !e->broken) return e;
+    if (e) uring_close(e);
+
+    e = uring_open();
+    pthread_setspecific(engine_key, e ? (void *)e : &unavailable);
+    return e;
+}
+
+// Queue one fixed-buffer read or write; the ring is sized so this never runs out
+static void queue_op(UringEngine *e, int opcode, int fd, int slot, size_t skip, size_t len,
+                     off_t offset, int op) {
+    unsigned tail = atomic_load_explicit(e->sq_tail, memory_order_relaxed);
+    unsigned index = tail & e->sq_mask;
+    struct io_uring_sqe *sqe = &e->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(e->buffers + (size_t)slot * URING_BUFFER_SIZE + skip);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = slot;
+    sqe->user_data = USER_DATA(slot, op);
+    e->sq_array[index] = index;
+    atomic_store_explicit(e->sq_tail, tail + 1, memory_order_release);
+    e->unsubmitted++;
+    e->inflight++;
+}
+
+// Socket offsets are ignored by the kernel, so stream I/O passes -1
+static void queue_socket_op(UringEngine *e, int opcode, int sock, int slot, size_t skip, size_t len, int op) {
+    queue_op(e, opcode, sock, slot, skip, len, (off_t)-1, op);
+}
+
+// Submit what is queued and wait for at least one completion
+static int submit_and_wait(UringEngine *e) {
+    while (1) {
+        long n = syscall(__NR_io_uring_enter, e->fd, e->unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) {
+            e->unsubmitted -= n;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+    }
+}
+
+static int next_completion(UringEngine *e, struct io_uring_cqe *out) {
+    unsigned head = atomic_load_explicit(e->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(e->cq_tail, memory_order_acquire)) return 0;
+    *out = e->cqes[head & e->cq_mask];
+    atomic_store_explicit(e->cq_head, head + 1, memory_order_release);
+    e->inflight--;
+    return 1;
+}
+
+// Wait out everything in flight so the buffers can be reused or freed
+static void drain(UringEngine *e) {
+    struct io_uring_cqe cqe;
+    while (e->inflight > 0) {
+        while (next_completion(e, &cqe)) {}
+        if (e->inflight > 0 && submit_and_wait(e) < 0) {
+            e->broken = 1;
+            return;
+        }
+    }
+}
+
+static int refused(int res) {
+    return res == -EINVAL || res == -EOPNOTSUPP || res == -ENOSYS || res == -EBADF;
+}
+
+static void begin_session(UringEngine *e, int sock, int fd) {
+    memset(e->slots, 0, sizeof(e->slots));
+    e->sock = sock;
+    e->file = fd;
+    e->next_fill = 0;
+    e->next_drain = 0;
+    e->socket_busy = 0;
+    e->moved = 0;
+    e->failed = 0;
+    e->write_failed = NULL;
+}
+
+// A chunk could not be moved; stop, with the buffers idle again
+static int fail_session(UringEngine *e, int status) {
+    e->failed = 1;
+    drain(e);
+    return status;
+}
+
+// Start sending [offset, end) of fd; the bytes go out through uring_send_chunk()
+void uring_send_begin(UringEngine *e, int sock, int fd, off_t offset, off_t end) {
+    begin_session(e, sock, fd);
+    e->read_pos = offset;
+    e->end = end;
+}
+
+// Read ahead into every free slot, in file order
+static void queue_reads(UringEngine *e) {
+    while (e->slots[e->next_fill].state == SLOT_FREE && e->read_pos < e->end) {
+        Slot *s = &e->slots[e->next_fill];
+        s->len = e->end - e->read_pos < URING_BUFFER_SIZE ? (size_t)(e->end - e->read_pos) : URING_BUFFER_SIZE;
+        s->file_offset = e->read_pos;
+        s->done = 0;
+        s->drained = 0;
+        s->state = SLOT_FILLING;
+        queue_op(e, IORING_OP_READ_FIXED, e->file, e->next_fill, 0, s->len, e->read_pos, OP_FILL);
+        e->read_pos += s->len;
+        e->next_fill = (e->next_fill + 1) % URING_BUFFERS;
+    }
+}
+
+/*
+ * Put the next len bytes of the range on the socket. Slots go out strictly
+ * in file order, one socket write at a time, and a slot that straddles the
+ * end of the chunk keeps its remainder for the next one. Reads of later
+ * slots stay in flight when this returns.
+ */
+int uring_send_chunk(UringEngine *e, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        queue_reads(e);
+        Slot *head = &e->slots[e->next_drain];
+        if (!e->socket_busy && head->state == SLOT_FULL) {
+            size_t want = head->len - head->drained;
+            if (want > len - sent) want = len - sent;
+            head->state = SLOT_DRAINING;
+            queue_socket_op(e, IORING_OP_WRITE_FIXED, e->sock, e->next_drain, head->drained, want, OP_DRAIN);
+            e->socket_busy = 1;
+        } else if (e->inflight == 0) {
+            return fail_session(e, URING_ERROR);    // Asked for more than the range holds
+        }
+
+        if (submit_and_wait(e) < 0) return fail_session(e, URING_ERROR);
+        struct io_uring_cqe cqe;
+        while (next_completion(e, &cqe)) {
+            int index = cqe.user_data >> 1;
+            Slot *s = &e->slots[index];
+            if (cqe.res < 0 && e->moved == 0 && refused(cqe.res)) return fail_session(e, URING_UNSUPPORTED);
+            // Socket error, or the file shrank under us
+            if (cqe.res <= 0) return fail_session(e, URING_ERROR);
+
+            if ((cqe.user_data & 1) == OP_FILL) {
+                s->done += cqe.res;
+                if (s->done < s->len) {
+                    queue_op(e, IORING_OP_READ_FIXED, e->file, index, s->done, s->len - s->done,
+                             s->file_offset + s->done, OP_FILL);
+                } else {
+                    s->state = SLOT_FULL;
+                }
+            } else {
+                s->drained += cqe.res;
+                e->moved += cqe.res;
+                sent += cqe.res;
+                e->socket_busy = 0;
+                if (s->drained < s->len) {
+                    s->state = SLOT_FULL;
+                } else {
+                    s->state = SLOT_FREE;
+                    e->next_drain = (e->next_drain + 1) % URING_BUFFERS;
+                }
+            }
+        }
+    }
+    return URING_OK;
+}
+
+/*
+ * Start receiving a body into fd at offset, chunk by chunk through
+ * uring_receive_chunk(). A failed file write sets *write_failed, possibly
+ * only once uring_finish() collects it; the stream is still consumed.
+ */
+void uring_receive_begin(UringEngine *e, int sock, int fd, off_t offset, int *write_failed) {
+    begin_session(e, sock, fd);
+    e->write_pos = offset;
+    e->write_failed = write_failed;
+}
+
+// Account for a file write; a short one is resumed where it stopped
+static void write_completed(UringEngine *e, int index, int res) {
+    Slot *s = &e->slots[index];
+    if (res <= 0) {
+        *e->write_failed = 1;
+        s->drained = s->len;
+    } else {
+        s->drained += res;
+    }
+    if (s->drained < s->len) {
+        queue_op(e, IORING_OP_WRITE_FIXED, e->file, index, s->drained, s->len - s->drained,
+                 s->file_offset + s->drained, OP_DRAIN);
+    } else {
+        s->state = SLOT_FREE;
+    }
+}
+
+/*
+ * Take the next len bytes off the socket. One socket read is in flight at a
+ * time and fills a slot before the next is started; full slots are written
+ * to the file concurrently, and those writes may still be running when
+ * this returns.
+ */
+int uring_receive_chunk(UringEngine *e, size_t len) {
+    size_t assigned = 0;        // Bytes of the chunk given to a slot so far
+    size_t got = 0;             // Bytes of the chunk taken off the socket
+    while (got < len) {
+        Slot *s = &e->slots[e->next_fill];
+        if (!e->socket_busy && assigned < len && s->state == SLOT_FREE) {
+            s->len = len - assigned < URING_BUFFER_SIZE ? len - assigned : URING_BUFFER_SIZE;
+            s->file_offset = e->write_pos + assigned;
+            s->done = 0;
+            s->drained = 0;
+            s->state = SLOT_FILLING;
+            queue_socket_op(e, IORING_OP_READ_FIXED, e->sock, e->next_fill, 0, s->len, OP_FILL);
+            assigned += s->len;
+            e->socket_busy = 1;
+        }
+
+        if (submit_and_wait(e) < 0) return fail_session(e, URING_ERROR);
+        struct io_uring_cqe cqe;
+        while (next_completion(e, &cqe)) {
+            int index = cqe.user_data >> 1;
+            Slot *c = &e->slots[index];
+            if ((cqe.user_data & 1) == OP_DRAIN) {
+                write_completed(e, index, cqe.res);
+                continue;
+            }
+            if (cqe.res < 0 && e->moved == 0 && refused(cqe.res)) return fail_session(e, URING_UNSUPPORTED);
+            // Reset, or closed mid-chunk
+            if (cqe.res <= 0) return fail_session(e, URING_ERROR);
+
+            c->done += cqe.res;
+            e->moved += cqe.res;
+            got += cqe.res;
+            if (c->done < c->len) {
+                queue_socket_op(e, IORING_OP_READ_FIXED, e->sock, index, c->done, c->len - c->done, OP_FILL);
+                continue;
+            }
+            e->socket_busy = 0;
+            e->next_fill = (e->next_fill + 1) % URING_BUFFERS;
+            if (*e->write_failed) {
+                c->state = SLOT_FREE;
+            } else {
+                c->state = SLOT_DRAINING;
+                queue_op(e, IORING_OP_WRITE_FIXED, e->file, index, 0, c->len, c->file_offset, OP_DRAIN);
+            }
+        }
+    }
+    e->write_pos += len;
+    return URING_OK;
+}
+
+/*
+ * End the session: reads a send queued past its last chunk are discarded,
+ * and a receive's file writes are waited for so every failure is reported.
+ */
+void uring_finish(UringEngine *e) {
+    if (e->failed || !e->write_failed) {
+        drain(e);
+        return;
+    }
+    struct io_uring_cqe cqe;
+    while (e->inflight > 0) {
+        while (next_completion(e, &cqe)) write_completed(e, cqe.user_data >> 1, cqe.res);
+        if (e->inflight > 0 && submit_and_wait(e) < 0) {
+            e->broken = 1;
+            return;
+        }
+    }
+}
+
+#else
+
+// Built without IO_URING=1: transfers always use sendfile() and splice()
+UringEngine *uring_engine() {
+    return NULL;
+}
+
+void uring_send_begin(UringEngine *engine, int sock, int fd, off_t offset, off_t end) {
+    (void)engine; (void)sock; (void)fd; (void)offset; (void)end;
+}
+
+int uring_send_chunk(UringEngine *engine, size_t len) {
+    (void)engine; (void)len;
+    return URING_UNSUPPORTED;
+}
+
+void uring_receive_begin(UringEngine *engine, int sock, int fd, off_t offset, int *write_failed) {
+    (void)engine; (void)sock; (void)fd; (void)offset; (void)write_failed;
+}
+
+int uring_receive_chunk(UringEngine *engine, size_t len) {
+    (void)engine; (void)len;
+    return URING_UNSUPPORTED;
+}
+
+void uring_finish(UringEngine *engine) {
+    (void)engine;
+}
+
+#endif
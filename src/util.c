@@ -0,0 +1,76 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "../include/util.h"
+
+/*
+ * Write all of buf to a blocking socket, retrying short writes. Extra
+ * flags such as MSG_MORE are passed through. Returns 0 once every byte is
+ * written, -1 if the connection broke.
+ */
+int send_exact(int sock, const void *buf, size_t len, int flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Write every buffer of iov to a blocking socket with sendmsg(), so small
+ * pieces such as a header and its payload leave together. A short write
+ * leaves the rest of the vector for the next call; iov is consumed in the
+ * process. Returns 0 once every byte is written, -1 if the connection broke.
+ */
+int sendmsg_exact(int sock, struct iovec *iov, int iovcnt, int flags) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        ssize_t n = sendmsg(sock, &msg, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len) {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read exactly len bytes from a blocking socket. MSG_WAITALL can still
+ * return early, e.g. when a signal arrives after some data, so partial
+ * reads are resumed. Returns -1 on error, early close, or when an
+ * SO_RCVTIMEO timeout expires.
+ */
+int recv_exact(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Milliseconds on the monotonic clock, for deadlines and intervals
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,247 @@
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include "../include/wire.h"
+#include "../include/util.h"
+#include "../include/app.h"
+
+size_t wire_put_varint(unsigned char *p, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    p[n++] = (unsigned char)value;
+    return n;
+}
+
+// Read one varint from [*p, end); -1 if it is cut off or longer than 64 bits
+int wire_get_varint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char byte = *(*p)++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t wire_encode_hello(unsigned char *buf) {
+    size_t name_len = strnlen(app_state.local_username, USERNAME_LEN - 1);
+    memcpy(buf, WIRE_MAGIC, 4);
+    buf[4] = WIRE_VERSION;
+    size_t body = wire_put_varint(buf + WIRE_HELLO_PREFIX, FILE_CAPS_SUPPORTED);
+    memcpy(buf + WIRE_HELLO_PREFIX + body, app_state.local_username, name_len);
+    buf[5] = (unsigned char)(body + name_len);
+    return WIRE_HELLO_PREFIX + body + name_len;
+}
+
+/*
+ * Parse a hello assembled in buf. Returns 0 once it is complete, the total
+ * number of bytes needed while it is not, or -1 if it is not a Lume hello.
+ */
+int wire_parse_hello(const unsigned char *buf, size_t len, WireHello *hello) {
+    if (len < WIRE_HELLO_PREFIX) return WIRE_HELLO_PREFIX;
+    if (memcmp(buf, WIRE_MAGIC, 4) != 0 || buf[4] == 0) return -1;
+    size_t total = WIRE_HELLO_PREFIX + buf[5];
+    if (len < total) return (int)total;
+
+    const unsigned char *p = buf + WIRE_HELLO_PREFIX;
+    const unsigned char *end = buf + total;
+    uint64_t caps;
+    if (wire_get_varint(&p, end, &caps) < 0) return -1;
+    size_t name_len = (size_t)(end - p);
+    if (name_len == 0 || name_len >= USERNAME_LEN || memchr(p, '\0', name_len)) return -1;
+
+    hello->version = buf[4] < WIRE_VERSION ? buf[4] : WIRE_VERSION;
+    hello->caps = (uint32_t)caps;
+    memcpy(hello->username, p, name_len);
+    hello->username[name_len] = '\0';
+    return 0;
+}
+
+size_t wire_encode_header(unsigned char *buf, int type, size_t payload_len) {
+    buf[0] = (unsigned char)type;
+    return 1 + wire_put_varint(buf + 1, payload_len);
+}
+
+// Like wire_parse_hello(): 0 when complete, bytes needed, or -1 when invalid
+int wire_parse_header(const unsigned char *buf, size_t len, FrameHeader *header) {
+    if (len < 2) return 2;
+    if (buf[len - 1] & 0x80) return len < WIRE_HEADER_MAX ? (int)len + 1 : -1;
+
+    const unsigned char *p = buf + 1;
+    uint64_t payload_len;
+    if (wire_get_varint(&p, buf + len, &payload_len) < 0) return -1;
+    header->type = buf[0];
+    header->payload_len = (size_t)payload_len;
+    return 0;
+}
+
+size_t wire_encode_beacon(unsigned char *buf, int kind) {
+    size_t name_len = strnlen(app_state.local_username, USERNAME_LEN - 1);
+    memcpy(buf, WIRE_MAGIC, 4);
+    buf[4] = WIRE_VERSION;
+    buf[5] = (unsigned char)kind;
+    size_t n = WIRE_HELLO_PREFIX + wire_put_varint(buf + WIRE_HELLO_PREFIX, (uint64_t)app_state.local_tcp_port);
+    memcpy(buf + n, app_state.local_username, name_len);
+    return n + name_len;
+}
+
+// 0 for a well-formed datagram of a kind we know, -1 otherwise
+int wire_parse_beacon(const unsigned char *buf, size_t len, WireBeacon *beacon) {
+    if (len < WIRE_HELLO_PREFIX || memcmp(buf, WIRE_MAGIC, 4) != 0 || buf[4] == 0) return -1;
+    if (buf[5] != WIRE_BEACON_ANNOUNCE && buf[5] != WIRE_BEACON_SOLICIT) return -1;
+
+    const unsigned char *p = buf + WIRE_HELLO_PREFIX;
+    const unsigned char *end = buf + len;
+    uint64_t port;
+    if (wire_get_varint(&p, end, &port) < 0 || port == 0 || port > 65535) return -1;
+    size_t name_len = (size_t)(end - p);
+    if (name_len == 0 || name_len >= USERNAME_LEN || memchr(p, '\0', name_len)) return -1;
+
+    beacon->kind = buf[5];
+    beacon->tcp_port = (int)port;
+    memcpy(beacon->username, p, name_len);
+    beacon->username[name_len] = '\0';
+    return 0;
+}
+
+size_t wire_encode_offer(unsigned char *buf, const FileMetadata *meta) {
+    size_t name_len = strnlen(meta->filename, sizeof(meta->filename) - 1);
+    size_t n = 0;
+    n += wire_put_varint(buf + n, meta->file_size);
+    n += wire_put_varint(buf + n, meta->flags);
+    n += wire_put_varint(buf + n, meta->streams);
+    n += wire_put_varint(buf + n, meta->transfer_id);
+    n += wire_put_varint(buf + n, name_len);
+    memcpy(buf + n, meta->filename, name_len);
+    return n + name_len;
+}
+
+int wire_decode_offer(const unsigned char *buf, size_t len, FileMetadata *meta) {
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + len;
+    uint64_t size, flags, streams, id, name_len;
+    if (wire_get_varint(&p, end, &size) < 0 || wire_get_varint(&p, end, &flags) < 0 ||
+        wire_get_varint(&p, end, &streams) < 0 || wire_get_varint(&p, end, &id) < 0 ||
+        wire_get_varint(&p, end, &name_len) < 0) {
+        return -1;
+    }
+    if (size > SIZE_MAX || name_len == 0 || name_len >= sizeof(meta->filename) ||
+        name_len > (uint64_t)(end - p) || memchr(p, '\0', name_len)) {
+        return -1;
+    }
+
+    memset(meta, 0, sizeof(*meta));
+    meta->file_size = (size_t)size;
+    meta->flags = (uint32_t)flags;
+    meta->streams = streams > MAX_FILE_STREAMS ? MAX_FILE_STREAMS : (uint32_t)streams;
+    meta->transfer_id = id;
+    memcpy(meta->filename, p, name_len);
+    return 0;
+}
+
+size_t wire_encode_accept(unsigned char *buf, const FileAccept *accept) {
+    size_t n = 0;
+    n += wire_put_varint(buf + n, accept->flags);
+    n += wire_put_varint(buf + n, accept->prefix_crc);
+    n += wire_put_varint(buf + n, accept->resume_offset);
+    n += wire_put_varint(buf + n, accept->streams);
+    return n;
+}
+
+// An empty payload is a bare acceptance with no capabilities
+int wire_decode_accept(const unsigned char *buf, size_t len, FileAccept *accept) {
+    memset(accept, 0, sizeof(*accept));
+    if (len == 0) return 0;
+
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + len;
+    uint64_t flags, crc, offset, streams;
+    if (wire_get_varint(&p, end, &flags) < 0 || wire_get_varint(&p, end, &crc) < 0 ||
+        wire_get_varint(&p, end, &offset) < 0 || wire_get_varint(&p, end, &streams) < 0 ||
+        crc > UINT32_MAX || streams > MAX_FILE_STREAMS) {
+        return -1;
+    }
+    accept->flags = (uint32_t)flags;
+    accept->prefix_crc = (uint32_t)crc;
+    accept->resume_offset = offset;
+    accept->streams = (uint32_t)streams;
+    return 0;
+}
+
+size_t wire_encode_stripe(unsigned char *buf, const FileStripe *stripe) {
+    size_t n = wire_put_varint(buf, stripe->transfer_id);
+    return n + wire_put_varint(buf + n, stripe->index);
+}
+
+int wire_decode_stripe(const unsigned char *buf, size_t len, FileStripe *stripe) {
+    const unsigned char *p = buf;
+    const unsigned char *end = buf + len;
+    uint64_t id, index;
+    if (wire_get_varint(&p, end, &id) < 0 || wire_get_varint(&p, end, &index) < 0 ||
+        index >= MAX_FILE_STREAMS) {
+        return -1;
+    }
+    stripe->transfer_id = id;
+    stripe->index = (uint32_t)index;
+    return 0;
+}
+
+/*
+ * Send a whole frame, header and payload gathered into one sendmsg() so
+ * they leave in the same segment. Extra flags such as MSG_MORE are passed
+ * through. Returns 0 once every byte is written.
+ */
+int wire_send_frame(int sock, int type, const void *payload, size_t len, int flags) {
+    unsigned char header[WIRE_HEADER_MAX];
+    struct iovec iov[2];
+    iov[0].iov_base = header;
+    iov[0].iov_len = wire_encode_header(header, type, len);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len = len;
+    return sendmsg_exact(sock, iov, len > 0 ? 2 : 1, flags);
+}
+
+/*
+ * Exchange hellos on a freshly connected blocking socket. The peer's
+ * hello must arrive within WIRE_HANDSHAKE_TIMEOUT. Returns 0 with the
+ * peer's identity and capabilities in *peer, -1 otherwise.
+ */
+int wire_handshake(int sock, WireHello *peer) {
+    unsigned char buf[WIRE_HELLO_MAX];
+    size_t len = wire_encode_hello(buf);
+    if (send_exact(sock, buf, len, 0) < 0) return -1;
+
+    struct timeval timeout = { WIRE_HANDSHAKE_TIMEOUT, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    int need;
+    len = 0;
+    while ((need = wire_parse_hello(buf, len, peer)) > 0) {
+        if (recv_exact(sock, buf + len, (size_t)need - len) < 0) break;
+        len = (size_t)need;
+    }
+
+    struct timeval none = { 0, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    return need == 0 ? 0 : -1;
+}
+
+// Read one frame header from a blocking socket
+int wire_recv_header(int sock, FrameHeader *header) {
+    unsigned char buf[WIRE_HEADER_MAX];
+    size_t len = 0;
+    int need;
+    while ((need = wire_parse_header(buf, len, header)) > 0) {
+        if (recv_exact(sock, buf + len, (size_t)need - len) < 0) return -1;
+        len = (size_t)need;
+    }
+    return need;
+}
@@ -0,0 +1,137 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../include/workers.h"
+
+/*
+ * Fixed set of threads for jobs that block, each with its own ring of
+ * jobs. Submissions are dealt round-robin and a worker whose ring is empty
+ * steals from the others, so a job queued behind a long transfer is picked
+ * up by whichever worker frees first. The rings hold jobs by value, so
+ * submitting does not allocate.
+ */
+typedef struct {
+    WorkFn fn;
+    void *arg;
+} WorkItem;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    unsigned head;                      // Oldest job
+    unsigned tail;                      // One past the newest
+    WorkItem items[WORKER_QUEUE_LEN];
+} WorkQueue;
+
+static WorkQueue *queues = NULL;
+static int worker_count = 0;
+static unsigned next_queue = 0;         // Only the submitting thread deals jobs
+
+// Jobs in any ring; raised before a push so sleepers never miss one
+static atomic_int queued = 0;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static int pop_job(WorkQueue *q, WorkItem *out) {
+    pthread_mutex_lock(&q->mutex);
+    int found = q->head != q->tail;
+    if (found) {
+        *out = q->items[q->head % WORKER_QUEUE_LEN];
+        q->head++;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return found;
+}
+
+static int push_job(WorkQueue *q, WorkFn fn, void *arg) {
+    pthread_mutex_lock(&q->mutex);
+    int room = q->tail - q->head < WORKER_QUEUE_LEN;
+    if (room) {
+        q->items[q->tail % WORKER_QUEUE_LEN] = (WorkItem){fn, arg};
+        q->tail++;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return room;
+}
+
+// Own ring first, then the others in turn
+static int take_job(int self, WorkItem *out) {
+    for (int i = 0; i < worker_count; i++) {
+        if (pop_job(&queues[(self + i) % worker_count], out)) {
+            atomic_fetch_sub(&queued, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    int self = (int)(intptr_t)arg;
+    while (1) {
+        WorkItem item;
+        if (take_job(self, &item)) {
+            item.fn(item.arg);
+            continue;
+        }
+        pthread_mutex_lock(&idle_mutex);
+        while (atomic_load(&queued) == 0) {
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        }
+        pthread_mutex_unlock(&idle_mutex);
+    }
+    return NULL;
+}
+
+// Start up to count workers; returns how many are running
+int init_workers(int count) {
+    if (count < 1) count = 1;
+    if (count > WORKER_THREADS_MAX) count = WORKER_THREADS_MAX;
+
+    queues = calloc(count, sizeof(WorkQueue));
+    if (!queues) return 0;
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_init(&queues[i].mutex, NULL);
+    }
+
+    // Workers index the queues, so they only start once all exist. Rings of
+    // workers that failed to start are still drained by stealing.
+    worker_count = count;
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, (void *)(intptr_t)i) != 0) break;
+        pthread_detach(tid);
+        started++;
+    }
+    if (started == 0) worker_count = 0;
+    return started;
+}
+
+/*
+ * Queue a job. Must be called from a single thread (the reactor). Returns
+ * -1 if every ring is full or no worker could be started; the caller keeps
+ * the job and tries again later.
+ */
+int workers_submit(WorkFn fn, void *arg) {
+    atomic_fetch_add(&queued, 1);
+    for (int i = 0; i < worker_count; i++) {
+        WorkQueue *q = &queues[next_queue++ % worker_count];
+        if (push_job(q, fn, arg)) {
+            pthread_mutex_lock(&idle_mutex);
+            pthread_cond_signal(&idle_cond);
+            pthread_mutex_unlock(&idle_mutex);
+            return 0;
+        }
+    }
+    atomic_fetch_sub(&queued, 1);
+    return -1;
+}
+
+int workers_count() {
+    return worker_count;
+}
+
+// Whether enough jobs wait that taking on more connections would only add to the queue
+int workers_saturated() {
+    return worker_count > 0 && atomic_load(&queued) >= worker_count * WORKER_BACKLOG;
+}